@@ -0,0 +1,334 @@
+#include "buffered_open.h"
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Record sizes and buffer sizes every reader and writer is measured with
+static const size_t record_sizes[] = { 16, 256, 4096, 65536 };
+static const size_t buffer_sizes[] = { 4096, 65536, 1024 * 1024 };
+#define RECORD_SIZE_COUNT (sizeof(record_sizes) / sizeof(record_sizes[0]))
+#define BUFFER_SIZE_COUNT (sizeof(buffer_sizes) / sizeof(buffer_sizes[0]))
+
+// File sizes the O_PREAPPEND cost is measured at, up to the -m size
+static const size_t prepend_file_sizes[] = { 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024,
+                                             256 * 1024 * 1024 };
+#define PREPEND_SIZE_COUNT (sizeof(prepend_file_sizes) / sizeof(prepend_file_sizes[0]))
+
+// The three ways a file is read or written
+enum { VARIANT_RAW, VARIANT_STDIO, VARIANT_BUFFERED, VARIANT_COUNT };
+static const char *variant_names[] = { "syscall", "stdio", "buffered" };
+
+void print_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [-m megabytes] [-r runs] <work_directory>\n", prog_name);
+    fprintf(stderr, "  -m: Bytes read and written per measurement in MiB, and largest O_PREAPPEND file (default 64)\n");
+    fprintf(stderr, "  -r: Runs per measurement, the best one is reported (default 3)\n");
+}
+
+// Function to write total bytes to path in records of the given size. Every record's latency is the
+// time since the previous one ended, so one clock read per record is all the timing costs. Returns
+// the elapsed seconds, including the final flush and close, or -1 on failure.
+static double run_write(int variant, const char *path, size_t record, size_t buffer, size_t total,
+                        const char *data, bench_latency_t *latency) {
+    size_t records = total / record;
+    double start = now_seconds();
+    double previous = start;
+
+    if (variant == VARIANT_RAW) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("open");
+            return -1;
+        }
+        for (size_t i = 0; i < records; i++) {
+            if (write(fd, data, record) != (ssize_t)record) {
+                perror("write");
+                close(fd);
+                return -1;
+            }
+            double now = now_seconds();
+            bench_latency_add(latency, now - previous);
+            previous = now;
+        }
+        close(fd);
+    } else if (variant == VARIANT_STDIO) {
+        FILE *file = fopen(path, "w");
+        if (!file) {
+            perror("fopen");
+            return -1;
+        }
+        setvbuf(file, NULL, _IOFBF, buffer);
+        for (size_t i = 0; i < records; i++) {
+            if (fwrite(data, 1, record, file) != record) {
+                perror("fwrite");
+                fclose(file);
+                return -1;
+            }
+            double now = now_seconds();
+            bench_latency_add(latency, now - previous);
+            previous = now;
+        }
+        if (fclose(file) != 0) {
+            perror("fclose");
+            return -1;
+        }
+    } else {
+        buffered_options_t options;
+        buffered_options_init(&options);
+        options.write_buffer_size = buffer;
+        buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &options);
+        if (!bf) {
+            perror("buffered_open_ex");
+            return -1;
+        }
+        for (size_t i = 0; i < records; i++) {
+            if (buffered_write(bf, data, record) != (ssize_t)record) {
+                perror("buffered_write");
+                buffered_close(bf);
+                return -1;
+            }
+            double now = now_seconds();
+            bench_latency_add(latency, now - previous);
+            previous = now;
+        }
+        if (buffered_close(bf) == -1) {
+            perror("buffered_close");
+            return -1;
+        }
+    }
+    return now_seconds() - start;
+}
+
+// Function to read path to the end in records of the given size, timed like run_write. Returns the
+// elapsed seconds or -1 on failure; *bytes receives the bytes read.
+static double run_read(int variant, const char *path, size_t record, size_t buffer, char *data,
+                       bench_latency_t *latency, size_t *bytes) {
+    double start = now_seconds();
+    double previous = start;
+    ssize_t n;
+    *bytes = 0;
+
+    if (variant == VARIANT_RAW) {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            perror("open");
+            return -1;
+        }
+        while ((n = read(fd, data, record)) > 0) {
+            *bytes += (size_t)n;
+            double now = now_seconds();
+            bench_latency_add(latency, now - previous);
+            previous = now;
+        }
+        close(fd);
+    } else if (variant == VARIANT_STDIO) {
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            perror("fopen");
+            return -1;
+        }
+        setvbuf(file, NULL, _IOFBF, buffer);
+        while ((n = (ssize_t)fread(data, 1, record, file)) > 0) {
+            *bytes += (size_t)n;
+            double now = now_seconds();
+            bench_latency_add(latency, now - previous);
+            previous = now;
+        }
+        fclose(file);
+    } else {
+        buffered_options_t options;
+        buffered_options_init(&options);
+        options.read_buffer_size = buffer;
+        buffered_file_t *bf = buffered_open_ex(path, O_RDONLY, 0, &options);
+        if (!bf) {
+            perror("buffered_open_ex");
+            return -1;
+        }
+        while ((n = buffered_read(bf, data, record)) > 0) {
+            *bytes += (size_t)n;
+            double now = now_seconds();
+            bench_latency_add(latency, now - previous);
+            previous = now;
+        }
+        buffered_close(bf);
+    }
+    if (n == -1) {
+        perror("read");
+        return -1;
+    }
+    return now_seconds() - start;
+}
+
+// Function to measure one writer or reader at one record and buffer size and print its row
+static int measure(int reading, int variant, const char *path, size_t record, size_t buffer, size_t total,
+                   int runs, char *data) {
+    bench_latency_t latency;
+    if (bench_latency_init(&latency) == -1) {
+        perror("malloc");
+        return -1;
+    }
+
+    double best = 0;
+    unsigned long long syscalls = 0;
+    size_t bytes = (total / record) * record;
+    for (int run = 0; run < runs; run++) {
+        bench_io_t io;
+        bench_io_read(&io);
+        double elapsed = reading ? run_read(variant, path, record, buffer, data, &latency, &bytes)
+                                 : run_write(variant, path, record, buffer, total, data, &latency);
+        syscalls += bench_io_since(&io);
+        if (elapsed < 0) {
+            bench_latency_free(&latency);
+            return -1;
+        }
+        if (run == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    // Raw system calls do not go through a buffer, so they get a single row per record size
+    char test_case[64];
+    snprintf(test_case, sizeof(test_case), "record=%zu/buffer=%zu", record, variant == VARIANT_RAW ? 0 : buffer);
+    bench_report(reading ? "read" : "write", variant_names[variant], test_case, (double)bytes,
+                 (double)(bytes / record), best, (double)syscalls / runs, &latency);
+    bench_latency_free(&latency);
+    return 0;
+}
+
+// Function to fill path with size bytes of data, written in the largest record size
+static int write_file(const char *path, size_t size, const char *data) {
+    size_t chunk = record_sizes[RECORD_SIZE_COUNT - 1];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    for (size_t written = 0; written < size; written += chunk) {
+        if (write(fd, data, chunk) != (ssize_t)chunk) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to measure putting header_size bytes in front of a file of file_size bytes with O_PREAPPEND
+static int measure_prepend(const char *path, size_t file_size, size_t header_size, int runs, const char *data) {
+    if (write_file(path, file_size, data) == -1) {
+        return -1;
+    }
+
+    bench_latency_t latency;
+    if (bench_latency_init(&latency) == -1) {
+        perror("malloc");
+        return -1;
+    }
+    double best = 0;
+    unsigned long long syscalls = 0;
+    prepend_method_t method = PREPEND_NONE;
+    for (int run = 0; run < runs; run++) {
+        bench_io_t io;
+        bench_io_read(&io);
+        double start = now_seconds();
+        buffered_file_t *bf = buffered_open(path, O_WRONLY | O_PREAPPEND);
+        if (!bf || buffered_write(bf, data, header_size) != (ssize_t)header_size || buffered_flush(bf) == -1) {
+            perror("O_PREAPPEND write");
+            if (bf) {
+                buffered_close(bf);
+            }
+            bench_latency_free(&latency);
+            return -1;
+        }
+        method = buffered_prepend_method(bf);
+        buffered_close(bf);
+        double elapsed = now_seconds() - start;
+        syscalls += bench_io_since(&io);
+        bench_latency_add(&latency, elapsed);
+        if (run == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    // The bytes column is the size of the file the data went in front of, since that is what a
+    // rewrite has to move
+    static const char *method_names[] = { "none", "plain", "insert_range", "rewrite" };
+    char variant[32];
+    char test_case[64];
+    snprintf(variant, sizeof(variant), "prepend_%zuB", header_size);
+    snprintf(test_case, sizeof(test_case), "file=%zu/method=%s", file_size, method_names[method]);
+    bench_report("prepend", variant, test_case, (double)file_size, 1, best, (double)syscalls / runs, &latency);
+    bench_latency_free(&latency);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    size_t megabytes = 64;
+    int runs = 3;
+
+    while ((opt = getopt(argc, argv, "m:r:")) != -1) {
+        switch (opt) {
+            case 'm':
+                megabytes = (size_t)atol(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc || megabytes == 0 || runs <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_buffered.dat", argv[optind]);
+    size_t total = megabytes * 1024 * 1024;
+    char *data = malloc(record_sizes[RECORD_SIZE_COUNT - 1]);
+    if (!data) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < record_sizes[RECORD_SIZE_COUNT - 1]; i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+
+    // Files stay in the page cache, so these measure the cost of the calls rather than of the device
+    int status = 0;
+    bench_report_header();
+    for (int reading = 0; reading <= 1 && status == 0; reading++) {
+        if (reading) {
+            // Every reader goes through the same file, written in one piece
+            status = write_file(path, total, data);
+        }
+        for (size_t r = 0; r < RECORD_SIZE_COUNT && status == 0; r++) {
+            for (int variant = 0; variant < VARIANT_COUNT && status == 0; variant++) {
+                for (size_t b = 0; b < BUFFER_SIZE_COUNT && status == 0; b++) {
+                    if (variant == VARIANT_RAW && b > 0) {
+                        break;
+                    }
+                    status = measure(reading, variant, path, record_sizes[r], buffer_sizes[b], total, runs, data);
+                }
+            }
+        }
+    }
+
+    for (size_t s = 0; s < PREPEND_SIZE_COUNT && status == 0 && prepend_file_sizes[s] <= total; s++) {
+        // 100 bytes has to move the contents; a whole block can use FALLOC_FL_INSERT_RANGE
+        status = measure_prepend(path, prepend_file_sizes[s], 100, runs, data);
+        if (status == 0) {
+            status = measure_prepend(path, prepend_file_sizes[s], 4096, runs, data);
+        }
+    }
+
+    unlink(path);
+    free(data);
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,129 @@
+// bench_common.h
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+// Helpers shared by the benchmark programs: timing, system call counts and latency percentiles,
+// and the CSV rows every benchmark prints. Each benchmark is a single file, so these are static.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Latency samples kept per measurement; beyond that every other sample is dropped and the rate halved
+#define BENCH_MAX_SAMPLES (1 << 20)
+
+// Read and write system calls made by the process so far
+typedef struct {
+    unsigned long long syscr;   // read-like calls (read, pread, readv, sendfile, copy_file_range, ...)
+    unsigned long long syscw;   // write-like calls
+} bench_io_t;
+
+// Latencies of the operations of one measurement, in seconds
+typedef struct {
+    double *samples;
+    size_t count;
+    unsigned long long calls;   // Operations seen, sampled or not
+    unsigned stride;            // Every stride-th operation is kept
+} bench_latency_t;
+
+// Function to return the current monotonic time in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to read the system call counters of the process from /proc/self/io. Without procfs
+// they stay 0 and the syscalls_per_mb column reads 0.
+static void bench_io_read(bench_io_t *io) {
+    memset(io, 0, sizeof(*io));
+    FILE *file = fopen("/proc/self/io", "r");
+    if (!file) {
+        return;
+    }
+    char name[64];
+    unsigned long long value;
+    while (fscanf(file, "%63[^:]: %llu\n", name, &value) == 2) {
+        if (strcmp(name, "syscr") == 0) {
+            io->syscr = value;
+        } else if (strcmp(name, "syscw") == 0) {
+            io->syscw = value;
+        }
+    }
+    fclose(file);
+}
+
+// Function to return the read and write system calls made since start
+static unsigned long long bench_io_since(const bench_io_t *start) {
+    bench_io_t end;
+    bench_io_read(&end);
+    return (end.syscr - start->syscr) + (end.syscw - start->syscw);
+}
+
+// Function to start an empty set of latency samples. Returns -1 if no memory is left.
+static int bench_latency_init(bench_latency_t *latency) {
+    latency->samples = malloc(BENCH_MAX_SAMPLES * sizeof(double));
+    latency->count = 0;
+    latency->calls = 0;
+    latency->stride = 1;
+    return latency->samples ? 0 : -1;
+}
+
+// Function to record the latency of one operation
+static void bench_latency_add(bench_latency_t *latency, double seconds) {
+    if (latency->calls++ % latency->stride != 0) {
+        return;
+    }
+    if (latency->count == BENCH_MAX_SAMPLES) {
+        // Keep every other sample so the set still spans the whole measurement
+        for (size_t i = 0; i < BENCH_MAX_SAMPLES / 2; i++) {
+            latency->samples[i] = latency->samples[i * 2];
+        }
+        latency->count = BENCH_MAX_SAMPLES / 2;
+        latency->stride *= 2;
+    }
+    latency->samples[latency->count++] = seconds;
+}
+
+// Function to order samples for bench_latency_percentile
+static int bench_compare_doubles(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+// Function to return the given percentile (0-100) of the samples in seconds. Sorts the samples.
+static double bench_latency_percentile(bench_latency_t *latency, double percentile) {
+    if (latency->count == 0) {
+        return 0;
+    }
+    qsort(latency->samples, latency->count, sizeof(double), bench_compare_doubles);
+    size_t index = (size_t)(percentile / 100.0 * (double)(latency->count - 1) + 0.5);
+    return latency->samples[index];
+}
+
+// Function to release the samples
+static void bench_latency_free(bench_latency_t *latency) {
+    free(latency->samples);
+    latency->samples = NULL;
+}
+
+// Function to print the header of the CSV rows printed by bench_report
+static void bench_report_header(void) {
+    printf("bench,variant,case,bytes,ops,seconds,mb_per_s,ops_per_s,syscalls_per_mb,p50_us,p99_us\n");
+}
+
+// Function to print one measurement as a CSV row. bytes and ops are per run and seconds is the best
+// run; syscalls are per run as well. The percentiles cover the operations of every run.
+static void bench_report(const char *bench, const char *variant, const char *test_case, double bytes,
+                         double ops, double seconds, double syscalls, bench_latency_t *latency) {
+    double megabytes = bytes / (1024 * 1024);
+    printf("%s,%s,%s,%.0f,%.0f,%.6f,%.2f,%.1f,%.2f,%.3f,%.3f\n", bench, variant, test_case, bytes, ops,
+           seconds, seconds > 0 ? megabytes / seconds : 0.0, seconds > 0 ? ops / seconds : 0.0,
+           megabytes > 0 ? syscalls / megabytes : 0.0, bench_latency_percentile(latency, 50) * 1e6,
+           bench_latency_percentile(latency, 99) * 1e6);
+    fflush(stdout);
+}
+
+#endif // BENCH_COMMON_H
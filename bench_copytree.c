@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include "copytree.h"
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <ftw.h>
+#include <linux/limits.h>
+
+// Files placed in each generated subdirectory
+#define FILES_PER_DIR 100
+
+// Files in the "huge" tree, and files per level of the "deep" tree
+#define HUGE_FILES 4
+#define DEEP_FILES_PER_LEVEL 4
+
+// Files in the "sparse" tree, with one 4 KiB block of data per SPARSE_STRIDE bytes
+#define SPARSE_FILES 16
+#define SPARSE_STRIDE (1024 * 1024)
+#define SPARSE_DATA 4096
+
+// Shapes of the generated source tree
+enum { TREE_TINY, TREE_HUGE, TREE_DEEP, TREE_SPARSE, TREE_COUNT };
+static const char *tree_names[] = { "tiny", "huge", "deep", "sparse" };
+
+// Sizes of the generated trees, set from the command line
+typedef struct {
+    int files;                  // Files in the tiny tree
+    size_t file_size;           // Size of each tiny and deep file
+    size_t huge_size;           // Size of each huge file
+    int depth;                  // Levels of the deep tree
+    size_t sparse_size;         // Apparent size of each sparse file
+} tree_params_t;
+
+void print_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [-n files] [-s file_size] [-H huge_mb] [-d depth] [-t trees] [-j threads] [-r runs] [-c] <work_directory>\n", prog_name);
+    fprintf(stderr, "  -n: Number of files in the tiny tree (default 10000)\n");
+    fprintf(stderr, "  -s: Size of every tiny and deep file in bytes (default 4096)\n");
+    fprintf(stderr, "  -H: Size of each of the %d huge files in MiB (default 64), also the apparent size of the sparse files\n", HUGE_FILES);
+    fprintf(stderr, "  -d: Levels of the deep tree (default 256)\n");
+    fprintf(stderr, "  -t: Comma-separated trees to copy: tiny, huge, deep, sparse (default all)\n");
+    fprintf(stderr, "  -j: Worker threads for the parallel engines (default: every CPU)\n");
+    fprintf(stderr, "  -r: Runs per engine, the best one is reported (default 3)\n");
+    fprintf(stderr, "  -c: Drop the source tree from the page cache before every run\n");
+}
+
+// Function to create a file of size bytes. A sparse file only gets SPARSE_DATA bytes of data every
+// SPARSE_STRIDE bytes; the rest are holes.
+static int write_file(const char *path, size_t size, const char *data, size_t data_size, int sparse) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    size_t step = sparse ? SPARSE_STRIDE : data_size;
+    for (size_t offset = 0; offset < size; offset += step) {
+        size_t len = size - offset < data_size ? size - offset : data_size;
+        if (sparse && len > SPARSE_DATA) {
+            len = SPARSE_DATA;
+        }
+        if (pwrite(fd, data, len, (off_t)offset) != (ssize_t)len) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+    }
+    if (ftruncate(fd, (off_t)size) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to generate a source tree of the given shape. *files and *bytes receive the number of
+// files and their total apparent size.
+static int generate_tree(const char *root, int tree, const tree_params_t *params, long *files, double *bytes) {
+    char path[PATH_MAX];
+    size_t data_size = 1024 * 1024;
+    char *data = malloc(data_size);
+    if (!data) {
+        return -1;
+    }
+    for (size_t i = 0; i < data_size; i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+
+    int result = 0;
+    *files = 0;
+    *bytes = 0;
+    if (mkdir(root, 0755) == -1) {
+        perror("mkdir");
+        free(data);
+        return -1;
+    }
+    if (tree == TREE_TINY) {
+        // Many small files spread over subdirectories
+        for (int i = 0; i < params->files && result == 0; i++) {
+            if (i % FILES_PER_DIR == 0) {
+                if (snprintf(path, sizeof(path), "%s/d%d", root, i / FILES_PER_DIR) >= (int)sizeof(path)) {
+                    fprintf(stderr, "Path too long under %s\n", root);
+                    result = -1;
+                    break;
+                }
+                if (mkdir(path, 0755) == -1) {
+                    perror("mkdir");
+                    result = -1;
+                    break;
+                }
+            }
+            if (snprintf(path, sizeof(path), "%s/d%d/f%d", root, i / FILES_PER_DIR, i) >= (int)sizeof(path)) {
+                fprintf(stderr, "Path too long under %s\n", root);
+                result = -1;
+                break;
+            }
+            result = write_file(path, params->file_size, data, data_size, 0);
+            *bytes += (double)params->file_size;
+        }
+        *files = params->files;
+    } else if (tree == TREE_HUGE || tree == TREE_SPARSE) {
+        // A few large files, dense or mostly holes
+        int count = tree == TREE_HUGE ? HUGE_FILES : SPARSE_FILES;
+        size_t size = tree == TREE_HUGE ? params->huge_size : params->sparse_size;
+        for (int i = 0; i < count && result == 0; i++) {
+            if (snprintf(path, sizeof(path), "%s/f%d", root, i) >= (int)sizeof(path)) {
+                fprintf(stderr, "Path too long under %s\n", root);
+                result = -1;
+                break;
+            }
+            result = write_file(path, size, data, data_size, tree == TREE_SPARSE);
+            *bytes += (double)size;
+        }
+        *files = count;
+    } else {
+        // One chain of nested directories with a few files on every level
+        size_t len = (size_t)snprintf(path, sizeof(path), "%s", root);
+        if (len >= sizeof(path)) {
+            fprintf(stderr, "Path too long under %s\n", root);
+            result = -1;
+        }
+        for (int level = 0; level < params->depth && result == 0; level++) {
+            for (int i = 0; i < DEEP_FILES_PER_LEVEL && result == 0; i++) {
+                if (snprintf(path + len, sizeof(path) - len, "/f%d", i) >= (int)(sizeof(path) - len)) {
+                    fprintf(stderr, "Path too long under %s\n", root);
+                    result = -1;
+                    break;
+                }
+                result = write_file(path, params->file_size, data, data_size, 0);
+                *bytes += (double)params->file_size;
+                (*files)++;
+            }
+            if (result == -1 || len + sizeof("/n/f") + 10 > sizeof(path)) {
+                break; // Deep enough for PATH_MAX once the next level's file names would not fit
+            }
+            len += (size_t)snprintf(path + len, sizeof(path) - len, "/n");
+            if (mkdir(path, 0755) == -1) {
+                perror("mkdir");
+                result = -1;
+            }
+        }
+    }
+    free(data);
+    return result;
+}
+
+// Function to remove a generated or copied tree
+static void remove_tree(const char *path) {
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf '%s'", path);
+    if (system(command) != 0) {
+        fprintf(stderr, "Failed to remove %s\n", path);
+    }
+}
+
+// Function to drop one file of the source tree from the page cache
+static int evict_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type == FTW_F) {
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+// Function to start a run with a cold cache. Dropping the whole page cache, dentries and inodes
+// included, needs root; otherwise the data of every source file is dropped on its own.
+static void drop_caches(const char *src) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd != -1) {
+        ssize_t written = write(fd, "3", 1);
+        close(fd);
+        if (written == 1) {
+            return;
+        }
+    }
+    nftw(src, evict_file, 64, FTW_PHYS);
+}
+
+// Function to copy the generated tree with every engine and print a row for each
+static int run_engines(const char *src, const char *dest, int tree, long files, double bytes, int threads, int runs,
+                       int cold) {
+    static const char *names[] = { "copy_directory", "parallel/sync", "parallel/io_uring", "parallel/inode-order",
+                                   "parallel/physical-order" };
+    for (int engine = 0; engine < 5; engine++) {
+        bench_latency_t latency;
+        if (bench_latency_init(&latency) == -1) {
+            perror("malloc");
+            return -1;
+        }
+        double best = 0;
+        unsigned long long syscalls = 0;
+        for (int run = 0; run < runs; run++) {
+            remove_tree(dest);
+            if (cold) {
+                drop_caches(src);
+            } else {
+                sync();
+            }
+
+            bench_io_t io;
+            bench_io_read(&io);
+            double start = now_seconds();
+            if (engine == 0) {
+                copy_directory(src, dest, 0, 0);
+            } else {
+                copytree_options_t options;
+                copytree_options_init(&options);
+                options.num_threads = threads;
+                options.engine = engine == 2 ? COPYTREE_ENGINE_IO_URING : COPYTREE_ENGINE_SYNC;
+                if (engine == 3) {
+                    options.order = COPYTREE_ORDER_INODE;
+                } else if (engine == 4) {
+                    options.order = COPYTREE_ORDER_PHYSICAL;
+                }
+                copy_directory_parallel(src, dest, 0, 0, &options);
+            }
+            double elapsed = now_seconds() - start;
+            syscalls += bench_io_since(&io);
+            bench_latency_add(&latency, elapsed);
+            if (run == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        // One operation is one file; the latency columns are those of whole copies
+        char test_case[64];
+        snprintf(test_case, sizeof(test_case), "tree=%s/files=%ld%s", tree_names[tree], files, cold ? "/cold" : "");
+        bench_report("copytree", names[engine], test_case, bytes, (double)files, best, (double)syscalls / runs,
+                     &latency);
+        bench_latency_free(&latency);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    tree_params_t params = { 10000, 4096, 64 * 1024 * 1024, 256, 64 * 1024 * 1024 };
+    int selected[TREE_COUNT] = { 1, 1, 1, 1 };
+    int threads = 0;
+    int runs = 3;
+    int cold = 0;
+
+    while ((opt = getopt(argc, argv, "n:s:H:d:t:j:r:c")) != -1) {
+        switch (opt) {
+            case 'n':
+                params.files = atoi(optarg);
+                break;
+            case 's':
+                params.file_size = (size_t)atol(optarg);
+                break;
+            case 'H':
+                params.huge_size = (size_t)atol(optarg) * 1024 * 1024;
+                params.sparse_size = params.huge_size;
+                break;
+            case 'd':
+                params.depth = atoi(optarg);
+                break;
+            case 't':
+                for (int tree = 0; tree < TREE_COUNT; tree++) {
+                    selected[tree] = 0;
+                }
+                for (char *name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+                    int tree = 0;
+                    while (tree < TREE_COUNT && strcmp(name, tree_names[tree]) != 0) {
+                        tree++;
+                    }
+                    if (tree == TREE_COUNT) {
+                        print_usage(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    selected[tree] = 1;
+                }
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'c':
+                cold = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc || params.files <= 0 || params.depth <= 0 || runs <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char src[PATH_MAX];
+    char dest[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/bench_src", argv[optind]);
+    snprintf(dest, sizeof(dest), "%s/bench_dest", argv[optind]);
+
+    bench_report_header();
+    int status = 0;
+    for (int tree = 0; tree < TREE_COUNT && status == 0; tree++) {
+        if (!selected[tree]) {
+            continue;
+        }
+        long files;
+        double bytes;
+        remove_tree(src);
+        remove_tree(dest);
+        status = generate_tree(src, tree, &params, &files, &bytes);
+        if (status == 0) {
+            status = run_engines(src, dest, tree, files, bytes, threads, runs, cold);
+        }
+    }
+
+    remove_tree(dest);
+    remove_tree(src);
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
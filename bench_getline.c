@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "buffered_open.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+void print_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [-m megabytes] [-l line_length] [-r runs] <work_directory>\n", prog_name);
+    fprintf(stderr, "  -m: Size of the generated file in MiB (default 256)\n");
+    fprintf(stderr, "  -l: Average line length in bytes (default 80)\n");
+    fprintf(stderr, "  -r: Runs per reader, the best one is reported (default 3)\n");
+}
+
+// Function to return the current monotonic time in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to generate a file of text lines with lengths spread around line_length
+static int generate_file(const char *path, size_t size, size_t line_length) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("fopen");
+        return -1;
+    }
+    unsigned seed = 1;
+    size_t written = 0;
+    while (written < size) {
+        seed = seed * 1103515245 + 12345;
+        size_t length = line_length / 2 + (seed >> 16) % (line_length + 1);
+        for (size_t i = 0; i < length; i++) {
+            fputc('a' + (int)((seed + i) % 26), file);
+        }
+        fputc('\n', file);
+        written += length + 1;
+    }
+    if (fclose(file) != 0) {
+        perror("fclose");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to count the lines of a file with stdio getline
+static size_t count_stdio(const char *path, size_t *bytes) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("fopen");
+        return 0;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    size_t lines = 0;
+    *bytes = 0;
+    while ((length = getline(&line, &capacity, file)) > 0) {
+        lines++;
+        *bytes += (size_t)length;
+    }
+    free(line);
+    fclose(file);
+    return lines;
+}
+
+// Function to count the lines of a file with buffered_getline in the given read mode
+static size_t count_buffered(const char *path, int mode, size_t *bytes) {
+    buffered_options_t options;
+    buffered_options_init(&options);
+    options.read_buffer_size = 64 * 1024;
+    options.readahead = mode == 1;
+    options.mmap_read = mode == 2;
+
+    buffered_file_t *bf = buffered_open_ex(path, O_RDONLY, 0, &options);
+    if (!bf) {
+        perror("buffered_open_ex");
+        return 0;
+    }
+    const char *line;
+    ssize_t length;
+    size_t lines = 0;
+    *bytes = 0;
+    while ((length = buffered_getline(bf, &line)) > 0) {
+        lines++;
+        *bytes += (size_t)length;
+    }
+    buffered_close(bf);
+    return lines;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    size_t megabytes = 256;
+    size_t line_length = 80;
+    int runs = 3;
+
+    while ((opt = getopt(argc, argv, "m:l:r:")) != -1) {
+        switch (opt) {
+            case 'm':
+                megabytes = (size_t)atol(optarg);
+                break;
+            case 'l':
+                line_length = (size_t)atol(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc || megabytes == 0 || line_length == 0 || runs <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_lines.txt", argv[optind]);
+    if (generate_file(path, megabytes * 1024 * 1024, line_length) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // The file is read once first, so every reader runs against the page cache
+    static const char *names[] = { "stdio getline", "buffered_getline", "  + readahead", "  + mmap" };
+    size_t expected_bytes;
+    size_t expected_lines = count_stdio(path, &expected_bytes);
+    printf("%-20s %10s %10s\n", "reader", "seconds", "GB/s");
+    for (int reader = 0; reader < 4; reader++) {
+        double best = 0;
+        for (int run = 0; run < runs; run++) {
+            size_t bytes;
+            double start = now_seconds();
+            size_t lines = reader == 0 ? count_stdio(path, &bytes) : count_buffered(path, reader - 1, &bytes);
+            double elapsed = now_seconds() - start;
+            if (lines != expected_lines || bytes != expected_bytes) {
+                fprintf(stderr, "%s: read %zu lines, expected %zu\n", names[reader], lines, expected_lines);
+                unlink(path);
+                return EXIT_FAILURE;
+            }
+            if (run == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        printf("%-20s %10.3f %10.2f\n", names[reader], best, expected_bytes / best / 1e9);
+    }
+
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,318 @@
+#include "buffered_internal.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+// Number of buffers producers and the flusher rotate through
+#define CONCURRENT_BUFFERS 4
+
+// Value of sealed while a buffer still takes reservations
+#define CONCURRENT_OPEN SIZE_MAX
+
+// One buffer of the ring. Producers reserve space with a fetch-add on reserved and count the bytes they
+// finished copying in committed. The producer whose reservation runs past the end seals the buffer by
+// recording how much of it is valid; the flusher writes it once committed reaches that length.
+typedef struct {
+    char *data;
+    atomic_size_t reserved;     // Bytes handed out; above the capacity once the buffer is sealed or idle
+    atomic_size_t committed;    // Bytes copied in by the producers
+    atomic_size_t sealed;       // Valid length once sealed, CONCURRENT_OPEN before
+    atomic_ulong seq;           // Sequence number the buffer is open for
+} concurrent_buffer_t;
+
+// State of the concurrent append mode of one handle
+struct buffered_concurrent {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // Signalled when a buffer may have become complete, and on stop
+    pthread_cond_t advanced;    // Signalled when the current buffer changes and when a buffer is written
+    pthread_mutex_t write_lock; // Held while writing, so records larger than a buffer are not interleaved
+
+    int fd;
+    buffered_stats_t *stats;    // Counters of the handle
+    size_t capacity;
+    concurrent_buffer_t buffers[CONCURRENT_BUFFERS];
+    atomic_ulong current;       // Sequence number of the buffer taking reservations
+    unsigned long flushed;      // Buffers written so far, guarded by lock
+    atomic_int error;           // errno of the first failed write, sticky until close
+    int stop;
+};
+
+// Function to write a whole buffer, retrying short writes
+static int concurrent_write_all(struct buffered_concurrent *cc, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = STATS_CALL(cc->stats, write(cc->fd, data, len));
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        if (written == 0) {
+            return EIO;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+// Function to tell the flusher that the buffer may be complete. Taking the lock keeps the wakeup from
+// slipping in between the flusher's check and its wait.
+static void concurrent_notify(struct buffered_concurrent *cc) {
+    pthread_mutex_lock(&cc->lock);
+    pthread_cond_signal(&cc->ready);
+    pthread_mutex_unlock(&cc->lock);
+}
+
+// Function to seal a buffer at length valid and open the next one, waiting for it to be written first
+// if the flusher is behind
+static void concurrent_seal(struct buffered_concurrent *cc, concurrent_buffer_t *buffer, size_t valid) {
+    unsigned long seq = atomic_load(&buffer->seq);
+    atomic_store(&buffer->sealed, valid);
+    if (atomic_load(&buffer->committed) == valid) {
+        concurrent_notify(cc);
+    }
+
+    pthread_mutex_lock(&cc->lock);
+    while (seq + 1 >= cc->flushed + CONCURRENT_BUFFERS && atomic_load(&cc->error) == 0) {
+        pthread_cond_wait(&cc->advanced, &cc->lock);
+    }
+    if (atomic_load(&cc->error) != 0) {
+        pthread_mutex_unlock(&cc->lock);
+        return; // Nothing will be written anymore
+    }
+    concurrent_buffer_t *next = &cc->buffers[(seq + 1) % CONCURRENT_BUFFERS];
+    atomic_store(&next->seq, seq + 1);
+    atomic_store(&next->reserved, 0);
+    atomic_store(&cc->current, seq + 1);
+    pthread_cond_broadcast(&cc->advanced);
+    pthread_mutex_unlock(&cc->lock);
+}
+
+// Function to wait until the buffer with sequence number seq is no longer the current one
+static void concurrent_wait_switch(struct buffered_concurrent *cc, unsigned long seq) {
+    pthread_mutex_lock(&cc->lock);
+    while (atomic_load(&cc->current) == seq && atomic_load(&cc->error) == 0) {
+        pthread_cond_wait(&cc->advanced, &cc->lock);
+    }
+    pthread_mutex_unlock(&cc->lock);
+}
+
+// Function run by the flusher: writes sealed buffers in sequence order as soon as they are complete
+static void *concurrent_main(void *arg) {
+    struct buffered_concurrent *cc = arg;
+
+    pthread_mutex_lock(&cc->lock);
+    for (;;) {
+        concurrent_buffer_t *buffer = &cc->buffers[cc->flushed % CONCURRENT_BUFFERS];
+        size_t valid = atomic_load(&buffer->sealed);
+        if (valid == CONCURRENT_OPEN || atomic_load(&buffer->committed) != valid) {
+            if (cc->stop) {
+                break;
+            }
+            pthread_cond_wait(&cc->ready, &cc->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&cc->lock);
+
+        if (valid > 0 && atomic_load(&cc->error) == 0) {
+            pthread_mutex_lock(&cc->write_lock);
+            int err = concurrent_write_all(cc, buffer->data, valid);
+            pthread_mutex_unlock(&cc->write_lock);
+            stats_add(&cc->stats->flushes, 1);
+            if (err != 0) {
+                atomic_store(&cc->error, err);
+            }
+        }
+
+        pthread_mutex_lock(&cc->lock);
+        // Reset committed before the buffer can take reservations again; it stays closed until reopened
+        atomic_store(&buffer->sealed, CONCURRENT_OPEN);
+        atomic_store(&buffer->committed, 0);
+        atomic_store(&buffer->reserved, cc->capacity + 1);
+        cc->flushed++;
+        pthread_cond_broadcast(&cc->advanced);
+    }
+    pthread_mutex_unlock(&cc->lock);
+    return NULL;
+}
+
+// Function to start the concurrent append mode of a handle
+int concurrent_start(buffered_file_t *bf) {
+    struct buffered_concurrent *cc = calloc(1, sizeof(struct buffered_concurrent));
+    if (!cc) {
+        return -1;
+    }
+
+    cc->fd = bf->fd;
+    cc->stats = &bf->stats;
+    cc->capacity = bf->write_buffer_size;
+    for (int i = 0; i < CONCURRENT_BUFFERS; i++) {
+        concurrent_buffer_t *buffer = &cc->buffers[i];
+        buffer->data = malloc(cc->capacity);
+        if (!buffer->data) {
+            for (int j = 0; j < i; j++) {
+                free(cc->buffers[j].data);
+            }
+            free(cc);
+            return -1;
+        }
+        atomic_init(&buffer->reserved, i == 0 ? 0 : cc->capacity + 1);
+        atomic_init(&buffer->committed, 0);
+        atomic_init(&buffer->sealed, CONCURRENT_OPEN);
+        atomic_init(&buffer->seq, (unsigned long)i);
+    }
+    atomic_init(&cc->current, 0);
+    atomic_init(&cc->error, 0);
+
+    pthread_mutex_init(&cc->lock, NULL);
+    pthread_mutex_init(&cc->write_lock, NULL);
+    pthread_cond_init(&cc->ready, NULL);
+    pthread_cond_init(&cc->advanced, NULL);
+    if (pthread_create(&cc->thread, NULL, concurrent_main, cc) != 0) {
+        pthread_mutex_destroy(&cc->lock);
+        pthread_mutex_destroy(&cc->write_lock);
+        pthread_cond_destroy(&cc->ready);
+        pthread_cond_destroy(&cc->advanced);
+        for (int i = 0; i < CONCURRENT_BUFFERS; i++) {
+            free(cc->buffers[i].data);
+        }
+        free(cc);
+        return -1;
+    }
+
+    bf->concurrent = cc;
+    return 0;
+}
+
+// Function to append one record from any thread
+ssize_t concurrent_writev(buffered_file_t *bf, const struct iovec *iov, int iovcnt, size_t total) {
+    struct buffered_concurrent *cc = bf->concurrent;
+
+    int err = atomic_load(&cc->error);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    if (total > cc->capacity) {
+        // Too large for any buffer: write everything before it, then the record itself while the
+        // flusher is kept out
+        if (concurrent_flush(bf) == -1) {
+            return -1;
+        }
+        pthread_mutex_lock(&cc->write_lock);
+        for (int i = 0; i < iovcnt && err == 0; i++) {
+            err = concurrent_write_all(cc, iov[i].iov_base, iov[i].iov_len);
+        }
+        pthread_mutex_unlock(&cc->write_lock);
+        if (err != 0) {
+            atomic_store(&cc->error, err);
+            errno = err;
+            return -1;
+        }
+        stats_add(&bf->stats.bytes_direct, total);
+        return total;
+    }
+
+    for (;;) {
+        unsigned long seq = atomic_load(&cc->current);
+        concurrent_buffer_t *buffer = &cc->buffers[seq % CONCURRENT_BUFFERS];
+        size_t offset = atomic_fetch_add(&buffer->reserved, total);
+
+        if (offset + total <= cc->capacity) {
+            // The space is ours: copy without holding any lock
+            char *dest = buffer->data + offset;
+            for (int i = 0; i < iovcnt; i++) {
+                memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+                dest += iov[i].iov_len;
+            }
+            stats_add(&bf->stats.bytes_buffered, total);
+            size_t committed = atomic_fetch_add(&buffer->committed, total) + total;
+            if (committed == atomic_load(&buffer->sealed)) {
+                concurrent_notify(cc);
+            }
+            return total;
+        }
+
+        if (offset <= cc->capacity) {
+            // This reservation crossed the end: the buffer holds offset valid bytes
+            concurrent_seal(cc, buffer, offset);
+        } else {
+            concurrent_wait_switch(cc, seq);
+        }
+
+        err = atomic_load(&cc->error);
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+    }
+}
+
+// Function to write everything appended so far. Returns -1 with errno set if a write failed.
+int concurrent_flush(buffered_file_t *bf) {
+    struct buffered_concurrent *cc = bf->concurrent;
+
+    // Seal the current buffer however full it is, unless a producer is already doing so. A plain
+    // fetch-add could close a buffer that was reopened in the meantime with nobody left to seal it.
+    unsigned long seq;
+    for (;;) {
+        seq = atomic_load(&cc->current);
+        concurrent_buffer_t *buffer = &cc->buffers[seq % CONCURRENT_BUFFERS];
+        size_t offset = atomic_load(&buffer->reserved);
+        if (offset > cc->capacity) {
+            break; // Already being sealed
+        }
+        if (atomic_compare_exchange_weak(&buffer->reserved, &offset, cc->capacity + 1)) {
+            concurrent_seal(cc, buffer, offset);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&cc->lock);
+    while (cc->flushed <= seq && atomic_load(&cc->error) == 0) {
+        pthread_cond_wait(&cc->advanced, &cc->lock);
+    }
+    pthread_mutex_unlock(&cc->lock);
+
+    int err = atomic_load(&cc->error);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to stop the flusher and release the buffers. Call concurrent_flush first.
+void concurrent_stop(buffered_file_t *bf) {
+    struct buffered_concurrent *cc = bf->concurrent;
+    if (!cc) {
+        return;
+    }
+
+    pthread_mutex_lock(&cc->lock);
+    cc->stop = 1;
+    pthread_cond_signal(&cc->ready);
+    pthread_mutex_unlock(&cc->lock);
+    pthread_join(cc->thread, NULL);
+
+    pthread_mutex_destroy(&cc->lock);
+    pthread_mutex_destroy(&cc->write_lock);
+    pthread_cond_destroy(&cc->ready);
+    pthread_cond_destroy(&cc->advanced);
+    for (int i = 0; i < CONCURRENT_BUFFERS; i++) {
+        free(cc->buffers[i].data);
+    }
+    free(cc);
+    bf->concurrent = NULL;
+}
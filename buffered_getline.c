@@ -0,0 +1,130 @@
+#include "buffered_internal.h"
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Function type of the delimiter scanners: returns the first delim in [start, end) or NULL
+typedef const char *(*scan_fn_t)(const char *start, const char *end, int delim);
+
+// Function to find the delimiter without vector instructions
+static const char *scan_scalar(const char *start, const char *end, int delim) {
+    return memchr(start, delim, (size_t)(end - start));
+}
+
+#if defined(__x86_64__)
+// Function to find the delimiter 16 bytes at a time (SSE2 is part of every x86-64 CPU)
+static const char *scan_sse2(const char *start, const char *end, int delim) {
+    const __m128i needle = _mm_set1_epi8((char)delim);
+    while (end - start >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)start);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask) {
+            return start + __builtin_ctz(mask);
+        }
+        start += 16;
+    }
+    return scan_scalar(start, end, delim);
+}
+
+// Function to find the delimiter 64 bytes per iteration with AVX2
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *start, const char *end, int delim) {
+    const __m256i needle = _mm256_set1_epi8((char)delim);
+    while (end - start >= 64) {
+        __m256i low = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)start), needle);
+        __m256i high = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(start + 32)), needle);
+        if (!_mm256_testz_si256(_mm256_or_si256(low, high), _mm256_or_si256(low, high))) {
+            unsigned mask = (unsigned)_mm256_movemask_epi8(low);
+            if (mask) {
+                return start + __builtin_ctz(mask);
+            }
+            return start + 32 + __builtin_ctz((unsigned)_mm256_movemask_epi8(high));
+        }
+        start += 64;
+    }
+    while (end - start >= 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)start), needle));
+        if (mask) {
+            return start + __builtin_ctz(mask);
+        }
+        start += 32;
+    }
+    return scan_sse2(start, end, delim);
+}
+#endif
+
+// Scanner picked for this CPU on first use
+static scan_fn_t scan_delim = scan_scalar;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+// Function to pick the widest scanner the CPU supports
+static void scan_select(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    scan_delim = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#endif
+}
+
+// Function to read one record ending in delim
+ssize_t buffered_read_until(buffered_file_t *bf, int delim, const char **record) {
+    if (!bf || bf->fd < 0 || !record) {
+        errno = EBADF;
+        perror("buffered_read_until");
+        return -1;
+    }
+    pthread_once(&scan_once, scan_select);
+
+    // Fast path: the record is already complete in the buffer
+    size_t available = bf->read_buffer_size - bf->read_buffer_pos;
+    if (available > 0) {
+        const char *start = bf->read_buffer + bf->read_buffer_pos;
+        const char *found = scan_delim(start, start + available, delim);
+        if (found) {
+            *record = start;
+            bf->read_buffer_pos += (size_t)(found - start) + 1;
+            stats_add(&bf->stats.bytes_buffered, (size_t)(found - start) + 1);
+            return found - start + 1;
+        }
+    }
+
+    size_t scanned = available;
+    size_t wanted = available + 1;
+    for (;;) {
+        const void *data;
+        ssize_t buffered = buffered_peek(bf, &data, wanted);
+        if (buffered <= 0) {
+            return buffered; // End of file or error
+        }
+
+        // Only the bytes that arrived since the last pass need to be looked at
+        const char *start = data;
+        const char *found = scan_delim(start + scanned, start + buffered, delim);
+        if (found) {
+            size_t length = (size_t)(found - start) + 1;
+            *record = start;
+            buffered_consume(bf, length);
+            return (ssize_t)length;
+        }
+        if ((size_t)buffered < wanted) {
+            // The file ends in the middle of a record: hand out what is left
+            *record = start;
+            buffered_consume(bf, (size_t)buffered);
+            return buffered;
+        }
+
+        // The record continues past the buffered data: ask for more in one piece
+        scanned = (size_t)buffered;
+        wanted = (size_t)buffered + 1;
+    }
+}
+
+// Function to read one line
+ssize_t buffered_getline(buffered_file_t *bf, const char **line) {
+    return buffered_read_until(bf, '\n', line);
+}
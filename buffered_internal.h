@@ -0,0 +1,123 @@
+#ifndef BUFFERED_INTERNAL_H
+#define BUFFERED_INTERNAL_H
+
+#include "buffered_open.h"
+#include <sys/uio.h>
+#include <time.h>
+
+// Instrumentation of the handles (buffered_stats_t). The background threads of a handle count into the
+// same structure as its callers, so counters are bumped with relaxed atomic adds. With BUFFERED_NO_STATS
+// defined the helpers do nothing and the compiler drops them along with the clock reads.
+#ifndef BUFFERED_NO_STATS
+
+// Function to add n to one counter of a handle
+static inline void stats_add(unsigned long long *counter, unsigned long long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Function to read the clock before a system call that stats_syscall will count
+static inline unsigned long long stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// Function to count one system call that began at the stats_clock reading start
+static inline void stats_syscall(buffered_stats_t *stats, unsigned long long start) {
+    stats_add(&stats->syscalls, 1);
+    stats_add(&stats->kernel_ns, stats_clock() - start);
+}
+
+// Evaluates to the result of the system call expression call, counted and timed in *stats
+#define STATS_CALL(stats, call) ({                                  \
+        unsigned long long stats_start_ = stats_clock();            \
+        __typeof__(call) stats_result_ = (call);                    \
+        stats_syscall((stats), stats_start_);                       \
+        stats_result_;                                              \
+    })
+
+#else
+
+static inline void stats_add(unsigned long long *counter, unsigned long long n) {
+    (void)counter;
+    (void)n;
+}
+
+static inline unsigned long long stats_clock(void) {
+    return 0;
+}
+
+static inline void stats_syscall(buffered_stats_t *stats, unsigned long long start) {
+    (void)stats;
+    (void)start;
+}
+
+#define STATS_CALL(stats, call) (call)
+
+#endif // BUFFERED_NO_STATS
+
+// Functions of the read-ahead mode (buffered_readahead.c)
+
+// Function to start the background reader of a handle. Returns -1 if it could not be started,
+// in which case the handle keeps reading synchronously.
+int readahead_start(buffered_file_t *bf);
+
+// Function to hand the next filled buffer to the consumer, releasing the one it held before.
+// Returns the number of bytes in *data, 0 at end of file and -1 on error.
+ssize_t readahead_next(buffered_file_t *bf, char **data);
+
+// Function to drop everything read ahead and restart at offset with the smallest window
+void readahead_reset(buffered_file_t *bf, off_t offset);
+
+// Function to stop the background reader and release its buffers
+void readahead_stop(buffered_file_t *bf);
+
+// Functions of the write-behind mode (buffered_writebehind.c)
+
+// Function to start the background flusher of a handle with up to depth queued buffers. The handle's
+// write buffer is replaced by the flusher's pool. Returns -1 if it could not be started.
+int writebehind_start(buffered_file_t *bf, int depth);
+
+// Function to report a failed background write. Returns -1 with errno set once one has failed.
+int writebehind_error(buffered_file_t *bf);
+
+// Function to queue the filled write buffer and give the producer an empty one. Blocks while
+// depth buffers are already queued.
+int writebehind_submit(buffered_file_t *bf);
+
+// Function to wait until every queued buffer has been written. Returns -1 with errno set if one failed.
+int writebehind_drain(buffered_file_t *bf);
+
+// Function to stop the background flusher and release its buffers
+void writebehind_stop(buffered_file_t *bf);
+
+// Functions of the concurrent append mode (buffered_concurrent.c)
+
+// Function to start the concurrent append mode of a handle. Returns -1 if it could not be started.
+int concurrent_start(buffered_file_t *bf);
+
+// Function to append one record of total bytes from any thread. The record reaches the file in one
+// piece, never split by another thread's data.
+ssize_t concurrent_writev(buffered_file_t *bf, const struct iovec *iov, int iovcnt, size_t total);
+
+// Function to write everything appended so far. Returns -1 with errno set if a write failed.
+int concurrent_flush(buffered_file_t *bf);
+
+// Function to stop the flusher and release the buffers. Call concurrent_flush first.
+void concurrent_stop(buffered_file_t *bf);
+
+// Functions of the handle and buffer pool (buffered_pool.c)
+
+// Function to take a handle from the pool. Returns NULL if no memory is left.
+buffered_file_t *pool_handle_get(buffered_pool_t *pool);
+
+// Function to give a closed handle back to the pool
+void pool_handle_put(buffered_pool_t *pool, buffered_file_t *bf);
+
+// Function to take a buffer of at least size bytes from the pool. Returns NULL if no memory is left.
+char *pool_buffer_get(buffered_pool_t *pool, size_t size);
+
+// Function to give a buffer obtained from pool_buffer_get back to the pool, with the size it was asked for
+void pool_buffer_put(buffered_pool_t *pool, char *buffer, size_t size);
+
+#endif // BUFFERED_INTERNAL_H
@@ -1,4 +1,5 @@
-#include "buffered_open.h"
+#define _GNU_SOURCE
+#include "buffered_internal.h"
 #include <stdarg.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -6,22 +7,216 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <sys/vfs.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
 
-// Function to wrap the original open function
-buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
-    int mode = 0;
-    va_list args;
+// Full refills or flushes in a row before an adaptive buffer is doubled
+#define ADAPTIVE_STREAK 4
 
-    if (flags & O_CREAT) {
-        va_start(args, flags);
-        mode = va_arg(args, int);
-        va_end(args);
+// Pieces of a buffered_writev smaller than this are copied into the write buffer; larger ones are
+// passed to the kernel as they are
+#define WRITEV_COPY_MAX 1024
+
+// Most iovecs handed to one writev call by buffered_writev
+#define WRITEV_BATCH 64
+
+// Huge page size used to round the length of huge-page backed buffers
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Bytes of a stream BUFFERED_CACHE_DROP leaves in the page cache behind the newest byte
+#define CACHE_DROP_WINDOW (8 * 1024 * 1024)
+
+// Function to fill an options structure with the default settings
+void buffered_options_init(buffered_options_t *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->read_buffer_size = BUFFER_SIZE;
+    opts->write_buffer_size = BUFFER_SIZE;
+    opts->alloc = BUFFERED_ALLOC_MALLOC;
+    opts->max_buffer_size = BUFFER_MAX_ADAPTIVE;
+}
+
+// Function to allocate a buffer according to the handle's allocation policy
+static char *buffer_alloc(buffered_file_t *bf, size_t size) {
+    if (bf->alloc == BUFFERED_ALLOC_HUGEPAGE) {
+        size_t length = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        void *buffer = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buffer == MAP_FAILED) {
+            // No reserved huge pages: ask for transparent huge pages instead
+            buffer = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (buffer == MAP_FAILED) {
+                errno = ENOMEM;
+                return NULL;
+            }
+            madvise(buffer, length, MADV_HUGEPAGE);
+        }
+        return buffer;
+    }
+    if (bf->direct_align) {
+        // O_DIRECT needs aligned memory, which neither malloc nor the pool promise
+        void *buffer;
+        if (posix_memalign(&buffer, bf->direct_align, size) != 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        return buffer;
+    }
+    if (bf->pool) {
+        return pool_buffer_get(bf->pool, size);
+    }
+    return malloc(size);
+}
+
+// Function to release a buffer obtained from buffer_alloc
+static void buffer_free(buffered_file_t *bf, char *buffer, size_t size) {
+    if (!buffer) {
+        return;
+    }
+    if (bf->alloc == BUFFERED_ALLOC_HUGEPAGE) {
+        munmap(buffer, (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1));
+    } else if (bf->direct_align) {
+        free(buffer);
+    } else if (bf->pool) {
+        pool_buffer_put(bf->pool, buffer, size);
+    } else {
+        free(buffer);
+    }
+}
+
+// Function to free the handle itself, or give it back to its pool
+static void release_handle(buffered_file_t *bf) {
+    if (bf->pool) {
+        pool_handle_put(bf->pool, bf);
+    } else {
+        free(bf);
+    }
+}
+
+// Function to make sure the read buffer exists before it is filled
+static int ensure_read_buffer(buffered_file_t *bf) {
+    if (!bf->read_buffer) {
+        bf->read_buffer = buffer_alloc(bf, bf->read_buffer_capacity);
+        if (!bf->read_buffer) {
+            perror("buffered_read: buffer allocation");
+            return -1;
+        }
+        bf->read_buffer_owned = 1;
+    }
+    return 0;
+}
+
+// Function to make sure the write buffer exists before data is copied into it
+static int ensure_write_buffer(buffered_file_t *bf) {
+    if (!bf->write_buffer) {
+        bf->write_buffer = buffer_alloc(bf, bf->write_buffer_size);
+        if (!bf->write_buffer) {
+            perror("buffered_write: buffer allocation");
+            return -1;
+        }
+        bf->write_buffer_owned = 1;
+    }
+    return 0;
+}
+
+// Function to double an owned, empty buffer after a streak of full refills or flushes
+static void maybe_grow_buffer(buffered_file_t *bf, char **buffer, size_t *capacity, int owned, unsigned *streak) {
+    if (!bf->adaptive || !owned || *capacity >= bf->max_buffer_size || ++*streak < ADAPTIVE_STREAK) {
+        return;
+    }
+    size_t new_capacity = *capacity * 2 > bf->max_buffer_size ? bf->max_buffer_size : *capacity * 2;
+    if (bf->direct_align) {
+        new_capacity -= new_capacity % bf->direct_align; // O_DIRECT transfers are whole blocks
+        if (new_capacity <= *capacity) {
+            return;
+        }
+    }
+    char *new_buffer = buffer_alloc(bf, new_capacity);
+    if (!new_buffer) {
+        return; // Keep streaming with the buffer we have
+    }
+    buffer_free(bf, *buffer, *capacity);
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    *streak = 0;
+}
+
+// Function to extend the mapping of a mapped handle to the current size of the file.
+// Returns the number of bytes now available past the read position.
+static ssize_t map_refill(buffered_file_t *bf) {
+    struct stat st;
+    if (STATS_CALL(&bf->stats, fstat(bf->fd, &st)) == -1) {
+        perror("fstat");
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (size > bf->read_buffer_size) {
+        void *map;
+        if (bf->read_buffer) {
+            map = mremap(bf->read_buffer, bf->read_buffer_size, size, MREMAP_MAYMOVE);
+        } else {
+            map = mmap(NULL, size, PROT_READ, MAP_SHARED, bf->fd, 0);
+        }
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        bf->read_buffer = map;
+        bf->read_buffer_size = size;
+    }
+    return bf->read_buffer_size - bf->read_buffer_pos;
+}
+
+// Function to switch a read-only handle to reading through a mapping of the file. Anything that
+// cannot be mapped (pipes, character devices) keeps the buffered path.
+static void map_start(buffered_file_t *bf) {
+    struct stat st;
+    if (STATS_CALL(&bf->stats, fstat(bf->fd, &st)) == -1 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    off_t offset = STATS_CALL(&bf->stats, lseek(bf->fd, 0, SEEK_CUR));
+    if (offset == -1) {
+        return;
+    }
+
+    // A caller-supplied read buffer is not used while mapped
+    bf->read_buffer = NULL;
+    bf->read_buffer_size = 0;
+    bf->mapped = 1;
+    if (st.st_size > 0 && map_refill(bf) == -1) {
+        bf->mapped = 0;
+        return;
+    }
+    // Reading continues where the descriptor was
+    bf->read_buffer_pos = (size_t)offset < bf->read_buffer_size ? (size_t)offset : bf->read_buffer_size;
+}
+
+// Function to open a buffered file with per-handle buffer settings
+buffered_file_t *buffered_open_ex(const char *pathname, int flags, mode_t mode, const buffered_options_t *opts) {
+    buffered_options_t defaults;
+    if (!opts) {
+        buffered_options_init(&defaults);
+        opts = &defaults;
+    }
+
+    // Only plain handles follow the cache policy, and the offset of an O_APPEND write is not known
+    // before it is made, so such a handle cannot line its writes up for O_DIRECT
+    buffered_cache_t cache = opts->cache;
+    if ((flags & O_PREAPPEND) || opts->readahead || opts->mmap_read || opts->write_behind > 0 ||
+        opts->concurrent_append) {
+        cache = BUFFERED_CACHE_NORMAL;
+    } else if (cache == BUFFERED_CACHE_DIRECT && (flags & O_APPEND)) {
+        cache = BUFFERED_CACHE_DROP;
     }
 
     int preappend = 0;
     if (flags & O_PREAPPEND) {
         preappend = 1;
-        flags |= O_RDWR;
+        // Existing content is read back to be moved, so the file must be opened for reading and writing.
+        // O_APPEND would send the positioned writes to the end of the file, so it is dropped.
+        flags = (flags & ~(O_ACCMODE | O_APPEND)) | O_RDWR;
         flags &= ~O_PREAPPEND;
     }
 
@@ -32,235 +227,905 @@ buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
     }
 
     // Allocate memory for buffered_file_t structure
-    buffered_file_t *bf = (buffered_file_t *)malloc(sizeof(buffered_file_t));
+    buffered_file_t *bf = opts->pool ? pool_handle_get(opts->pool) : (buffered_file_t *)malloc(sizeof(buffered_file_t));
     if (!bf) {
         close(fd);
         errno = ENOMEM;
         return NULL;
     }
 
-    // Initialize the buffered_file_t structure
+    // Initialize the buffered_file_t structure; the buffers themselves are allocated on first use
     bf->fd = fd;
     bf->flags = flags;
     bf->preappend = preappend;
+    bf->read_buffer = opts->read_buffer;
+    bf->write_buffer = opts->write_buffer;
     bf->read_buffer_size = 0;
-    bf->write_buffer_size = BUFFER_SIZE;
+    bf->read_buffer_capacity = opts->read_buffer_size ? opts->read_buffer_size : BUFFER_SIZE;
+    bf->write_buffer_size = opts->write_buffer_size ? opts->write_buffer_size : BUFFER_SIZE;
     bf->read_buffer_pos = 0;
     bf->write_buffer_pos = 0;
+    bf->read_buffer_owned = 0;
+    bf->write_buffer_owned = 0;
+    bf->alloc = opts->alloc;
+    bf->adaptive = opts->adaptive;
+    bf->max_buffer_size = opts->max_buffer_size ? opts->max_buffer_size : BUFFER_MAX_ADAPTIVE;
+    bf->read_streak = 0;
+    bf->write_streak = 0;
+    bf->prepend_buffer = NULL;
+    bf->prepend_capacity = 0;
+    bf->prepend_len = 0;
+    bf->prepend_block_size = 0;
+    bf->prepend_insert_errno = 0;
+    bf->prepend_method = PREPEND_NONE;
+    bf->readahead = NULL;
+    bf->writebehind = NULL;
+    bf->concurrent = NULL;
+    bf->mapped = 0;
+    bf->peek_buffer = NULL;
+    bf->peek_capacity = 0;
+    bf->fd_offset = -1;
+    bf->write_queued = 0;
+    bf->pool = opts->pool;
+    memset(&bf->stats, 0, sizeof(bf->stats));
+    bf->cache = cache;
+    bf->direct_align = 0;
+    bf->status_flags = 0;
+    bf->cache_start = -1;
+    bf->cache_end = 0;
 
-    // Allocate memory for read and write buffers
-    bf->read_buffer = (char *)malloc(BUFFER_SIZE);
-    bf->write_buffer = (char *)malloc(BUFFER_SIZE);
+    // O_DIRECT is switched on after the open, so a filesystem that refuses it (EINVAL) leaves a
+    // working descriptor behind, also for O_CREAT | O_EXCL. The handle then drops the cache instead.
+    if (cache == BUFFERED_CACHE_DIRECT) {
+        int status = fcntl(fd, F_GETFL);
+        if (status != -1 && STATS_CALL(&bf->stats, fcntl(fd, F_SETFL, status | O_DIRECT)) == 0) {
+            size_t align = (size_t)sysconf(_SC_PAGESIZE);
+            bf->status_flags = status & ~O_DIRECT;
+            bf->direct_align = align;
+            bf->read_buffer_capacity = (bf->read_buffer_capacity + align - 1) & ~(align - 1);
+            bf->write_buffer_size = (bf->write_buffer_size + align - 1) & ~(align - 1);
+            // Caller buffers are only usable when they already meet the alignment
+            if ((uintptr_t)bf->read_buffer % align != 0 || bf->read_buffer_capacity != opts->read_buffer_size) {
+                bf->read_buffer = NULL;
+            }
+            if ((uintptr_t)bf->write_buffer % align != 0 || bf->write_buffer_size != opts->write_buffer_size) {
+                bf->write_buffer = NULL;
+            }
+        } else {
+            bf->cache = BUFFERED_CACHE_DROP;
+        }
+    }
 
-    if (!bf->read_buffer || !bf->write_buffer) {
-        free(bf->read_buffer);
-        free(bf->write_buffer);
-        free(bf);
-        close(fd);
-        errno = ENOMEM;
-        return NULL;
+    // Read-ahead keeps its own pair of buffers; if the reader cannot be started the handle
+    // simply reads synchronously
+    if (opts->readahead && !opts->mmap_read && !preappend && (flags & O_ACCMODE) != O_WRONLY) {
+        readahead_start(bf);
+    }
+    if (opts->mmap_read && !preappend && (flags & O_ACCMODE) == O_RDONLY) {
+        map_start(bf);
+    }
+    if (opts->concurrent_append && !preappend && (flags & O_ACCMODE) != O_RDONLY) {
+        // Unlike the other modes this one cannot quietly fall back: callers rely on it for thread safety
+        if (concurrent_start(bf) == -1) {
+            readahead_stop(bf);
+            close(fd);
+            release_handle(bf);
+            errno = ENOMEM;
+            return NULL;
+        }
+    } else if (opts->write_behind > 0 && !preappend && (flags & O_ACCMODE) != O_RDONLY) {
+        writebehind_start(bf, opts->write_behind);
     }
 
     return bf;
 }
 
-// Function to write to the buffered file
-ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count) {
-    if (!bf || bf->fd < 0) {
-        errno = EBADF;
-        perror("buffered_write");
-        return -1;
+// Function to wrap the original open function
+buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
+    int mode = 0;
+    va_list args;
+
+    if (flags & O_CREAT) {
+        va_start(args, flags);
+        mode = va_arg(args, int);
+        va_end(args);
     }
 
-    // Prepend logic
-    if (bf->preappend) {
-        // Check the file descriptor
-        if (fcntl(bf->fd, F_GETFD) == -1) {
-            perror("buffered_write fcntl");
-            return -1;
-        }
+    return buffered_open_ex(pathname, flags, (mode_t)mode, NULL);
+}
 
-        // Read existing content
-        off_t current_offset = lseek(bf->fd, 0, SEEK_END);
-        if (current_offset == -1) {
-            perror("lseek SEEK_END");
-            return -1;
+// Function to put data in front of the pending O_PREAPPEND data. Nothing touches the file until
+// the pending data is committed, so N prepends cost one pass over the file instead of N.
+static int prepend_pending(buffered_file_t *bf, const void *buf, size_t count) {
+    if (bf->prepend_len + count > bf->prepend_capacity) {
+        size_t new_capacity = bf->prepend_capacity ? bf->prepend_capacity * 2 : BUFFER_SIZE;
+        while (new_capacity < bf->prepend_len + count) {
+            new_capacity *= 2;
         }
-
-        char *temp_buffer = malloc(current_offset);
-        if (!temp_buffer) {
+        char *new_buffer = malloc(new_capacity);
+        if (!new_buffer) {
+            errno = ENOMEM;
             perror("malloc");
             return -1;
         }
+        // Keep the pending bytes at the end of the larger buffer
+        memcpy(new_buffer + new_capacity - bf->prepend_len,
+               bf->prepend_buffer + bf->prepend_capacity - bf->prepend_len, bf->prepend_len);
+        free(bf->prepend_buffer);
+        bf->prepend_buffer = new_buffer;
+        bf->prepend_capacity = new_capacity;
+    }
 
-        if (lseek(bf->fd, 0, SEEK_SET) == -1) {
-            perror("lseek SEEK_SET");
-            free(temp_buffer);
-            return -1;
+    bf->prepend_len += count;
+    memcpy(bf->prepend_buffer + bf->prepend_capacity - bf->prepend_len, buf, count);
+    return 0;
+}
+
+// Function to write pending bytes at the start of the file
+static int prepend_write_front(buffered_file_t *bf, const char *data, size_t len) {
+    ssize_t written_bytes = STATS_CALL(&bf->stats, pwrite(bf->fd, data, len, 0));
+    if (written_bytes != (ssize_t)len) {
+        if (written_bytes != -1) {
+            errno = EIO;
         }
+        perror("pwrite");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to try opening up len bytes at the start of the file without moving any data.
+// Returns 0 on success and -1 when the filesystem refuses, with the reason remembered.
+static int prepend_insert_range(buffered_file_t *bf, size_t len) {
+    if (bf->prepend_insert_errno != 0) {
+        return -1; // Refused before, the filesystem will not change its mind
+    }
+    if (STATS_CALL(&bf->stats, fallocate(bf->fd, FALLOC_FL_INSERT_RANGE, 0, (off_t)len)) == -1) {
+        bf->prepend_insert_errno = errno;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to write the pending O_PREAPPEND data to the start of the file. When the pending size is a
+// multiple of the filesystem block size, FALLOC_FL_INSERT_RANGE opens up the space without moving any
+// data. With partial set (an early commit while writes continue) only the block-aligned tail is
+// committed that way and the rest stays pending, so the fast path is not lost to an odd size.
+// Otherwise the existing contents are moved up in place, from the end backwards, through a
+// fixed-size buffer, so memory use does not depend on the size of the file.
+static int prepend_commit(buffered_file_t *bf, int partial) {
+    if (bf->prepend_len == 0) {
+        return 0;
+    }
+
+    off_t file_size = STATS_CALL(&bf->stats, lseek(bf->fd, 0, SEEK_END));
+    if (file_size == -1) {
+        perror("lseek SEEK_END");
+        return -1;
+    }
+
+    const char *pending = bf->prepend_buffer + bf->prepend_capacity - bf->prepend_len;
 
-        ssize_t read_bytes = read(bf->fd, temp_buffer, current_offset);
-        if (read_bytes == -1) {
-            perror("read");
-            free(temp_buffer);
+    // An empty file has nothing to make room for
+    if (file_size == 0) {
+        if (prepend_write_front(bf, pending, bf->prepend_len) == -1) {
             return -1;
         }
+        bf->prepend_method = PREPEND_PLAIN_WRITE;
+        bf->prepend_len = 0;
+        return 0;
+    }
 
-        // Clear the file content
-        if (ftruncate(bf->fd, 0) == -1) {
-            perror("ftruncate");
-            free(temp_buffer);
+    if (bf->prepend_block_size == 0) {
+        struct statfs fs;
+        bf->prepend_block_size = STATS_CALL(&bf->stats, fstatfs(bf->fd, &fs)) == 0 && fs.f_bsize > 0 ? (size_t)fs.f_bsize : BUFFER_SIZE;
+    }
+
+    // Fast path: the oldest pending bytes sit right before the current contents, so a block-aligned
+    // tail of the pending data can go into space inserted by the filesystem
+    size_t aligned = bf->prepend_len - bf->prepend_len % bf->prepend_block_size;
+    if (aligned > 0 && (partial || aligned == bf->prepend_len) && prepend_insert_range(bf, aligned) == 0) {
+        if (prepend_write_front(bf, pending + bf->prepend_len - aligned, aligned) == -1) {
             return -1;
         }
+        bf->prepend_method = PREPEND_INSERT_RANGE;
+        bf->prepend_len -= aligned;
+        return 0;
+    }
 
-        if (lseek(bf->fd, 0, SEEK_SET) == -1) {
-            perror("lseek SEEK_SET");
-            free(temp_buffer);
+    // Fallback: move the existing contents up by the pending size
+    off_t shift = (off_t)bf->prepend_len;
+    size_t shift_size = file_size < PREPEND_SHIFT_SIZE ? (size_t)file_size : PREPEND_SHIFT_SIZE;
+    char *shift_buffer = malloc(shift_size);
+    if (!shift_buffer) {
+        errno = ENOMEM;
+        perror("malloc");
+        return -1;
+    }
+
+    // Walk from the end so no byte is overwritten before it has been moved
+    off_t end = file_size;
+    while (end > 0) {
+        size_t chunk = end < (off_t)shift_size ? (size_t)end : shift_size;
+        off_t start = end - chunk;
+
+        ssize_t read_bytes = STATS_CALL(&bf->stats, pread(bf->fd, shift_buffer, chunk, start));
+        if (read_bytes != (ssize_t)chunk) {
+            if (read_bytes != -1) {
+                errno = EIO;
+            }
+            perror("pread");
+            free(shift_buffer);
             return -1;
         }
-
-        // Write new content directly if larger than buffer
-        if (count >= bf->write_buffer_size) {
-            ssize_t written_bytes = write(bf->fd, buf, count);
-            if (written_bytes == -1) {
-                perror("write");
-                free(temp_buffer);
-                return -1;
+        ssize_t written_bytes = STATS_CALL(&bf->stats, pwrite(bf->fd, shift_buffer, chunk, start + shift));
+        if (written_bytes != (ssize_t)chunk) {
+            if (written_bytes != -1) {
+                errno = EIO;
             }
+            perror("pwrite");
+            free(shift_buffer);
+            return -1;
+        }
+        stats_add(&bf->stats.prepend_rewritten, chunk);
+        end = start;
+    }
+    free(shift_buffer);
 
-            ssize_t appended_bytes = write(bf->fd, temp_buffer, read_bytes);
-            free(temp_buffer);
+    // Write the new content in the space that was opened up
+    if (prepend_write_front(bf, pending, bf->prepend_len) == -1) {
+        return -1;
+    }
 
-            if (appended_bytes == -1) {
-                perror("write");
-                return -1;
-            }
+    bf->prepend_method = PREPEND_REWRITE;
+    bf->prepend_len = 0;
+    return 0;
+}
 
-            return written_bytes;
-        }
+// Function to report how the last O_PREAPPEND commit was done
+prepend_method_t buffered_prepend_method(const buffered_file_t *bf) {
+    return bf ? bf->prepend_method : PREPEND_NONE;
+}
 
-        // Buffer the new content
-        memcpy(bf->write_buffer, buf, count);
-        bf->write_buffer_pos = count;
+// Function to return the offset of the descriptor, asking the kernel only the first time
+static off_t descriptor_offset(buffered_file_t *bf) {
+    if (bf->fd_offset == -1) {
+        bf->fd_offset = STATS_CALL(&bf->stats, lseek(bf->fd, 0, SEEK_CUR));
+    }
+    return bf->fd_offset;
+}
 
-        // Flush buffer to file
-        if (buffered_flush(bf) == -1) {
-            free(temp_buffer);
-            return -1;
+// Function to account for bytes read or handed to the kernel for writing at the descriptor's offset
+static void advance_offset(buffered_file_t *bf, size_t bytes) {
+    if (bf->flags & O_APPEND) {
+        bf->fd_offset = -1; // Writes went to wherever the end of the file was
+    } else if (bf->fd_offset != -1) {
+        bf->fd_offset += (off_t)bytes;
+    }
+}
+
+// Function to drop the cached pages of [from, to). Dirty pages cannot be dropped, so a handle that
+// writes waits for their write-back first.
+static void cache_drop(buffered_file_t *bf, off_t from, off_t to) {
+    if (to <= from) {
+        return;
+    }
+    if ((bf->flags & O_ACCMODE) != O_RDONLY) {
+        STATS_CALL(&bf->stats, sync_file_range(bf->fd, from, to - from, SYNC_FILE_RANGE_WAIT_BEFORE |
+                                               SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER));
+    }
+    STATS_CALL(&bf->stats, posix_fadvise(bf->fd, from, to - from, POSIX_FADV_DONTNEED));
+}
+
+// Function to drop whatever BUFFERED_CACHE_DROP still holds of the stream
+static void cache_release(buffered_file_t *bf) {
+    if (bf->cache_start != -1) {
+        cache_drop(bf, bf->cache_start, bf->cache_end);
+        bf->cache_start = -1;
+    }
+}
+
+// Function to account for len bytes at offset that the handle just wrote or read in BUFFERED_CACHE_DROP
+// mode. Write-back of written bytes starts at once, so by the time they fall CACHE_DROP_WINDOW behind the
+// newest byte and are dropped there is rarely anything left to wait for.
+static void cache_stream(buffered_file_t *bf, off_t offset, size_t len, int written) {
+    if (written) {
+        STATS_CALL(&bf->stats, sync_file_range(bf->fd, offset, (off_t)len, SYNC_FILE_RANGE_WRITE));
+    }
+    off_t end = offset + (off_t)len;
+    if (bf->cache_start == -1 || offset < bf->cache_start || offset > bf->cache_end) {
+        // The stream jumped: settle the range it left behind
+        cache_release(bf);
+        bf->cache_start = offset;
+        bf->cache_end = end;
+    } else if (end > bf->cache_end) {
+        bf->cache_end = end;
+    }
+    if (bf->cache_end - bf->cache_start >= 2 * (off_t)CACHE_DROP_WINDOW) {
+        off_t to = bf->cache_end - CACHE_DROP_WINDOW;
+        cache_drop(bf, bf->cache_start, to);
+        bf->cache_start = to;
+    }
+}
+
+// Function to account for bytes that reached the file. Anything read ahead may predate them.
+static void note_written(buffered_file_t *bf, size_t bytes) {
+    if (bf->cache == BUFFERED_CACHE_DROP && bytes > 0) {
+        off_t end = bf->fd_offset != -1 && !(bf->flags & O_APPEND) ? bf->fd_offset + (off_t)bytes
+                                                                   : STATS_CALL(&bf->stats, lseek(bf->fd, 0, SEEK_CUR));
+        if (end != -1) {
+            cache_stream(bf, end - (off_t)bytes, bytes, 1);
         }
+    }
+    advance_offset(bf, bytes);
+    if (bf->readahead && descriptor_offset(bf) != -1) {
+        readahead_reset(bf, bf->fd_offset);
+    }
+}
 
-        // Append the existing content
-        ssize_t appended_bytes = write(bf->fd, temp_buffer, read_bytes);
-        free(temp_buffer);
+// Function to drop the read buffer before writing, so the write lands where the caller has read up
+// to instead of after the buffered data, and later reads cannot return bytes the write replaced
+static int switch_to_writing(buffered_file_t *bf) {
+    if (bf->mapped || bf->read_buffer_size == 0) {
+        return 0;
+    }
 
-        if (appended_bytes == -1) {
-            perror("write");
+    size_t unread = bf->read_buffer_size - bf->read_buffer_pos;
+    if (unread > 0) {
+        off_t offset = STATS_CALL(&bf->stats, lseek(bf->fd, -(off_t)unread, SEEK_CUR));
+        if (offset == -1) {
+            perror("lseek");
             return -1;
         }
+        bf->fd_offset = offset;
+    }
+    bf->read_buffer_size = 0;
+    bf->read_buffer_pos = 0;
+    if (bf->readahead && descriptor_offset(bf) != -1) {
+        readahead_reset(bf, bf->fd_offset);
+    }
+    return 0;
+}
 
-        return count;
-    } else {
-        // Regular buffered write logic
-        size_t remaining_space = bf->write_buffer_size - bf->write_buffer_pos;
+// Function to flush pending writes before reading, so reads see them
+static int switch_to_reading(buffered_file_t *bf) {
+    if (bf->write_buffer_pos > 0 || bf->write_queued) {
+        return buffered_flush(bf);
+    }
+    return 0;
+}
 
-        // If count is larger than buffer size, write directly
-        if (count >= bf->write_buffer_size) {
-            // Flush any existing buffer content
-            if (buffered_flush(bf) == -1) {
-                return -1;
-            }
-            return write(bf->fd, buf, count);
-        }
+// Function to take O_DIRECT off the descriptor for good after the filesystem refused an aligned
+// transfer. The handle carries on through the cache and drops it behind itself instead.
+static void direct_disable(buffered_file_t *bf) {
+    STATS_CALL(&bf->stats, fcntl(bf->fd, F_SETFL, bf->status_flags));
+    bf->cache = BUFFERED_CACHE_DROP;
+}
 
-        // Flush if not enough space
-        if (count > remaining_space) {
-            if (buffered_flush(bf) == -1) {
-                return -1;
-            }
-        }
+// Functions to take O_DIRECT off the descriptor around a transfer that is not aligned, and to put it back
+static int direct_suspend(buffered_file_t *bf) {
+    if (bf->cache != BUFFERED_CACHE_DIRECT) {
+        return 0;
+    }
+    return STATS_CALL(&bf->stats, fcntl(bf->fd, F_SETFL, bf->status_flags));
+}
 
-        // Buffer the data
-        memcpy(bf->write_buffer + bf->write_buffer_pos, buf, count);
-        bf->write_buffer_pos += count;
-        return count;
+static void direct_resume(buffered_file_t *bf) {
+    if (bf->cache == BUFFERED_CACHE_DIRECT) {
+        int saved_errno = errno;
+        STATS_CALL(&bf->stats, fcntl(bf->fd, F_SETFL, bf->status_flags | O_DIRECT));
+        errno = saved_errno;
     }
 }
 
-// Function to flush the buffer to the file
-int buffered_flush(buffered_file_t *bf) {
-    if (!bf || bf->fd < 0) {
-        errno = EBADF;
-        perror("buffered_flush");
+// Function to write len bytes of the write buffer at the descriptor's offset, retrying short writes.
+// Unless aligned is set the bytes go through the page cache. Returns 0 or -1 with errno set.
+static int direct_write_out(buffered_file_t *bf, const char *data, size_t len, int aligned) {
+    if (!aligned && direct_suspend(bf) == -1) {
         return -1;
     }
-
-    if (bf->preappend && bf->write_buffer_pos > 0) {
-        // Check the file descriptor
-        if (fcntl(bf->fd, F_GETFD) == -1) {
-            perror("buffered_flush fcntl");
-            return -1;
+    int result = 0;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t written = STATS_CALL(&bf->stats, write(bf->fd, data + done, len - done));
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && aligned && bf->cache == BUFFERED_CACHE_DIRECT) {
+                direct_disable(bf); // The device wants a larger alignment than a page
+                continue;
+            }
+            result = -1;
+            break;
         }
+        done += (size_t)written;
+        note_written(bf, (size_t)written);
+    }
+    if (!aligned) {
+        direct_resume(bf);
+    }
+    return result;
+}
 
-        // Read existing content
-        off_t current_offset = lseek(bf->fd, 0, SEEK_END);
-        if (current_offset == -1) {
-            perror("lseek SEEK_END");
+// Function to write the write buffer of an O_DIRECT handle. The whole blocks go out with O_DIRECT. The
+// bytes up to the first block boundary of the file (after an earlier partial flush) and, with all set,
+// the bytes after the last one go through the page cache; without all those stay buffered.
+static int direct_flush(buffered_file_t *bf, int all) {
+    off_t offset = descriptor_offset(bf);
+    if (offset == -1) {
+        return -1;
+    }
+    size_t align = bf->direct_align;
+    size_t pos = bf->write_buffer_pos;
+    size_t head = (size_t)(offset % (off_t)align);
+    head = head == 0 ? 0 : align - head;
+    if (head > pos) {
+        head = pos;
+    }
+    if (head > 0) {
+        if (direct_write_out(bf, bf->write_buffer, head, 0) == -1) {
             return -1;
         }
+        // The rest starts on a block boundary of the file and must start on one in memory as well
+        pos -= head;
+        memmove(bf->write_buffer, bf->write_buffer + head, pos);
+        bf->write_buffer_pos = pos;
+    }
 
-        char *temp_buffer = malloc(current_offset);
-        if (!temp_buffer) {
-            perror("malloc");
+    size_t middle = pos - pos % align;
+    if (middle > 0 && direct_write_out(bf, bf->write_buffer, middle, 1) == -1) {
+        return -1;
+    }
+    size_t tail = pos - middle;
+    if (tail > 0 && all) {
+        if (direct_write_out(bf, bf->write_buffer + middle, tail, 0) == -1) {
+            memmove(bf->write_buffer, bf->write_buffer + middle, tail);
+            bf->write_buffer_pos = tail;
             return -1;
         }
+        tail = 0;
+    }
+    memmove(bf->write_buffer, bf->write_buffer + middle, tail);
+    bf->write_buffer_pos = tail;
+    stats_add(&bf->stats.flushes, 1);
+    return 0;
+}
 
-        if (lseek(bf->fd, 0, SEEK_SET) == -1) {
-            perror("lseek SEEK_SET");
-            free(temp_buffer);
+// Function to write through the aligned buffer of an O_DIRECT handle. Caller memory is never handed to
+// the kernel directly, since it is rarely aligned; the buffer goes out each time it is full.
+static ssize_t direct_write(buffered_file_t *bf, const char *buf, size_t count) {
+    if (ensure_write_buffer(bf) == -1) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < count) {
+        size_t chunk = bf->write_buffer_size - bf->write_buffer_pos;
+        if (chunk > count - done) {
+            chunk = count - done;
+        }
+        memcpy(bf->write_buffer + bf->write_buffer_pos, buf + done, chunk);
+        bf->write_buffer_pos += chunk;
+        done += chunk;
+        stats_add(&bf->stats.bytes_buffered, chunk);
+        if (bf->write_buffer_pos == bf->write_buffer_size && direct_flush(bf, 0) == -1) {
+            perror("buffered_write: write error");
             return -1;
         }
+    }
+    return (ssize_t)count;
+}
+
+// Function to write to the buffered file
+ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count) {
+    if (!bf || bf->fd < 0) {
+        errno = EBADF;
+        perror("buffered_write");
+        return -1;
+    }
 
-        ssize_t read_bytes = read(bf->fd, temp_buffer, current_offset);
-        if (read_bytes == -1) {
-            perror("read");
-            free(temp_buffer);
+    if (bf->concurrent) {
+        struct iovec iov = { (void *)buf, count };
+        if (concurrent_writev(bf, &iov, 1, count) == -1) {
+            perror("buffered_write: write error");
             return -1;
         }
+        return count;
+    }
 
-        // Write new content
-        if (lseek(bf->fd, 0, SEEK_SET) == -1) {
-            perror("lseek SEEK_SET");
-            free(temp_buffer);
+    // Prepend logic: queue the data in front of what is already pending
+    if (bf->preappend) {
+        if (prepend_pending(bf, buf, count) == -1) {
             return -1;
         }
 
-        ssize_t written_bytes = write(bf->fd, bf->write_buffer, bf->write_buffer_pos);
-        if (written_bytes == -1) {
-            perror("write");
-            free(temp_buffer);
+        // Commit early so a long run of prepends does not hold unbounded memory
+        if (bf->prepend_len >= PREPEND_MAX_PENDING && prepend_commit(bf, 1) == -1) {
             return -1;
         }
 
-        // Append existing content
-        ssize_t appended_bytes = write(bf->fd, temp_buffer, read_bytes);
-        free(temp_buffer);
-
-        if (appended_bytes == -1) {
-            perror("write");
+        stats_add(&bf->stats.bytes_buffered, count);
+        return count;
+    } else {
+        // A failed background write is reported on the next call
+        if (bf->writebehind && writebehind_error(bf) == -1) {
+            perror("buffered_write: write error");
             return -1;
         }
-
-        bf->write_buffer_pos = 0;
-        return 0;
-    } else if (bf->write_buffer_pos > 0) {
-        ssize_t written = write(bf->fd, bf->write_buffer, bf->write_buffer_pos);
-        if (written == -1) {
-            perror("buffered_flush: write error");
+        if (switch_to_writing(bf) == -1) {
             return -1;
         }
-        bf->write_buffer_pos = 0;
-    }
-    return 0;
+        if (bf->cache == BUFFERED_CACHE_DIRECT) {
+            return direct_write(bf, buf, count);
+        }
+
+        // Regular buffered write logic
+        size_t remaining_space = bf->write_buffer_size - bf->write_buffer_pos;
+
+        // If count is larger than buffer size, write directly
+        if (count >= bf->write_buffer_size) {
+            if (!bf->writebehind) {
+                // One writev sends the buffered bytes and the caller's data together
+                struct iovec iov = { (void *)buf, count };
+                return buffered_writev(bf, &iov, 1);
+            }
+            // Flush any existing buffer content
+            if (buffered_flush(bf) == -1) {
+                return -1;
+            }
+            ssize_t written = STATS_CALL(&bf->stats, write(bf->fd, buf, count));
+            if (written > 0) {
+                stats_add(&bf->stats.bytes_direct, (size_t)written);
+                note_written(bf, (size_t)written);
+            }
+            return written;
+        }
+
+        // Flush if not enough space. In write-behind mode the full buffer goes to the flusher and
+        // writing carries on in the next one.
+        if (count > remaining_space) {
+            if (bf->writebehind) {
+                size_t queued = bf->write_buffer_pos;
+                if (writebehind_submit(bf) == -1) {
+                    perror("buffered_write: write error");
+                    return -1;
+                }
+                stats_add(&bf->stats.flushes, 1);
+                advance_offset(bf, queued);
+                bf->write_queued = 1;
+            } else {
+                if (buffered_flush(bf) == -1) {
+                    return -1;
+                }
+                maybe_grow_buffer(bf, &bf->write_buffer, &bf->write_buffer_size, bf->write_buffer_owned, &bf->write_streak);
+            }
+        }
+
+        // Buffer the data
+        if (ensure_write_buffer(bf) == -1) {
+            return -1;
+        }
+        memcpy(bf->write_buffer + bf->write_buffer_pos, buf, count);
+        bf->write_buffer_pos += count;
+        stats_add(&bf->stats.bytes_buffered, count);
+        return count;
+    }
+}
+
+// Function to write a whole iovec array, retrying short writes, as one flush of the handle. The array
+// is used up in the process. Returns the number of bytes written or -1.
+static ssize_t writev_all(buffered_file_t *bf, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += (ssize_t)iov[i].iov_len;
+    }
+    while (iovcnt > 0) {
+        ssize_t written = STATS_CALL(&bf->stats, writev(bf->fd, iov, iovcnt));
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // Skip what was written and continue in the middle of the first iovec that was not finished
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+    stats_add(&bf->stats.flushes, 1);
+    return total;
+}
+
+// Function to write the concatenation of iovcnt buffers
+ssize_t buffered_writev(buffered_file_t *bf, const struct iovec *iov, int iovcnt) {
+    if (!bf || bf->fd < 0) {
+        errno = EBADF;
+        perror("buffered_writev");
+        return -1;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    if (bf->concurrent) {
+        if (concurrent_writev(bf, iov, iovcnt, total) == -1) {
+            perror("buffered_writev: write error");
+            return -1;
+        }
+        return total;
+    }
+
+    if (bf->preappend) {
+        // The pieces go in front one by one, so the last one is queued first
+        for (int i = iovcnt - 1; i >= 0; i--) {
+            if (prepend_pending(bf, iov[i].iov_base, iov[i].iov_len) == -1) {
+                return -1;
+            }
+        }
+        if (bf->prepend_len >= PREPEND_MAX_PENDING && prepend_commit(bf, 1) == -1) {
+            return -1;
+        }
+        stats_add(&bf->stats.bytes_buffered, total);
+        return total;
+    }
+
+    if (bf->writebehind || bf->cache == BUFFERED_CACHE_DIRECT) {
+        // Everything is copied into the flusher's or the aligned buffers anyway
+        for (int i = 0; i < iovcnt; i++) {
+            if (buffered_write(bf, iov[i].iov_base, iov[i].iov_len) == -1) {
+                return -1;
+            }
+        }
+        return total;
+    }
+
+    if (switch_to_writing(bf) == -1 || ensure_write_buffer(bf) == -1) {
+        return -1;
+    }
+
+    // Everything fits: gathering it costs no system call at all
+    if (total <= bf->write_buffer_size - bf->write_buffer_pos) {
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(bf->write_buffer + bf->write_buffer_pos, iov[i].iov_base, iov[i].iov_len);
+            bf->write_buffer_pos += iov[i].iov_len;
+        }
+        stats_add(&bf->stats.bytes_buffered, total);
+        return total;
+    }
+
+    // Otherwise build one writev out of the buffered bytes, runs of small pieces copied behind them
+    // and large pieces referenced in place. The bytes of the buffer from run_start on are not part of
+    // the batch yet.
+    struct iovec batch[WRITEV_BATCH];
+    int count = 0;
+    size_t used = bf->write_buffer_pos;
+    size_t run_start = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len;
+        if (len == 0) {
+            continue;
+        }
+
+        if (len < WRITEV_COPY_MAX && len < bf->write_buffer_size) {
+            if (used + len > bf->write_buffer_size) {
+                // The buffer is full: send the batch, including the run collected so far
+                if (used > run_start) {
+                    batch[count].iov_base = bf->write_buffer + run_start;
+                    batch[count].iov_len = used - run_start;
+                    count++;
+                }
+                ssize_t written = writev_all(bf, batch, count);
+                if (written == -1) {
+                    perror("buffered_writev: write error");
+                    return -1;
+                }
+                note_written(bf, (size_t)written);
+                count = 0;
+                used = 0;
+                run_start = 0;
+            }
+            memcpy(bf->write_buffer + used, iov[i].iov_base, len);
+            used += len;
+            stats_add(&bf->stats.bytes_buffered, len);
+            continue;
+        }
+
+        // A large piece ends the current run of buffered bytes
+        if (used > run_start) {
+            batch[count].iov_base = bf->write_buffer + run_start;
+            batch[count].iov_len = used - run_start;
+            count++;
+            run_start = used;
+        }
+        batch[count].iov_base = iov[i].iov_base;
+        batch[count].iov_len = len;
+        count++;
+        stats_add(&bf->stats.bytes_direct, len);
+
+        // Keep room for one more run and one more piece
+        if (count > WRITEV_BATCH - 2) {
+            ssize_t written = writev_all(bf, batch, count);
+            if (written == -1) {
+                perror("buffered_writev: write error");
+                return -1;
+            }
+            note_written(bf, (size_t)written);
+            count = 0;
+            used = 0;
+            run_start = 0;
+        }
+    }
+
+    if (count > 0) {
+        ssize_t written = writev_all(bf, batch, count);
+        if (written == -1) {
+            perror("buffered_writev: write error");
+            return -1;
+        }
+        note_written(bf, (size_t)written);
+    }
+
+    // Small pieces after the last large one stay buffered for the next write
+    memmove(bf->write_buffer, bf->write_buffer + run_start, used - run_start);
+    bf->write_buffer_pos = used - run_start;
+    return total;
+}
+
+// Function to flush the buffer to the file
+int buffered_flush(buffered_file_t *bf) {
+    if (!bf || bf->fd < 0) {
+        errno = EBADF;
+        perror("buffered_flush");
+        return -1;
+    }
+
+    if (bf->preappend) {
+        return prepend_commit(bf, 0);
+    } else if (bf->concurrent) {
+        if (concurrent_flush(bf) == -1) {
+            perror("buffered_flush: write error");
+            return -1;
+        }
+    } else if (bf->writebehind) {
+        // Queue what is buffered and wait for the flusher to write everything
+        if (bf->write_buffer_pos > 0) {
+            advance_offset(bf, bf->write_buffer_pos);
+            if (writebehind_submit(bf) == -1) {
+                perror("buffered_flush: write error");
+                return -1;
+            }
+            stats_add(&bf->stats.flushes, 1);
+            bf->write_queued = 1;
+        }
+        if (writebehind_drain(bf) == -1) {
+            perror("buffered_flush: write error");
+            return -1;
+        }
+        if (bf->write_queued) {
+            bf->write_queued = 0;
+            note_written(bf, 0);
+        }
+    } else if (bf->cache == BUFFERED_CACHE_DIRECT) {
+        if (bf->write_buffer_pos > 0 && direct_flush(bf, 1) == -1) {
+            perror("buffered_flush: write error");
+            return -1;
+        }
+    } else if (bf->write_buffer_pos > 0) {
+        // Retry short writes; after an error the bytes not yet written stay buffered
+        size_t done = 0;
+        while (done < bf->write_buffer_pos) {
+            ssize_t written = STATS_CALL(&bf->stats, write(bf->fd, bf->write_buffer + done, bf->write_buffer_pos - done));
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                int err = errno;
+                perror("buffered_flush: write error");
+                memmove(bf->write_buffer, bf->write_buffer + done, bf->write_buffer_pos - done);
+                bf->write_buffer_pos -= done;
+                note_written(bf, done);
+                errno = err;
+                return -1;
+            }
+            done += (size_t)written;
+        }
+        stats_add(&bf->stats.flushes, 1);
+        bf->write_buffer_pos = 0;
+        note_written(bf, done);
+    }
+    return 0;
+}
+
+// Function to fill the read buffer of an O_DIRECT handle. Reads start on a block boundary, so after a
+// seek to an unaligned offset the block is read from its start and the bytes before the offset are
+// skipped. Returns the number of bytes past the read position, 0 at end of file.
+static ssize_t direct_refill(buffered_file_t *bf) {
+    off_t offset = descriptor_offset(bf);
+    if (offset == -1) {
+        perror("buffered_read: lseek");
+        return -1;
+    }
+    size_t skip = (size_t)(offset % (off_t)bf->direct_align);
+    ssize_t bytes_read;
+    if (skip == 0) {
+        bytes_read = STATS_CALL(&bf->stats, read(bf->fd, bf->read_buffer, bf->read_buffer_capacity));
+    } else {
+        bytes_read = STATS_CALL(&bf->stats, pread(bf->fd, bf->read_buffer, bf->read_buffer_capacity, offset - (off_t)skip));
+    }
+    if (bytes_read == -1 && errno == EINVAL) {
+        // The device wants a larger alignment than a page: read through the cache from here on
+        direct_disable(bf);
+        skip = 0;
+        bytes_read = STATS_CALL(&bf->stats, read(bf->fd, bf->read_buffer, bf->read_buffer_capacity));
+    }
+    if (bytes_read == -1) {
+        perror("buffered_read: read error");
+        return -1;
+    }
+
+    size_t got = (size_t)bytes_read > skip ? (size_t)bytes_read - skip : 0;
+    if (skip > 0 && got > 0 && STATS_CALL(&bf->stats, lseek(bf->fd, offset + (off_t)got, SEEK_SET)) == -1) {
+        perror("buffered_read: lseek");
+        return -1;
+    }
+    bf->fd_offset = offset + (off_t)got;
+    bf->read_buffer_pos = skip;
+    bf->read_buffer_size = skip + got;
+    return (ssize_t)got;
+}
+
+// Function to refill the empty read buffer. Returns the number of bytes now buffered, 0 at end of file.
+static ssize_t refill_read_buffer(buffered_file_t *bf) {
+    ssize_t bytes_read;
+
+    if (bf->mapped) {
+        // Everything up to the end of the mapping was read; pick up data appended since
+        return map_refill(bf);
+    }
+
+    if (bf->readahead) {
+        // Take the buffer the background reader filled and let it start on the one we drained
+        bytes_read = readahead_next(bf, &bf->read_buffer);
+        if (bytes_read == -1) {
+            perror("buffered_read: read error");
+            return -1;
+        }
+    } else {
+        // A refill that finds the previous buffer used up counts towards growing it
+        if (bf->read_buffer_size > 0) {
+            maybe_grow_buffer(bf, &bf->read_buffer, &bf->read_buffer_capacity, bf->read_buffer_owned,
+                              &bf->read_streak);
+        }
+        if (ensure_read_buffer(bf) == -1) {
+            return -1;
+        }
+        if (bf->cache == BUFFERED_CACHE_DIRECT) {
+            return direct_refill(bf);
+        }
+        off_t start = bf->cache == BUFFERED_CACHE_DROP ? descriptor_offset(bf) : -1;
+        bytes_read = STATS_CALL(&bf->stats, read(bf->fd, bf->read_buffer, bf->read_buffer_capacity));
+        if (bytes_read == -1) {
+            perror("buffered_read: read error");
+            return -1;
+        }
+        advance_offset(bf, (size_t)bytes_read);
+        if (start != -1 && bytes_read > 0) {
+            cache_stream(bf, start, (size_t)bytes_read, 0);
+        }
+    }
+
+    bf->read_buffer_pos = 0;
+    bf->read_buffer_size = bytes_read;
+    return bytes_read;
 }
 
 // Function to read from the buffered file
@@ -270,6 +1135,9 @@ ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
         perror("buffered_read");
         return -1;
     }
+    if (switch_to_reading(bf) == -1) {
+        return -1;
+    }
 
     size_t total_read = 0;
     char *user_buf = buf;
@@ -278,21 +1146,19 @@ ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
         size_t available_data = bf->read_buffer_size - bf->read_buffer_pos;
 
         if (available_data == 0) {
-            ssize_t bytes_read = read(bf->fd, bf->read_buffer, BUFFER_SIZE);
+            ssize_t bytes_read = refill_read_buffer(bf);
             if (bytes_read == -1) {
-                perror("buffered_read: read error");
                 return -1;
             }
             if (bytes_read == 0) {
                 break; // End of file
             }
-            bf->read_buffer_pos = 0;
-            bf->read_buffer_size = bytes_read;
             available_data = bytes_read;
         }
 
         size_t to_copy = (count < available_data) ? count : available_data;
         memcpy(user_buf, bf->read_buffer + bf->read_buffer_pos, to_copy);
+        stats_add(&bf->stats.bytes_buffered, to_copy);
 
         bf->read_buffer_pos += to_copy;
         user_buf += to_copy;
@@ -303,20 +1169,506 @@ ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
     return total_read;
 }
 
-// Function to close the buffered file
-int buffered_close(buffered_file_t *bf) {
-    if (buffered_flush(bf) == -1) {
+// Function to gather at least min_len bytes, or everything up to the end of the file, in one piece.
+// The unread bytes are moved to the front of the read buffer (a larger one if needed) and the rest is
+// read behind them. Read-ahead buffers cannot grow, so they are joined in the peek buffer instead.
+static ssize_t gather_read_buffer(buffered_file_t *bf, size_t min_len) {
+    size_t available = bf->read_buffer_size - bf->read_buffer_pos;
+    const char *unread = bf->read_buffer + bf->read_buffer_pos;
+
+    if (bf->readahead) {
+        // Room for the request plus one whole read-ahead buffer, so a buffer is never split
+        size_t needed = min_len + (bf->max_buffer_size > bf->read_buffer_capacity ? bf->max_buffer_size
+                                                                                  : bf->read_buffer_capacity);
+        if (bf->peek_capacity < needed) {
+            // Grow geometrically so a record spanning many buffers is not copied over and over
+            size_t capacity = bf->peek_capacity * 2 > needed ? bf->peek_capacity * 2 : needed;
+            char *new_buffer = malloc(capacity);
+            if (!new_buffer) {
+                errno = ENOMEM;
+                perror("buffered_peek: buffer allocation");
+                return -1;
+            }
+            memcpy(new_buffer, unread, available);
+            free(bf->peek_buffer);
+            bf->peek_buffer = new_buffer;
+            bf->peek_capacity = capacity;
+        } else {
+            memmove(bf->peek_buffer, unread, available);
+        }
+        bf->read_buffer = bf->peek_buffer;
+        bf->read_buffer_pos = 0;
+        bf->read_buffer_size = available;
+
+        while (bf->read_buffer_size < min_len) {
+            char *data;
+            ssize_t bytes_read = readahead_next(bf, &data);
+            if (bytes_read == -1) {
+                perror("buffered_peek: read error");
+                return -1;
+            }
+            if (bytes_read == 0) {
+                break; // End of file
+            }
+            memcpy(bf->peek_buffer + bf->read_buffer_size, data, (size_t)bytes_read);
+            bf->read_buffer_size += (size_t)bytes_read;
+        }
+        return bf->read_buffer_size;
+    }
+
+    if (!bf->read_buffer_owned || bf->read_buffer_capacity < min_len) {
+        size_t capacity = bf->read_buffer_capacity;
+        while (capacity < min_len) {
+            capacity *= 2;
+        }
+        char *new_buffer = buffer_alloc(bf, capacity);
+        if (!new_buffer) {
+            perror("buffered_peek: buffer allocation");
+            return -1;
+        }
+        memcpy(new_buffer, unread, available);
+        if (bf->read_buffer_owned) {
+            buffer_free(bf, bf->read_buffer, bf->read_buffer_capacity);
+        }
+        bf->read_buffer = new_buffer;
+        bf->read_buffer_capacity = capacity;
+        bf->read_buffer_owned = 1;
+    } else {
+        memmove(bf->read_buffer, unread, available);
+    }
+    bf->read_buffer_pos = 0;
+    bf->read_buffer_size = available;
+
+    // Reads land behind the unread bytes, wherever they end, so an O_DIRECT handle reads through the cache
+    if (direct_suspend(bf) == -1) {
+        perror("buffered_peek: fcntl");
+        return -1;
+    }
+    while (bf->read_buffer_size < min_len) {
+        ssize_t bytes_read = STATS_CALL(&bf->stats, read(bf->fd, bf->read_buffer + bf->read_buffer_size,
+                                                         bf->read_buffer_capacity - bf->read_buffer_size));
+        if (bytes_read == -1) {
+            perror("buffered_peek: read error");
+            direct_resume(bf);
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break; // End of file
+        }
+        advance_offset(bf, (size_t)bytes_read);
+        bf->read_buffer_size += (size_t)bytes_read;
+    }
+    direct_resume(bf);
+    return bf->read_buffer_size;
+}
+
+// Function to look at buffered data without copying it
+ssize_t buffered_peek(buffered_file_t *bf, const void **data, size_t min_len) {
+    if (!bf || bf->fd < 0 || !data) {
+        errno = EBADF;
+        perror("buffered_peek");
+        return -1;
+    }
+    if (switch_to_reading(bf) == -1) {
         return -1;
     }
 
-    int result = close(bf->fd);
+    ssize_t available = bf->read_buffer_size - bf->read_buffer_pos;
+    if (bf->mapped) {
+        if (available == 0 || (size_t)available < min_len) {
+            available = map_refill(bf);
+        }
+    } else {
+        if (available == 0) {
+            available = refill_read_buffer(bf);
+        }
+        if (available > 0 && (size_t)available < min_len) {
+            available = gather_read_buffer(bf, min_len);
+        }
+    }
+    if (available == -1) {
+        return -1;
+    }
+
+    if (bf->mapped && min_len > BUFFER_SIZE) {
+        // The caller is about to scan this range: start paging it in
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = bf->read_buffer_pos & ~(page - 1);
+        size_t length = (size_t)available < min_len ? (size_t)available : min_len;
+        madvise(bf->read_buffer + start, bf->read_buffer_pos + length - start, MADV_WILLNEED);
+    }
+
+    *data = bf->read_buffer + bf->read_buffer_pos;
+    return available;
+}
+
+// Function to mark count bytes returned by buffered_peek as read
+int buffered_consume(buffered_file_t *bf, size_t count) {
+    if (!bf || bf->fd < 0) {
+        errno = EBADF;
+        perror("buffered_consume");
+        return -1;
+    }
+    if (count > bf->read_buffer_size - bf->read_buffer_pos) {
+        errno = EINVAL;
+        perror("buffered_consume");
+        return -1;
+    }
+    bf->read_buffer_pos += count;
+    stats_add(&bf->stats.bytes_buffered, count);
+    return 0;
+}
+
+// Function to return the position the caller sees: the descriptor's offset, less what is buffered but
+// not read yet, plus what is written but not flushed yet
+static off_t logical_offset(buffered_file_t *bf) {
+    if (bf->mapped) {
+        return (off_t)bf->read_buffer_pos;
+    }
+    if (bf->fd_offset == -1 && bf->write_queued && buffered_flush(bf) == -1) {
+        return -1; // O_APPEND writes are queued: only the kernel knows where they end
+    }
+    if (descriptor_offset(bf) == -1) {
+        return -1;
+    }
+    if (bf->write_buffer_pos > 0) {
+        return bf->fd_offset + (off_t)bf->write_buffer_pos;
+    }
+    return bf->fd_offset - (off_t)(bf->read_buffer_size - bf->read_buffer_pos);
+}
+
+// Function to move the descriptor and drop the read buffer
+static off_t seek_descriptor(buffered_file_t *bf, off_t offset, int whence) {
+    off_t result = STATS_CALL(&bf->stats, lseek(bf->fd, offset, whence));
     if (result == -1) {
-        perror("close");
+        perror("buffered_lseek");
+        return -1;
+    }
+    bf->fd_offset = result;
+    bf->read_buffer_size = 0;
+    bf->read_buffer_pos = 0;
+    if (bf->readahead) {
+        readahead_reset(bf, result);
+    }
+    return result;
+}
+
+// Function to move the position of the buffered file
+off_t buffered_lseek(buffered_file_t *bf, off_t offset, int whence) {
+    if (!bf || bf->fd < 0) {
+        errno = EBADF;
+        perror("buffered_lseek");
+        return -1;
+    }
+    if (bf->preappend || bf->concurrent) {
+        // Pending prepends have no position yet, and concurrent appends have no single one
+        errno = EINVAL;
+        perror("buffered_lseek");
+        return -1;
+    }
+
+    off_t current = logical_offset(bf);
+    if (current == -1) {
+        perror("buffered_lseek");
         return -1;
     }
 
-    free(bf->read_buffer);
-    free(bf->write_buffer);
-    free(bf);
+    off_t target;
+    if (whence == SEEK_SET) {
+        target = offset;
+    } else if (whence == SEEK_CUR) {
+        target = current + offset;
+    } else if (bf->mapped) {
+        if (whence != SEEK_END) {
+            errno = EINVAL;
+            perror("buffered_lseek");
+            return -1;
+        }
+        if (map_refill(bf) == -1) {
+            return -1;
+        }
+        target = (off_t)bf->read_buffer_size + offset;
+    } else {
+        // The end of the file, its holes and its data are only known to the kernel
+        if (buffered_flush(bf) == -1) {
+            return -1;
+        }
+        return seek_descriptor(bf, offset, whence);
+    }
+    if (target < 0) {
+        errno = EINVAL;
+        perror("buffered_lseek");
+        return -1;
+    }
+    if (target == current) {
+        return current;
+    }
+
+    if (bf->mapped) {
+        // The mapping covers the whole file, so any position inside it is a move of the read position
+        if ((size_t)target > bf->read_buffer_size && (map_refill(bf) == -1 || (size_t)target > bf->read_buffer_size)) {
+            errno = EINVAL; // A read-only mapping cannot be positioned past its end
+            perror("buffered_lseek");
+            return -1;
+        }
+        bf->read_buffer_pos = (size_t)target;
+        return target;
+    }
+
+    if ((bf->write_buffer_pos > 0 || bf->write_queued) && buffered_flush(bf) == -1) {
+        return -1;
+    }
+
+    // A target inside the read buffer only moves the read position
+    off_t window_end = descriptor_offset(bf);
+    if (window_end != -1 && target <= window_end && target >= window_end - (off_t)bf->read_buffer_size) {
+        bf->read_buffer_pos = bf->read_buffer_size - (size_t)(window_end - target);
+        return target;
+    }
+    return seek_descriptor(bf, target, SEEK_SET);
+}
+
+// Function to check that [offset, offset + count) is a valid range for a positioned read or write
+static int check_range(buffered_file_t *bf, const void *buf, off_t offset, const char *caller) {
+    if (!bf || bf->fd < 0 || !buf) {
+        errno = EBADF;
+        perror(caller);
+        return -1;
+    }
+    if (offset < 0) {
+        errno = EINVAL;
+        perror(caller);
+        return -1;
+    }
     return 0;
 }
+
+// Function to read at an offset until count bytes or the end of the file, retrying short reads. The
+// caller's memory is not aligned, so an O_DIRECT handle reads through the cache.
+static ssize_t pread_all(buffered_file_t *bf, char *buf, size_t count, off_t offset) {
+    if (direct_suspend(bf) == -1) {
+        return -1;
+    }
+    size_t total = 0;
+    while (total < count) {
+        ssize_t bytes_read = STATS_CALL(&bf->stats, pread(bf->fd, buf + total, count - total, offset + (off_t)total));
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            direct_resume(bf);
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break; // End of file
+        }
+        total += (size_t)bytes_read;
+    }
+    direct_resume(bf);
+    if (bf->cache == BUFFERED_CACHE_DROP && total > 0) {
+        cache_stream(bf, offset, total, 0);
+    }
+    stats_add(&bf->stats.bytes_direct, total);
+    return (ssize_t)total;
+}
+
+// Function to write at an offset, retrying short writes. Like pread_all it goes through the cache.
+static ssize_t pwrite_all(buffered_file_t *bf, const char *buf, size_t count, off_t offset) {
+    if (direct_suspend(bf) == -1) {
+        return -1;
+    }
+    size_t total = 0;
+    while (total < count) {
+        ssize_t written = STATS_CALL(&bf->stats, pwrite(bf->fd, buf + total, count - total, offset + (off_t)total));
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            direct_resume(bf);
+            return -1;
+        }
+        total += (size_t)written;
+    }
+    direct_resume(bf);
+    if (bf->cache == BUFFERED_CACHE_DROP && total > 0) {
+        cache_stream(bf, offset, total, 1);
+    }
+    stats_add(&bf->stats.bytes_direct, total);
+    return (ssize_t)total;
+}
+
+// Function to read count bytes at offset without moving the position
+ssize_t buffered_pread(buffered_file_t *bf, void *buf, size_t count, off_t offset) {
+    if (check_range(bf, buf, offset, "buffered_pread") == -1) {
+        return -1;
+    }
+
+    if (bf->mapped) {
+        if ((size_t)offset + count > bf->read_buffer_size && map_refill(bf) == -1) {
+            return -1;
+        }
+        if ((size_t)offset >= bf->read_buffer_size) {
+            return 0;
+        }
+        size_t available = bf->read_buffer_size - (size_t)offset;
+        size_t to_copy = count < available ? count : available;
+        memcpy(buf, bf->read_buffer + offset, to_copy);
+        stats_add(&bf->stats.bytes_buffered, to_copy);
+        return (ssize_t)to_copy;
+    }
+
+    // Pending writes must reach the file first if the read could see them
+    int overlaps = bf->preappend || bf->concurrent || bf->write_queued;
+    if (!overlaps && bf->write_buffer_pos > 0) {
+        off_t start = (bf->flags & O_APPEND) ? -1 : descriptor_offset(bf);
+        overlaps = start == -1 || (offset < start + (off_t)bf->write_buffer_pos && offset + (off_t)count > start);
+    }
+    if (overlaps && buffered_flush(bf) == -1) {
+        return -1;
+    }
+
+    // Served from the read buffer when it holds the whole range
+    if (bf->read_buffer_size > 0 && bf->fd_offset != -1) {
+        off_t window_start = bf->fd_offset - (off_t)bf->read_buffer_size;
+        if (offset >= window_start && offset + (off_t)count <= bf->fd_offset) {
+            memcpy(buf, bf->read_buffer + (offset - window_start), count);
+            stats_add(&bf->stats.bytes_buffered, count);
+            return (ssize_t)count;
+        }
+    }
+
+    ssize_t bytes_read = pread_all(bf, buf, count, offset);
+    if (bytes_read == -1) {
+        perror("buffered_pread: read error");
+    }
+    return bytes_read;
+}
+
+// Function to write count bytes at offset without moving the position
+ssize_t buffered_pwrite(buffered_file_t *bf, const void *buf, size_t count, off_t offset) {
+    if (check_range(bf, buf, offset, "buffered_pwrite") == -1) {
+        return -1;
+    }
+    if (bf->mapped) {
+        errno = EBADF; // Mapped handles are read-only
+        perror("buffered_pwrite");
+        return -1;
+    }
+    if (bf->preappend || bf->concurrent) {
+        errno = EINVAL;
+        perror("buffered_pwrite");
+        return -1;
+    }
+    if (bf->writebehind && writebehind_error(bf) == -1) {
+        perror("buffered_pwrite: write error");
+        return -1;
+    }
+
+    if (bf->flags & O_APPEND) {
+        // Linux appends positioned writes on O_APPEND descriptors; the buffers stay valid
+        if (buffered_flush(bf) == -1) {
+            return -1;
+        }
+        ssize_t written = pwrite_all(bf, buf, count, offset);
+        if (written == -1) {
+            perror("buffered_pwrite: write error");
+        }
+        return written;
+    }
+
+    // A range inside the pending write buffer is updated in place
+    if (bf->write_buffer_pos > 0) {
+        off_t start = descriptor_offset(bf);
+        if (start != -1 && offset >= start && offset + (off_t)count <= start + (off_t)bf->write_buffer_pos) {
+            memcpy(bf->write_buffer + (offset - start), buf, count);
+            stats_add(&bf->stats.bytes_buffered, count);
+            return (ssize_t)count;
+        }
+    }
+    if ((bf->write_buffer_pos > 0 || bf->write_queued) && buffered_flush(bf) == -1) {
+        return -1;
+    }
+
+    // Buffers the background reader is filling past the read buffer may predate the write
+    int restart = 0;
+    if (bf->readahead && descriptor_offset(bf) != -1 && offset + (off_t)count > bf->fd_offset) {
+        if (switch_to_writing(bf) == -1) {
+            return -1;
+        }
+        restart = 1;
+    }
+
+    ssize_t written = pwrite_all(bf, buf, count, offset);
+    if (written == -1) {
+        perror("buffered_pwrite: write error");
+        return -1;
+    }
+    if (restart) {
+        readahead_reset(bf, bf->fd_offset);
+    }
+
+    // Keep buffered read data that the write replaced in step with the file
+    if (bf->read_buffer_size > 0 && bf->fd_offset != -1) {
+        off_t window_start = bf->fd_offset - (off_t)bf->read_buffer_size;
+        off_t from = offset > window_start ? offset : window_start;
+        off_t to = offset + (off_t)count < bf->fd_offset ? offset + (off_t)count : bf->fd_offset;
+        if (from < to) {
+            memcpy(bf->read_buffer + (from - window_start), (const char *)buf + (from - offset), (size_t)(to - from));
+        }
+    }
+    return written;
+}
+
+// Function to copy the counters of a handle
+void buffered_stats(const buffered_file_t *bf, buffered_stats_t *stats) {
+    stats->syscalls = __atomic_load_n(&bf->stats.syscalls, __ATOMIC_RELAXED);
+    stats->kernel_ns = __atomic_load_n(&bf->stats.kernel_ns, __ATOMIC_RELAXED);
+    stats->bytes_buffered = __atomic_load_n(&bf->stats.bytes_buffered, __ATOMIC_RELAXED);
+    stats->bytes_direct = __atomic_load_n(&bf->stats.bytes_direct, __ATOMIC_RELAXED);
+    stats->flushes = __atomic_load_n(&bf->stats.flushes, __ATOMIC_RELAXED);
+    stats->prepend_rewritten = __atomic_load_n(&bf->stats.prepend_rewritten, __ATOMIC_RELAXED);
+}
+
+// Function to set every counter of a handle back to 0
+void buffered_stats_reset(buffered_file_t *bf) {
+    __atomic_store_n(&bf->stats.syscalls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bf->stats.kernel_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bf->stats.bytes_buffered, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bf->stats.bytes_direct, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bf->stats.flushes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bf->stats.prepend_rewritten, 0, __ATOMIC_RELAXED);
+}
+
+// Function to close the buffered file
+int buffered_close(buffered_file_t *bf) {
+    if (!bf) {
+        errno = EBADF;
+        return -1;
+    }
+
+    // A failed flush is reported, but the handle is released anyway: a write-behind error is
+    // sticky, so trying again later could never succeed
+    int result = buffered_flush(bf);
+
+    readahead_stop(bf);
+    writebehind_stop(bf);
+    concurrent_stop(bf);
+    cache_release(bf);
+    if (close(bf->fd) == -1) {
+        perror("close");
+        result = -1;
+    }
+
+    if (bf->mapped && bf->read_buffer) {
+        munmap(bf->read_buffer, bf->read_buffer_size);
+    } else if (bf->read_buffer_owned) {
+        buffer_free(bf, bf->read_buffer, bf->read_buffer_capacity);
+    }
+    if (bf->write_buffer_owned) {
+        buffer_free(bf, bf->write_buffer, bf->write_buffer_size);
+    }
+    free(bf->prepend_buffer);
+    free(bf->peek_buffer);
+    release_handle(bf);
+    return result;
+}
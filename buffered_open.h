@@ -3,6 +3,7 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 // Define a new flag that doesn't collide with existing flags
 #define O_PREAPPEND 0x40000000
@@ -10,6 +11,90 @@
 // Define the standard buffer size for read and write operations
 #define BUFFER_SIZE 4096
 
+// Size of the buffer used to shift existing file contents when O_PREAPPEND data is committed
+#define PREPEND_SHIFT_SIZE (1024 * 1024)
+
+// Upper bound for adaptive buffer growth when no other limit is given
+#define BUFFER_MAX_ADAPTIVE (1024 * 1024)
+
+// Pending O_PREAPPEND data is committed early once it grows past this many bytes
+#define PREPEND_MAX_PENDING (64 * 1024 * 1024)
+
+// Where the buffers of a handle come from
+typedef enum {
+    BUFFERED_ALLOC_MALLOC,      // Heap memory from malloc
+    BUFFERED_ALLOC_HUGEPAGE     // Anonymous mapping backed by huge pages (transparent huge pages if none are reserved)
+} buffered_alloc_t;
+
+// How a handle treats the page cache. Only plain handles use it: O_PREAPPEND, read-ahead, mmap_read,
+// write-behind and concurrent append handles always go through the cache as usual.
+typedef enum {
+    BUFFERED_CACHE_NORMAL,      // Read and write through the page cache
+    BUFFERED_CACHE_DROP,        // Page cache, but written data is written back and dropped, and data read
+                                // is dropped, once it falls a window behind the stream
+    BUFFERED_CACHE_DIRECT       // O_DIRECT with page-aligned buffers. Falls back to BUFFERED_CACHE_DROP where
+                                // the filesystem refuses O_DIRECT, and for O_APPEND handles.
+} buffered_cache_t;
+
+// Pool of handles and buffers shared by many short-lived handles (buffered_pool.c)
+typedef struct buffered_pool buffered_pool_t;
+
+// Counters of a pool, see buffered_pool_stats
+typedef struct {
+    unsigned long handle_hits;      // Handles reused without calling malloc
+    unsigned long handle_misses;    // Slabs of handles that had to be allocated
+    unsigned long buffer_hits;      // Buffers reused without calling malloc
+    unsigned long buffer_misses;    // Buffers that had to be allocated
+    unsigned long buffer_oversize;  // Buffers larger than BUFFER_MAX_ADAPTIVE, never pooled
+} buffered_pool_stats_t;
+
+// Counters of a handle, see buffered_stats. Building the library with -DBUFFERED_NO_STATS compiles the
+// counting out, and every counter then reads 0.
+typedef struct {
+    unsigned long long syscalls;            // Calls made on the descriptor (read, write, seek, allocate, ...)
+    unsigned long long kernel_ns;           // Wall time spent inside those calls, in nanoseconds
+    unsigned long long bytes_buffered;      // Bytes the caller read or wrote that were copied through a buffer
+    unsigned long long bytes_direct;        // Bytes passed between the caller's memory and the kernel uncopied
+    unsigned long long flushes;             // Write buffers handed to the kernel or to a background flusher
+    unsigned long long prepend_rewritten;   // Existing bytes moved up by O_PREAPPEND commits
+} buffered_stats_t;
+
+// Per-handle settings for buffered_open_ex, set to defaults by buffered_options_init
+typedef struct {
+    size_t read_buffer_size;    // Capacity of the read buffer, 0 selects BUFFER_SIZE
+    size_t write_buffer_size;   // Capacity of the write buffer, 0 selects BUFFER_SIZE
+    void *read_buffer;          // Caller-owned read buffer of read_buffer_size bytes, NULL to allocate on first read
+    void *write_buffer;         // Caller-owned write buffer of write_buffer_size bytes, NULL to allocate on first write
+    buffered_alloc_t alloc;     // How buffers that are not supplied by the caller are allocated
+    int adaptive;               // Double an allocated buffer after repeated full refills or flushes (sequential streaming)
+    size_t max_buffer_size;     // Limit for adaptive growth, 0 selects BUFFER_MAX_ADAPTIVE
+    int readahead;              // Fill the next buffer in a background thread while the current one is drained
+    int write_behind;           // Full write buffers a background thread may have queued, 0 writes synchronously.
+                                // The flusher allocates its own buffers, so write_buffer is not used in this mode.
+    int mmap_read;              // Read an O_RDONLY handle through a read-only mapping of the whole file
+    int concurrent_append;      // Let several threads call buffered_write, buffered_writev and buffered_flush
+                                // on the handle at once; each call's data reaches the file as one unbroken record
+    buffered_pool_t *pool;      // Take the handle and its malloc'd buffers from this pool and return them on close
+    buffered_cache_t cache;     // Page cache policy, BUFFERED_CACHE_NORMAL by default
+} buffered_options_t;
+
+// How the pending O_PREAPPEND data was last written to the file
+typedef enum {
+    PREPEND_NONE,               // Nothing has been committed yet
+    PREPEND_PLAIN_WRITE,        // The file was empty, the data was simply written
+    PREPEND_INSERT_RANGE,       // The filesystem opened up the space with FALLOC_FL_INSERT_RANGE, no data moved
+    PREPEND_REWRITE             // Fallback: the existing contents were moved up to make room
+} prepend_method_t;
+
+// Background reader state of a read-ahead handle (buffered_readahead.c)
+struct buffered_readahead;
+
+// Background flusher state of a write-behind handle (buffered_writebehind.c)
+struct buffered_writebehind;
+
+// Shared state of a concurrent append handle (buffered_concurrent.c)
+struct buffered_concurrent;
+
 // Structure to hold the buffer and original flags
 typedef struct {
     int fd;                     // File descriptor for the opened file
@@ -26,21 +111,114 @@ typedef struct {
     int flags;                  // File flags used to control file access modes and options (like O_RDONLY, O_WRONLY)
 
     int preappend;              // Flag to remember if the O_PREAPPEND flag was used, indicating special handling for writes
+
+    char *prepend_buffer;       // Pending O_PREAPPEND data, kept at the end of the buffer so newer writes go in front
+    size_t prepend_capacity;    // Size of the prepend buffer
+    size_t prepend_len;         // Number of pending O_PREAPPEND bytes, committed to the file on flush or close
+    size_t prepend_block_size;  // Filesystem block size, 0 until the first commit looks it up
+    int prepend_insert_errno;   // Why FALLOC_FL_INSERT_RANGE was refused (0 while it works or was never tried)
+    prepend_method_t prepend_method; // How the last commit was done
+
+    size_t read_buffer_capacity;    // Number of bytes the read buffer can hold (read_buffer_size is how many it holds now)
+    int read_buffer_owned;          // The read buffer was allocated here and is released on close
+    int write_buffer_owned;         // The write buffer was allocated here and is released on close
+    buffered_alloc_t alloc;         // How owned buffers are allocated
+    int adaptive;                   // Grow owned buffers on sustained sequential access
+    size_t max_buffer_size;         // Limit for adaptive growth
+    unsigned read_streak;           // Consecutive refills that found the previous buffer fully consumed
+    unsigned write_streak;          // Consecutive flushes caused by a full write buffer
+    struct buffered_readahead *readahead; // Background reader, NULL unless read-ahead is active
+    struct buffered_writebehind *writebehind; // Background flusher, NULL unless write-behind is active
+    struct buffered_concurrent *concurrent; // Multi-producer append state, NULL unless concurrent append is active
+    int mapped;                     // read_buffer is a read-only mapping of the first read_buffer_size bytes of the file
+    char *peek_buffer;              // Joins read-ahead buffers when a peek asks for more than one holds
+    size_t peek_capacity;           // Size of the peek buffer
+    off_t fd_offset;                // Offset of the descriptor (after any queued write-behind data), -1 until needed
+    int write_queued;               // Write-behind buffers were queued since the last flush
+    buffered_pool_t *pool;          // Pool the handle and its owned buffers came from, NULL if malloc'd
+    buffered_stats_t stats;         // Counters, updated by the background threads of the handle as well
+    buffered_cache_t cache;         // Page cache policy in effect; BUFFERED_CACHE_DIRECT only while fd has O_DIRECT
+    size_t direct_align;            // Alignment of buffers, offsets and lengths for O_DIRECT, 0 unless opened direct
+    int status_flags;               // fcntl status flags of fd without O_DIRECT, for unaligned transfers
+    off_t cache_start;              // BUFFERED_CACHE_DROP: start of the streamed range not dropped yet, -1 if none
+    off_t cache_end;                // End of that range
 } buffered_file_t;
 
 // Function to wrap the original open function
 buffered_file_t *buffered_open(const char *pathname, int flags, ...);
 
+// Function to fill an options structure with the default settings
+void buffered_options_init(buffered_options_t *opts);
+
+// Function to open a buffered file with per-handle buffer settings. mode is used with O_CREAT.
+// Buffers are allocated on first use, so a write-only handle never allocates a read buffer.
+buffered_file_t *buffered_open_ex(const char *pathname, int flags, mode_t mode, const buffered_options_t *opts);
+
 // Function to write to the buffered file
 ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count);
 
+// Function to write the concatenation of iovcnt buffers. Small pieces are gathered in the write buffer;
+// large ones go out together with the buffered bytes in a single writev, without being copied.
+ssize_t buffered_writev(buffered_file_t *bf, const struct iovec *iov, int iovcnt);
+
 // Function to read from the buffered file
 ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count);
 
-// Function to flush the buffer to the file
+// Function to look at buffered data without copying it. Makes at least min_len bytes available in one piece
+// unless the file ends first, and points *data at them. Returns the number of bytes available at *data
+// (0 at end of file) or -1 on error. The pointer stays valid until the next call that reads from bf.
+ssize_t buffered_peek(buffered_file_t *bf, const void **data, size_t min_len);
+
+// Function to mark count bytes returned by buffered_peek as read
+int buffered_consume(buffered_file_t *bf, size_t count);
+
+// Function to read one record ending in delim. *record points at the record, delimiter included (the last
+// record of a file may lack it), and stays valid until the next call that reads from bf. A record that fits
+// in the buffer is not copied. Returns the record length, 0 at end of file or -1 on error.
+ssize_t buffered_read_until(buffered_file_t *bf, int delim, const char **record);
+
+// Function to read one newline-terminated line, see buffered_read_until
+ssize_t buffered_getline(buffered_file_t *bf, const char **line);
+
+// Function to move the position of the buffered file. A target inside the buffered read window just moves
+// the read position, and asking for the current position costs no system call. Pending writes are
+// flushed only when the position actually changes. Not available in O_PREAPPEND and concurrent append mode.
+off_t buffered_lseek(buffered_file_t *bf, off_t offset, int whence);
+
+// Function to read count bytes at offset without moving the position. Served from the read buffer when it
+// holds the whole range; pending writes are flushed first only if they overlap it.
+ssize_t buffered_pread(buffered_file_t *bf, void *buf, size_t count, off_t offset);
+
+// Function to write count bytes at offset without moving the position. A range inside the pending write
+// buffer is updated in place, and buffered read data the write replaces is updated to match.
+ssize_t buffered_pwrite(buffered_file_t *bf, const void *buf, size_t count, off_t offset);
+
+// Function to flush the buffer to the file. In O_PREAPPEND mode this commits every pending prepend in one pass.
+// In write-behind mode it waits until everything queued has been written.
 int buffered_flush(buffered_file_t *bf);
 
-// Function to close the buffered file
+// Function to report how the last O_PREAPPEND commit was done. When it is PREPEND_REWRITE and the
+// pending size was block aligned, prepend_insert_errno tells why the fast path was refused.
+prepend_method_t buffered_prepend_method(const buffered_file_t *bf);
+
+// Function to copy the counters of a handle into *stats. Safe to call while other threads use the handle.
+void buffered_stats(const buffered_file_t *bf, buffered_stats_t *stats);
+
+// Function to set every counter of a handle back to 0
+void buffered_stats_reset(buffered_file_t *bf);
+
+// Function to close the buffered file. The handle is released even when the final flush fails.
 int buffered_close(buffered_file_t *bf);
 
+// Function to create a pool for buffered_options_t.pool. Handles are carved from slabs and buffers are kept
+// on free lists per power-of-two size class; each thread works from its own cache and only takes the
+// pool's lock to exchange half a cache at a time. Memory is kept until the pool is destroyed.
+buffered_pool_t *buffered_pool_create(void);
+
+// Function to release a pool and everything it keeps. Every handle opened with it must be closed first.
+void buffered_pool_destroy(buffered_pool_t *pool);
+
+// Function to report how often the pool served a handle or buffer without calling malloc
+void buffered_pool_stats(buffered_pool_t *pool, buffered_pool_stats_t *stats);
+
 #endif // BUFFERED_OPEN_H
@@ -0,0 +1,324 @@
+#include "buffered_internal.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+// Buffer size classes are powers of two from BUFFER_SIZE up to BUFFER_MAX_ADAPTIVE
+#define POOL_CLASSES 9
+
+// Handles carved out of one slab allocation
+#define POOL_SLAB_HANDLES 64
+
+// Objects a thread cache keeps per list before it hands half of them back to the shared lists
+#define POOL_CACHE_MAX 16
+
+// A free handle or buffer; the link is stored in the object itself
+typedef struct pool_free {
+    struct pool_free *next;
+} pool_free_t;
+
+// One slab of handles, released when the pool is destroyed
+typedef struct pool_slab {
+    struct pool_slab *next;
+    buffered_file_t handles[POOL_SLAB_HANDLES];
+} pool_slab_t;
+
+// Per-thread cache of one pool. Only the owning thread touches the lists, so they need no lock; the
+// counters are atomics so buffered_pool_stats can read them from another thread.
+typedef struct pool_cache {
+    struct pool_cache *next;        // Registered caches of the pool, guarded by the pool's lock
+    struct pool_cache *prev;
+    buffered_pool_t *pool;
+    pool_free_t *handles;
+    unsigned handle_count;
+    pool_free_t *buffers[POOL_CLASSES];
+    unsigned buffer_count[POOL_CLASSES];
+    atomic_ulong handle_hits;
+    atomic_ulong handle_misses;
+    atomic_ulong buffer_hits;
+    atomic_ulong buffer_misses;
+    atomic_ulong buffer_oversize;
+} pool_cache_t;
+
+// A pool of handles and buffers shared by the threads that open files with it
+struct buffered_pool {
+    pthread_mutex_t lock;
+    pthread_key_t key;              // Each thread's pool_cache_t, returned to the pool when the thread exits
+    pool_cache_t *caches;
+    pool_slab_t *slabs;
+    pool_free_t *handles;           // Shared free lists, filled from thread caches that overflow
+    pool_free_t *buffers[POOL_CLASSES];
+    buffered_pool_stats_t retired;  // Counters of caches whose threads have exited
+};
+
+// Function to count an event in a counter only the calling thread writes
+static void pool_count(atomic_ulong *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+// Function to return the size class of a buffer, or -1 if it is too large to be pooled
+static int pool_class(size_t size) {
+    size_t class_size = BUFFER_SIZE;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        if (size <= class_size) {
+            return i;
+        }
+        class_size *= 2;
+    }
+    return -1;
+}
+
+// Function to move up to count objects from the front of one list to another. Returns how many were moved.
+static unsigned pool_move(pool_free_t **from, pool_free_t **to, unsigned count) {
+    unsigned moved = 0;
+    while (moved < count && *from) {
+        pool_free_t *object = *from;
+        *from = object->next;
+        object->next = *to;
+        *to = object;
+        moved++;
+    }
+    return moved;
+}
+
+// Function to hand everything in a cache back to the shared lists. Called with the pool's lock held.
+static void pool_cache_drain(buffered_pool_t *pool, pool_cache_t *cache) {
+    pool_move(&cache->handles, &pool->handles, cache->handle_count);
+    cache->handle_count = 0;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        pool_move(&cache->buffers[i], &pool->buffers[i], cache->buffer_count[i]);
+        cache->buffer_count[i] = 0;
+    }
+}
+
+// Function run when a thread that used the pool exits
+static void pool_cache_release(void *arg) {
+    pool_cache_t *cache = arg;
+    buffered_pool_t *pool = cache->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    pool_cache_drain(pool, cache);
+    pool->retired.handle_hits += atomic_load(&cache->handle_hits);
+    pool->retired.handle_misses += atomic_load(&cache->handle_misses);
+    pool->retired.buffer_hits += atomic_load(&cache->buffer_hits);
+    pool->retired.buffer_misses += atomic_load(&cache->buffer_misses);
+    pool->retired.buffer_oversize += atomic_load(&cache->buffer_oversize);
+    if (cache->prev) {
+        cache->prev->next = cache->next;
+    } else {
+        pool->caches = cache->next;
+    }
+    if (cache->next) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(cache);
+}
+
+// Function to return the calling thread's cache, creating it on first use
+static pool_cache_t *pool_cache(buffered_pool_t *pool) {
+    pool_cache_t *cache = pthread_getspecific(pool->key);
+    if (cache) {
+        return cache;
+    }
+
+    cache = calloc(1, sizeof(pool_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    cache->pool = pool;
+    if (pthread_setspecific(pool->key, cache) != 0) {
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    cache->next = pool->caches;
+    if (pool->caches) {
+        pool->caches->prev = cache;
+    }
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->lock);
+    return cache;
+}
+
+// Function to create an empty pool
+buffered_pool_t *buffered_pool_create(void) {
+    buffered_pool_t *pool = calloc(1, sizeof(buffered_pool_t));
+    if (!pool) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    int err = pthread_key_create(&pool->key, pool_cache_release);
+    if (err != 0) {
+        free(pool);
+        errno = err;
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+// Function to release a pool and everything it keeps. Every handle opened with it must be closed.
+void buffered_pool_destroy(buffered_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+
+    // Thread caches are not returned by their threads anymore once the key is gone
+    pthread_key_delete(pool->key);
+    while (pool->caches) {
+        pool_cache_t *cache = pool->caches;
+        pool->caches = cache->next;
+        pool_cache_drain(pool, cache);
+        free(cache);
+    }
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        while (pool->buffers[i]) {
+            pool_free_t *buffer = pool->buffers[i];
+            pool->buffers[i] = buffer->next;
+            free(buffer);
+        }
+    }
+    while (pool->slabs) {
+        pool_slab_t *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// Function to report how often the pool could serve a request without calling malloc
+void buffered_pool_stats(buffered_pool_t *pool, buffered_pool_stats_t *stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->retired;
+    for (pool_cache_t *cache = pool->caches; cache; cache = cache->next) {
+        stats->handle_hits += atomic_load_explicit(&cache->handle_hits, memory_order_relaxed);
+        stats->handle_misses += atomic_load_explicit(&cache->handle_misses, memory_order_relaxed);
+        stats->buffer_hits += atomic_load_explicit(&cache->buffer_hits, memory_order_relaxed);
+        stats->buffer_misses += atomic_load_explicit(&cache->buffer_misses, memory_order_relaxed);
+        stats->buffer_oversize += atomic_load_explicit(&cache->buffer_oversize, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to take a handle from the pool
+buffered_file_t *pool_handle_get(buffered_pool_t *pool) {
+    pool_cache_t *cache = pool_cache(pool);
+    if (!cache) {
+        return NULL;
+    }
+
+    if (!cache->handles) {
+        // Refill the cache with half a cache's worth from the shared list, or carve a new slab
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->handles) {
+            pool_slab_t *slab = malloc(sizeof(pool_slab_t));
+            if (!slab) {
+                pthread_mutex_unlock(&pool->lock);
+                return NULL;
+            }
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            for (int i = POOL_SLAB_HANDLES - 1; i >= 0; i--) {
+                pool_free_t *handle = (pool_free_t *)&slab->handles[i];
+                handle->next = pool->handles;
+                pool->handles = handle;
+            }
+            pool_count(&cache->handle_misses);
+        } else {
+            pool_count(&cache->handle_hits);
+        }
+        cache->handle_count = pool_move(&pool->handles, &cache->handles, POOL_CACHE_MAX / 2);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        pool_count(&cache->handle_hits);
+    }
+
+    pool_free_t *handle = cache->handles;
+    cache->handles = handle->next;
+    cache->handle_count--;
+    return (buffered_file_t *)handle;
+}
+
+// Function to give a closed handle back to the pool
+void pool_handle_put(buffered_pool_t *pool, buffered_file_t *bf) {
+    pool_cache_t *cache = pool_cache(pool);
+    pool_free_t *handle = (pool_free_t *)bf;
+
+    if (!cache) {
+        pthread_mutex_lock(&pool->lock);
+        handle->next = pool->handles;
+        pool->handles = handle;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    handle->next = cache->handles;
+    cache->handles = handle;
+    if (++cache->handle_count > POOL_CACHE_MAX) {
+        pthread_mutex_lock(&pool->lock);
+        pool_move(&cache->handles, &pool->handles, POOL_CACHE_MAX / 2);
+        pthread_mutex_unlock(&pool->lock);
+        cache->handle_count -= POOL_CACHE_MAX / 2;
+    }
+}
+
+// Function to take a buffer of at least size bytes from the pool
+char *pool_buffer_get(buffered_pool_t *pool, size_t size) {
+    pool_cache_t *cache = pool_cache(pool);
+    int class = pool_class(size);
+
+    if (class == -1) {
+        if (cache) {
+            pool_count(&cache->buffer_oversize);
+        }
+        return malloc(size);
+    }
+    if (!cache) {
+        return malloc((size_t)BUFFER_SIZE << class);
+    }
+
+    if (!cache->buffers[class]) {
+        pthread_mutex_lock(&pool->lock);
+        cache->buffer_count[class] = pool_move(&pool->buffers[class], &cache->buffers[class], POOL_CACHE_MAX / 2);
+        pthread_mutex_unlock(&pool->lock);
+        if (cache->buffer_count[class] == 0) {
+            pool_count(&cache->buffer_misses);
+            return malloc((size_t)BUFFER_SIZE << class);
+        }
+    }
+    pool_free_t *buffer = cache->buffers[class];
+    cache->buffers[class] = buffer->next;
+    cache->buffer_count[class]--;
+    pool_count(&cache->buffer_hits);
+    return (char *)buffer;
+}
+
+// Function to give a buffer obtained from pool_buffer_get back to the pool
+void pool_buffer_put(buffered_pool_t *pool, char *buffer, size_t size) {
+    int class = pool_class(size);
+    if (class == -1) {
+        free(buffer);
+        return;
+    }
+
+    pool_cache_t *cache = pool_cache(pool);
+    pool_free_t *object = (pool_free_t *)buffer;
+    if (!cache) {
+        pthread_mutex_lock(&pool->lock);
+        object->next = pool->buffers[class];
+        pool->buffers[class] = object;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    object->next = cache->buffers[class];
+    cache->buffers[class] = object;
+    if (++cache->buffer_count[class] > POOL_CACHE_MAX) {
+        pthread_mutex_lock(&pool->lock);
+        pool_move(&cache->buffers[class], &pool->buffers[class], POOL_CACHE_MAX / 2);
+        pthread_mutex_unlock(&pool->lock);
+        cache->buffer_count[class] -= POOL_CACHE_MAX / 2;
+    }
+}
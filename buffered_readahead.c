@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include "buffered_internal.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+// Number of buffers cycled between the background reader and the consumer
+#define READAHEAD_SLOTS 2
+
+// State of the background reader of one handle
+struct buffered_readahead {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;          // Signalled when a slot becomes ready
+    pthread_cond_t drained;         // Signalled when a slot is released, on reset and on stop
+
+    int fd;
+    buffered_stats_t *stats;        // Counters of the handle
+    char *buffers[READAHEAD_SLOTS]; // Each buffer holds up to max_window bytes
+    off_t offsets[READAHEAD_SLOTS]; // File offset each ready slot was read from
+    ssize_t lengths[READAHEAD_SLOTS]; // Bytes in a ready slot, 0 at end of file, -1 on error
+    int errors[READAHEAD_SLOTS];    // errno of a failed fill
+    int ready[READAHEAD_SLOTS];     // Slot holds data the consumer has not taken yet
+
+    int fill_slot;                  // Slot the reader fills next
+    int consume_slot;               // Slot the consumer holds, -1 when it holds none
+    int next_slot;                  // Slot the consumer takes next
+    off_t next_offset;              // File offset of the next fill
+    off_t position;                 // Where the descriptor's offset was left after the last refill
+    size_t window;                  // Bytes requested per fill, doubled while access stays sequential
+    size_t min_window;
+    size_t max_window;
+    unsigned generation;            // Bumped on reset so a fill of the old position is thrown away
+    int eof;                        // The reader saw end of file and waits for a reset
+    int stop;
+};
+
+// Function run by the background reader
+static void *readahead_main(void *arg) {
+    struct buffered_readahead *ra = arg;
+
+    pthread_mutex_lock(&ra->lock);
+    for (;;) {
+        while (!ra->stop && (ra->eof || ra->ready[ra->fill_slot] || ra->fill_slot == ra->consume_slot)) {
+            pthread_cond_wait(&ra->drained, &ra->lock);
+        }
+        if (ra->stop) {
+            break;
+        }
+
+        int slot = ra->fill_slot;
+        off_t offset = ra->next_offset;
+        size_t window = ra->window;
+        unsigned generation = ra->generation;
+        pthread_mutex_unlock(&ra->lock);
+
+        ssize_t bytes_read;
+        do {
+            bytes_read = STATS_CALL(ra->stats, pread(ra->fd, ra->buffers[slot], window, offset));
+        } while (bytes_read == -1 && errno == EINTR);
+        int err = errno;
+        if (bytes_read > 0) {
+            // Let the kernel start on the window after this one while the consumer works
+            STATS_CALL(ra->stats, readahead(ra->fd, offset + bytes_read, window));
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        if (generation != ra->generation) {
+            continue; // The consumer moved elsewhere while we were reading
+        }
+        ra->offsets[slot] = offset;
+        ra->lengths[slot] = bytes_read;
+        ra->errors[slot] = err;
+        ra->ready[slot] = 1;
+        if (bytes_read <= 0) {
+            ra->eof = 1;
+        } else {
+            ra->next_offset = offset + bytes_read;
+        }
+        ra->fill_slot = (slot + 1) % READAHEAD_SLOTS;
+        pthread_cond_signal(&ra->filled);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+// Function to start the background reader of a handle
+int readahead_start(buffered_file_t *bf) {
+    struct buffered_readahead *ra = calloc(1, sizeof(struct buffered_readahead));
+    if (!ra) {
+        return -1;
+    }
+
+    ra->fd = bf->fd;
+    ra->stats = &bf->stats;
+    ra->min_window = bf->read_buffer_capacity;
+    ra->max_window = bf->max_buffer_size > ra->min_window ? bf->max_buffer_size : ra->min_window;
+    ra->window = ra->min_window;
+    ra->consume_slot = -1;
+    ra->next_offset = STATS_CALL(&bf->stats, lseek(bf->fd, 0, SEEK_CUR));
+    ra->position = ra->next_offset;
+    if (ra->next_offset == -1) {
+        free(ra);
+        return -1; // Pipes and sockets cannot be read at an offset
+    }
+
+    for (int i = 0; i < READAHEAD_SLOTS; i++) {
+        ra->buffers[i] = malloc(ra->max_window);
+        if (!ra->buffers[i]) {
+            for (int j = 0; j < i; j++) {
+                free(ra->buffers[j]);
+            }
+            free(ra);
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->filled, NULL);
+    pthread_cond_init(&ra->drained, NULL);
+    if (pthread_create(&ra->thread, NULL, readahead_main, ra) != 0) {
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->filled);
+        pthread_cond_destroy(&ra->drained);
+        for (int i = 0; i < READAHEAD_SLOTS; i++) {
+            free(ra->buffers[i]);
+        }
+        free(ra);
+        return -1;
+    }
+
+    posix_fadvise(bf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    bf->readahead = ra;
+    return 0;
+}
+
+// Function to hand the next filled buffer to the consumer. The descriptor's offset is kept where a
+// plain read would have left it, and a caller that moved it in between is treated as random access.
+ssize_t readahead_next(buffered_file_t *bf, char **data) {
+    struct buffered_readahead *ra = bf->readahead;
+
+    off_t current = STATS_CALL(&bf->stats, lseek(bf->fd, 0, SEEK_CUR));
+    if (current != -1 && current != ra->position) {
+        readahead_reset(bf, current);
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    if (ra->consume_slot >= 0) {
+        // The previous buffer was drained: hand it back and widen the window
+        ra->ready[ra->consume_slot] = 0;
+        ra->consume_slot = -1;
+        if (ra->window < ra->max_window) {
+            ra->window = ra->window * 2 > ra->max_window ? ra->max_window : ra->window * 2;
+        }
+        pthread_cond_signal(&ra->drained);
+    }
+
+    int slot = ra->next_slot;
+
+    while (!ra->ready[slot]) {
+        pthread_cond_wait(&ra->filled, &ra->lock);
+    }
+    ssize_t length = ra->lengths[slot];
+    if (length <= 0) {
+        // End of file or an error: start over at the same position, so a later call sees data
+        // appended in the meantime just like a plain read would
+        int err = ra->errors[slot];
+        off_t position = ra->position;
+        pthread_mutex_unlock(&ra->lock);
+        readahead_reset(bf, position);
+        if (length == -1) {
+            errno = err;
+        }
+        return length;
+    }
+    ra->consume_slot = slot;
+    ra->next_slot = (slot + 1) % READAHEAD_SLOTS;
+    ra->position = ra->offsets[slot] + length;
+    pthread_mutex_unlock(&ra->lock);
+
+    if (STATS_CALL(&bf->stats, lseek(bf->fd, ra->position, SEEK_SET)) == -1) {
+        perror("lseek");
+        return -1;
+    }
+    bf->fd_offset = ra->position;
+    *data = ra->buffers[slot];
+    return length;
+}
+
+// Function to drop everything read ahead and restart at offset with the smallest window
+void readahead_reset(buffered_file_t *bf, off_t offset) {
+    struct buffered_readahead *ra = bf->readahead;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->generation++;
+    for (int i = 0; i < READAHEAD_SLOTS; i++) {
+        ra->ready[i] = 0;
+    }
+    ra->consume_slot = -1;
+    ra->fill_slot = 0;
+    ra->next_slot = 0;
+    ra->next_offset = offset;
+    ra->position = offset;
+    ra->window = ra->min_window;
+    ra->eof = 0;
+    pthread_cond_signal(&ra->drained);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+// Function to stop the background reader and release its buffers
+void readahead_stop(buffered_file_t *bf) {
+    struct buffered_readahead *ra = bf->readahead;
+    if (!ra) {
+        return;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_signal(&ra->drained);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->filled);
+    pthread_cond_destroy(&ra->drained);
+    for (int i = 0; i < READAHEAD_SLOTS; i++) {
+        free(ra->buffers[i]);
+    }
+    free(ra);
+    bf->readahead = NULL;
+}
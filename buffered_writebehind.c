@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include "buffered_internal.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+// State of the background flusher of one handle. The buffers are used round robin: the queued ones
+// are head .. head + queued - 1, and the producer fills the one right after them.
+struct buffered_writebehind {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;            // Signalled when a buffer is queued and on stop
+    pthread_cond_t done;            // Signalled when a buffer has been written
+
+    int fd;
+    buffered_stats_t *stats;        // Counters of the handle
+    int depth;                      // Most buffers that may be queued at once
+    char **buffers;                 // depth + 1 buffers of the handle's write buffer size
+    size_t *lengths;                // Bytes to write from each queued buffer
+    int head;                       // Oldest queued buffer, the one the flusher works on
+    int queued;                     // Buffers queued or being written
+    int error;                      // errno of the first failed write, sticky until close
+    int stop;
+};
+
+// Function to write a whole buffer, retrying short writes
+static int writebehind_write_all(struct buffered_writebehind *wb, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = STATS_CALL(wb->stats, write(wb->fd, data, len));
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        if (written == 0) {
+            return EIO;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+// Function run by the background flusher
+static void *writebehind_main(void *arg) {
+    struct buffered_writebehind *wb = arg;
+
+    pthread_mutex_lock(&wb->lock);
+    for (;;) {
+        while (!wb->stop && wb->queued == 0) {
+            pthread_cond_wait(&wb->work, &wb->lock);
+        }
+        if (wb->queued == 0) {
+            break; // Stopped with nothing left to write
+        }
+
+        int slot = wb->head;
+        int skip = wb->error != 0;
+        pthread_mutex_unlock(&wb->lock);
+
+        // After a failure the rest is dropped: writing it would leave a hole in the file
+        int err = skip ? 0 : writebehind_write_all(wb, wb->buffers[slot], wb->lengths[slot]);
+
+        pthread_mutex_lock(&wb->lock);
+        if (err != 0 && wb->error == 0) {
+            wb->error = err;
+        }
+        wb->head = (wb->head + 1) % (wb->depth + 1);
+        wb->queued--;
+        pthread_cond_broadcast(&wb->done);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+// Function to release the buffers of a flusher
+static void writebehind_free(struct buffered_writebehind *wb) {
+    if (wb->buffers) {
+        for (int i = 0; i <= wb->depth; i++) {
+            free(wb->buffers[i]);
+        }
+    }
+    free(wb->buffers);
+    free(wb->lengths);
+    free(wb);
+}
+
+// Function to start the background flusher of a handle
+int writebehind_start(buffered_file_t *bf, int depth) {
+    struct buffered_writebehind *wb = calloc(1, sizeof(struct buffered_writebehind));
+    if (!wb) {
+        return -1;
+    }
+
+    wb->fd = bf->fd;
+    wb->stats = &bf->stats;
+    wb->depth = depth;
+    wb->buffers = calloc((size_t)depth + 1, sizeof(char *));
+    wb->lengths = calloc((size_t)depth + 1, sizeof(size_t));
+    if (!wb->buffers || !wb->lengths) {
+        writebehind_free(wb);
+        return -1;
+    }
+    for (int i = 0; i <= depth; i++) {
+        wb->buffers[i] = malloc(bf->write_buffer_size);
+        if (!wb->buffers[i]) {
+            writebehind_free(wb);
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->work, NULL);
+    pthread_cond_init(&wb->done, NULL);
+    if (pthread_create(&wb->thread, NULL, writebehind_main, wb) != 0) {
+        pthread_mutex_destroy(&wb->lock);
+        pthread_cond_destroy(&wb->work);
+        pthread_cond_destroy(&wb->done);
+        writebehind_free(wb);
+        return -1;
+    }
+
+    // The producer fills the pool's buffers from now on
+    bf->write_buffer = wb->buffers[0];
+    bf->write_buffer_owned = 0;
+    bf->writebehind = wb;
+    return 0;
+}
+
+// Function to report a failed background write. Returns -1 with errno set once one has failed.
+int writebehind_error(buffered_file_t *bf) {
+    struct buffered_writebehind *wb = bf->writebehind;
+
+    pthread_mutex_lock(&wb->lock);
+    int err = wb->error;
+    pthread_mutex_unlock(&wb->lock);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to queue the filled write buffer and give the producer an empty one
+int writebehind_submit(buffered_file_t *bf) {
+    struct buffered_writebehind *wb = bf->writebehind;
+
+    pthread_mutex_lock(&wb->lock);
+    // Backpressure: with every other buffer queued, wait for the flusher to finish one
+    while (wb->queued == wb->depth && wb->error == 0) {
+        pthread_cond_wait(&wb->done, &wb->lock);
+    }
+    if (wb->error != 0) {
+        int err = wb->error;
+        pthread_mutex_unlock(&wb->lock);
+        errno = err;
+        return -1;
+    }
+
+    int slot = (wb->head + wb->queued) % (wb->depth + 1);
+    wb->lengths[slot] = bf->write_buffer_pos;
+    wb->queued++;
+    pthread_cond_signal(&wb->work);
+    bf->write_buffer = wb->buffers[(slot + 1) % (wb->depth + 1)];
+    pthread_mutex_unlock(&wb->lock);
+
+    bf->write_buffer_pos = 0;
+    return 0;
+}
+
+// Function to wait until every queued buffer has been written. Returns -1 with errno set if one failed.
+int writebehind_drain(buffered_file_t *bf) {
+    struct buffered_writebehind *wb = bf->writebehind;
+
+    pthread_mutex_lock(&wb->lock);
+    while (wb->queued > 0) {
+        pthread_cond_wait(&wb->done, &wb->lock);
+    }
+    int err = wb->error;
+    pthread_mutex_unlock(&wb->lock);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to stop the background flusher and release its buffers. Anything still queued is written first.
+void writebehind_stop(buffered_file_t *bf) {
+    struct buffered_writebehind *wb = bf->writebehind;
+    if (!wb) {
+        return;
+    }
+
+    pthread_mutex_lock(&wb->lock);
+    wb->stop = 1;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->thread, NULL);
+
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->work);
+    pthread_cond_destroy(&wb->done);
+    writebehind_free(wb);
+    bf->write_buffer = NULL;
+    bf->writebehind = NULL;
+}
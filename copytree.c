@@ -1,4 +1,5 @@
-#include "copytree.h"
+#define _GNU_SOURCE
+#include "copytree_internal.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,57 +10,271 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 
-// Function to delete a file or directory recursively
-int delete_path(const char *path) {
-    struct stat statbuf;
-    if (lstat(path, &statbuf) != 0) {
-        perror("stat");
+// Function to start reading the entries of an open directory
+int dir_reader_open(dir_reader_t *reader, int fd) {
+    reader->fd = fd;
+    reader->pos = 0;
+    reader->len = 0;
+    reader->offset = 0;
+    reader->buffer = malloc(DIR_READ_BUFFER_SIZE);
+    if (!reader->buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to return the next entry of a directory, skipping "." and "..". Returns 1 with *entry
+// filled in, 0 at the end of the directory and -1 with errno set on failure. The name stays valid
+// until the next call.
+int dir_reader_next(dir_reader_t *reader, dir_entry_t *entry) {
+    for (;;) {
+        if (reader->pos >= reader->len) {
+            // One system call returns as many entries as fit in the buffer
+            ssize_t bytes = getdents64(reader->fd, reader->buffer, DIR_READ_BUFFER_SIZE);
+            if (bytes == -1) {
+                return -1;
+            }
+            if (bytes == 0) {
+                return 0;
+            }
+            reader->pos = 0;
+            reader->len = (size_t)bytes;
+        }
+
+        struct dirent64 *raw = (struct dirent64 *)(reader->buffer + reader->pos);
+        reader->pos += raw->d_reclen;
+        reader->offset = (off_t)raw->d_off;
+        const char *name = raw->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        entry->name = name;
+        entry->type = raw->d_type;
+        entry->ino = (ino_t)raw->d_ino;
+        return 1;
+    }
+}
+
+// Function to read a directory again from its first entry
+void dir_reader_rewind(dir_reader_t *reader) {
+    lseek(reader->fd, 0, SEEK_SET);
+    reader->pos = 0;
+    reader->len = 0;
+    reader->offset = 0;
+}
+
+// Function to let go of a reader whose directory is about to be closed. Only its position is
+// kept; entries that were read ahead are read again by dir_reader_resume.
+void dir_reader_suspend(dir_reader_t *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+    reader->fd = -1;
+    reader->pos = 0;
+    reader->len = 0;
+}
+
+// Function to continue a suspended reader on a new descriptor of the same directory, from the entry
+// after the last one it returned
+int dir_reader_resume(dir_reader_t *reader, int fd) {
+    reader->buffer = malloc(DIR_READ_BUFFER_SIZE);
+    if (!reader->buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+    reader->fd = fd;
+    if (lseek(fd, reader->offset, SEEK_SET) == -1) {
         return -1;
     }
+    return 0;
+}
 
-    if (S_ISDIR(statbuf.st_mode)) {
-        // It's a directory, so remove its contents first
-        DIR *dir = opendir(path);
-        if (!dir) {
+// Function to open the parent of the open directory fd again after its descriptor was closed, and
+// check that it is still the same directory. flags are those of openat.
+int reopen_parent(int fd, int flags, dev_t dev, ino_t ino) {
+    int parent = openat(fd, "..", flags | O_DIRECTORY | O_CLOEXEC);
+    if (parent == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(parent, &st) == -1 || st.st_dev != dev || st.st_ino != ino) {
+        close(parent);
+        errno = ESTALE; // Moved away while we were below it
+        return -1;
+    }
+    return parent;
+}
+
+// Function to find the device and inode number of an open directory before it is closed
+static int directory_identity(int fd, dev_t *dev, ino_t *ino) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    *dev = st.st_dev;
+    *ino = st.st_ino;
+    return 0;
+}
+
+// Function to release the buffer of a reader. The directory itself stays open.
+void dir_reader_close(dir_reader_t *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+// One directory of a sequential delete in progress
+typedef struct {
+    int fd;                     // -1 while closed to stay within DIR_OPEN_DEPTH
+    char *name;                 // Name of the directory in its parent
+    dev_t dev;                  // Identity of the directory, checked when it is opened again
+    ino_t ino;
+    int removed;                // Entries removed in the current pass over the directory
+    dir_reader_t reader;
+} delete_frame_t;
+
+// Function to open the subdirectory name of parent_fd and put it on top of the delete stack. The
+// shallowest open level is closed first when DIR_OPEN_DEPTH levels are open already.
+static int delete_push(delete_frame_t **frames, size_t *depth, size_t *capacity, size_t *open_from,
+                       int parent_fd, const char *name) {
+    if (*depth == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : DIR_OPEN_DEPTH;
+        delete_frame_t *grown = realloc(*frames, new_capacity * sizeof(delete_frame_t));
+        if (!grown) {
             perror("opendir");
             return -1;
         }
+        *frames = grown;
+        *capacity = new_capacity;
+    }
 
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-            // Skip the special entries "." and ".."
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        perror("opendir");
+        return -1;
+    }
+    delete_frame_t *frame = &(*frames)[*depth];
+    frame->name = strdup(name);
+    if (!frame->name || dir_reader_open(&frame->reader, fd) == -1) {
+        perror("opendir");
+        free(frame->name);
+        close(fd);
+        return -1;
+    }
+    frame->fd = fd;
+    frame->removed = 0;
+    (*depth)++;
 
-            // Construct the full path of the entry
-            char full_path[PATH_MAX];
-            snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+    // A level that cannot be identified stays open and is tried again on the next push
+    delete_frame_t *shallowest = &(*frames)[*open_from];
+    if (*depth - *open_from > DIR_OPEN_DEPTH &&
+        directory_identity(shallowest->fd, &shallowest->dev, &shallowest->ino) == 0) {
+        dir_reader_suspend(&shallowest->reader);
+        close(shallowest->fd);
+        shallowest->fd = -1;
+        (*open_from)++;
+    }
+    return 0;
+}
 
-            // Recursively delete the entry
-            if (delete_path(full_path) != 0) {
-                closedir(dir);
-                return -1;
-            }
+// Function to remove the empty directory on top of the delete stack from its parent, opening the
+// parent again if it was closed on the way down
+static int delete_pop(delete_frame_t *frames, size_t *depth, size_t *open_from, int dir_fd) {
+    delete_frame_t *top = &frames[*depth - 1];
+    delete_frame_t *parent = *depth > 1 ? &frames[*depth - 2] : NULL;
+    if (parent && parent->fd == -1) {
+        parent->fd = reopen_parent(top->fd, O_RDONLY, parent->dev, parent->ino);
+        if (parent->fd == -1 || dir_reader_resume(&parent->reader, parent->fd) == -1) {
+            perror("opendir");
+            return -1;
         }
+        (*open_from)--;
+    }
 
-        closedir(dir);
+    dir_reader_close(&top->reader);
+    close(top->fd);
+    int result = unlinkat(parent ? parent->fd : dir_fd, top->name, AT_REMOVEDIR);
+    if (result != 0) {
+        perror("rmdir");
+    }
+    free(top->name);
+    (*depth)--;
+    if (parent) {
+        parent->removed++;
+    }
+    return result;
+}
 
-        // Now the directory is empty, so remove it
-        if (rmdir(path) != 0) {
-            perror("rmdir");
-            return -1;
+// Function to delete the entry name of the directory dir_fd recursively. type is the d_type the
+// directory listing reported, DT_UNKNOWN if there was none.
+int delete_path_at(int dir_fd, const char *name, unsigned char type) {
+    if (type != DT_DIR) {
+        // Try it as a file first: a directory is refused with EISDIR, so no stat is needed
+        if (unlinkat(dir_fd, name, 0) == 0) {
+            return 0;
         }
-    } else {
-        // It's a file or symbolic link, so remove it
-        if (unlink(path) != 0) {
+        if (errno != EISDIR) {
             perror("unlink");
             return -1;
         }
     }
 
-    return 0;
+    // It's a directory, so remove its contents first. The tree is walked with a stack of open
+    // directories instead of recursion, so its depth is limited by neither descriptors nor PATH_MAX.
+    delete_frame_t *frames = NULL;
+    size_t depth = 0;
+    size_t capacity = 0;
+    size_t open_from = 0; // Levels below this one are closed
+    int result = delete_push(&frames, &depth, &capacity, &open_from, dir_fd, name);
+    while (result == 0 && depth > 0) {
+        delete_frame_t *top = &frames[depth - 1];
+        dir_entry_t entry;
+        int status = dir_reader_next(&top->reader, &entry);
+        if (status == 1) {
+            if (entry.type != DT_DIR) {
+                if (unlinkat(top->fd, entry.name, 0) == 0) {
+                    top->removed++;
+                    continue;
+                }
+                if (errno != EISDIR) {
+                    perror("unlink");
+                    result = -1;
+                    break;
+                }
+            }
+            result = delete_push(&frames, &depth, &capacity, &open_from, top->fd, entry.name);
+        } else if (status == -1) {
+            perror("readdir");
+            result = -1;
+        } else if (top->removed > 0) {
+            // Some filesystems skip entries when the directory shrinks while it is read: look again
+            // until a pass finds nothing left
+            top->removed = 0;
+            dir_reader_rewind(&top->reader);
+        } else {
+            // Now the directory is empty, so remove it
+            result = delete_pop(frames, &depth, &open_from, dir_fd);
+        }
+    }
+
+    while (depth > 0) {
+        depth--;
+        if (frames[depth].fd != -1) {
+            close(frames[depth].fd);
+        }
+        dir_reader_close(&frames[depth].reader);
+        free(frames[depth].name);
+    }
+    free(frames);
+    return result == 0 ? 0 : -1;
+}
+
+// Function to delete a file or directory recursively
+int delete_path(const char *path) {
+    return delete_path_at(AT_FDCWD, path, DT_UNKNOWN);
 }
 
 // Function to check if the directory is empty
@@ -90,98 +305,775 @@ int directory_exists(const char *path) {
     return S_ISDIR(statbuf.st_mode);
 }
 
-// Function to copy a file from src to dest, with options to handle symlinks and permissions.
-void copy_file(const char *src, const char *dest, int copy_symlinks, int copy_permissions) {
-    struct stat src_stat;
-    if (lstat(src, &src_stat) == -1) {
-        perror("Error getting source file information");
+// Function to record a failed operation (err is 0 for failures that have no errno). With a context
+// the failure is kept for the final report of a parallel copy, otherwise it is printed straight away.
+void copy_report_error(copy_context_t *ctx, const char *what, const char *path, int err) {
+    if (!ctx) {
+        if (err != 0) {
+            fprintf(stderr, "%s: %s\n", what, strerror(err));
+        } else {
+            fprintf(stderr, "%s\n", what);
+        }
+        if (path) {
+            fprintf(stderr, "File: %s\n", path); // Print the filename
+        }
         return;
     }
 
-    // Check if src is a directory
-    if (S_ISDIR(src_stat.st_mode)) {
-        fprintf(stderr, "Error: %s is a directory\n", src);
+    char *path_copy = strdup(path ? path : "");
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->error_count == ctx->error_capacity) {
+        size_t new_capacity = ctx->error_capacity ? ctx->error_capacity * 2 : 16;
+        copy_error_t *errors = realloc(ctx->errors, new_capacity * sizeof(copy_error_t));
+        if (!errors) {
+            pthread_mutex_unlock(&ctx->lock);
+            fprintf(stderr, "%s: %s: %s\n", path ? path : "", what, err ? strerror(err) : "failed");
+            free(path_copy);
+            return;
+        }
+        ctx->errors = errors;
+        ctx->error_capacity = new_capacity;
+    }
+    ctx->errors[ctx->error_count].path = path_copy;
+    ctx->errors[ctx->error_count].what = what;
+    ctx->errors[ctx->error_count].err = err;
+    ctx->error_count++;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Function to reserve descriptors, blocking while the open-file cap is reached
+void copy_acquire_fds(copy_context_t *ctx, int count) {
+    if (!ctx) {
         return;
     }
+    pthread_mutex_lock(&ctx->fd_lock);
+    while (ctx->fds_available < count) {
+        pthread_cond_wait(&ctx->fd_cond, &ctx->fd_lock);
+    }
+    ctx->fds_available -= count;
+    pthread_mutex_unlock(&ctx->fd_lock);
+}
 
-    // Check if src is a symbolic link
-    if (S_ISLNK(src_stat.st_mode)) {
-        // Handle symbolic links
-        if (copy_symlinks) {
-            // Get the target of the symbolic link
-            char link_target[PATH_MAX + 1];
-            ssize_t len = readlink(src, link_target, sizeof(link_target) - 1);
-            if (len == -1) {
-                perror("Error reading symbolic link");
-                return;
-            }
-            link_target[len] = '\0';
-
-            // Create the symbolic link in the destination
-            if (symlink(link_target, dest) == -1) {
-                perror("Error creating symbolic link");
-                return;
+// Function to give descriptors back to the open-file cap
+void copy_release_fds(copy_context_t *ctx, int count) {
+    if (!ctx) {
+        return;
+    }
+    pthread_mutex_lock(&ctx->fd_lock);
+    ctx->fds_available += count;
+    pthread_cond_broadcast(&ctx->fd_cond);
+    pthread_mutex_unlock(&ctx->fd_lock);
+}
+
+// Largest buffer used by the read/write fallback
+#define COPY_BUFFER_MAX (1024 * 1024)
+
+// Granularity at which zero detection turns data into holes
+#define SPARSE_BLOCK_SIZE 4096
+
+// Bytes of a file COPYTREE_CACHE_DROP leaves in the page cache behind the newest byte copied
+#define CACHE_DROP_WINDOW (8 * 1024 * 1024)
+
+// Devices between which reflink was last refused, so other files on the same pair skip the ioctl
+static __thread dev_t reflink_failed_src = (dev_t)-1;
+static __thread dev_t reflink_failed_dest = (dev_t)-1;
+
+// Set once the running kernel reports that copy_file_range does not exist
+static atomic_int copy_file_range_missing = 0;
+
+// Function to return a printable name for a data path
+const char *copytree_tier_name(copytree_tier_t tier) {
+    switch (tier) {
+        case COPY_TIER_REFLINK:
+            return "reflink";
+        case COPY_TIER_COPY_FILE_RANGE:
+            return "copy_file_range";
+        case COPY_TIER_SENDFILE:
+            return "sendfile";
+        case COPY_TIER_READ_WRITE:
+            return "read/write";
+        case COPY_TIER_IO_URING:
+            return "io_uring";
+        default:
+            return "unknown";
+    }
+}
+
+// Function to tell whether a kernel copy error means "this tier cannot do it" rather than a real I/O error
+static int tier_unsupported(int err) {
+    return err == ENOSYS || err == EOPNOTSUPP || err == ENOTSUP || err == EXDEV || err == EINVAL ||
+           err == ENOTTY || err == EBADF || err == EPERM;
+}
+
+// Progress of one file through the tiered data path
+typedef struct {
+    int src_fd;
+    int dest_fd;
+    int detect_zeros;           // Leave all-zero blocks of the source as holes in the copy
+    copytree_tier_t tier;       // Slowest tier that was needed so far
+    int skip_copy_file_range;   // copy_file_range refused this file, go straight to sendfile
+    int skip_sendfile;          // sendfile refused this file, go straight to read/write
+    char *buffer;               // Buffer of the read/write tier, allocated on first use
+    size_t buffer_size;
+    off_t dest_end;             // End of the last byte written to the destination
+    off_t hole_bytes;           // Bytes of the destination left as holes
+    int write_failed;           // The failure, if any, happened on the destination side
+    copytree_cache_t cache;     // Page cache policy; COPYTREE_CACHE_DIRECT only while both descriptors have O_DIRECT
+    size_t align;               // Alignment of O_DIRECT buffers, offsets and lengths
+    int src_flags;              // Status flags of the descriptors without O_DIRECT, to turn it off again
+    int dest_flags;
+    off_t dropped;              // COPYTREE_CACHE_DROP: pages before this offset were written back and dropped
+    int hash;                   // Checksum the data on its way through the read/write tier
+    uint32_t crc;               // CRC32C of the source up to hashed_end, holes included
+    off_t hashed_end;
+} data_copy_t;
+
+// Function to note that a slower tier than any used before was needed
+static void data_copy_used(data_copy_t *dc, copytree_tier_t tier) {
+    if (tier > dc->tier) {
+        dc->tier = tier;
+    }
+}
+
+// Function to switch both descriptors of a copy to O_DIRECT. Returns -1, with neither switched, when the
+// filesystem of either one refuses.
+static int data_copy_direct(data_copy_t *dc) {
+    dc->src_flags = fcntl(dc->src_fd, F_GETFL);
+    dc->dest_flags = fcntl(dc->dest_fd, F_GETFL);
+    if (dc->src_flags == -1 || dc->dest_flags == -1 || fcntl(dc->src_fd, F_SETFL, dc->src_flags | O_DIRECT) == -1) {
+        return -1;
+    }
+    if (fcntl(dc->dest_fd, F_SETFL, dc->dest_flags | O_DIRECT) == -1) {
+        fcntl(dc->src_fd, F_SETFL, dc->src_flags);
+        return -1;
+    }
+    dc->align = (size_t)sysconf(_SC_PAGESIZE);
+    return 0;
+}
+
+// Function to go on through the page cache after an O_DIRECT transfer was refused, as it is for the
+// unaligned tail of a file
+static void data_copy_undirect(data_copy_t *dc) {
+    fcntl(dc->src_fd, F_SETFL, dc->src_flags);
+    fcntl(dc->dest_fd, F_SETFL, dc->dest_flags);
+    dc->cache = COPYTREE_CACHE_DROP;
+}
+
+// Function to account for len bytes just copied at offset in COPYTREE_CACHE_DROP mode. Their write-back
+// starts at once; once they fall CACHE_DROP_WINDOW behind, it is waited for and the pages of both files
+// are dropped, so a large file never holds more than about two windows of the cache.
+static void data_copy_stream(data_copy_t *dc, off_t offset, off_t len) {
+    if (dc->cache != COPYTREE_CACHE_DROP) {
+        return;
+    }
+    sync_file_range(dc->dest_fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    off_t end = offset + len;
+    if (end - dc->dropped >= 2 * (off_t)CACHE_DROP_WINDOW) {
+        off_t to = end - CACHE_DROP_WINDOW;
+        sync_file_range(dc->dest_fd, dc->dropped, to - dc->dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(dc->dest_fd, dc->dropped, to - dc->dropped, POSIX_FADV_DONTNEED);
+        posix_fadvise(dc->src_fd, dc->dropped, to - dc->dropped, POSIX_FADV_DONTNEED);
+        dc->dropped = to;
+    }
+}
+
+// Function to let go of the remaining pages of a copied file. The source's pages are clean and go at
+// once. The copy's last window only has its write-back started and is dropped as far as that has
+// finished: waiting for the disk on every small file would cost far more than the cache it saves.
+static void data_copy_release(data_copy_t *dc) {
+    posix_fadvise(dc->src_fd, dc->dropped, 0, POSIX_FADV_DONTNEED);
+    sync_file_range(dc->dest_fd, dc->dropped, 0, SYNC_FILE_RANGE_WRITE);
+    posix_fadvise(dc->dest_fd, dc->dropped, 0, POSIX_FADV_DONTNEED);
+}
+
+// Function to tell whether a whole block is zero
+static int block_is_zero(const char *block, size_t len) {
+    return len == 0 || (block[0] == 0 && memcmp(block, block + 1, len - 1) == 0);
+}
+
+// Function to add a block read from the source to the checksum, with any hole skipped before it
+static void data_copy_hash(data_copy_t *dc, const char *data, size_t len, off_t offset) {
+    if (offset > dc->hashed_end) {
+        dc->crc = copy_crc_zeros(dc->crc, offset - dc->hashed_end);
+    }
+    dc->crc = copytree_crc32c(dc->crc, data, len);
+    dc->hashed_end = offset + (off_t)len;
+}
+
+// Function to write a block of the read/write tier, skipping it when it is zero and holes are wanted
+static int data_copy_write(data_copy_t *dc, const char *data, size_t len, off_t offset) {
+    if (dc->hash) {
+        data_copy_hash(dc, data, len, offset);
+    }
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = len - done;
+        if (dc->detect_zeros) {
+            // Work in filesystem-block sized pieces so a zero block becomes a real hole
+            chunk = SPARSE_BLOCK_SIZE - (size_t)((offset + done) % SPARSE_BLOCK_SIZE);
+            if (chunk > len - done) {
+                chunk = len - done;
+            }
+            if (block_is_zero(data + done, chunk)) {
+                dc->hole_bytes += chunk;
+                done += chunk;
+                continue;
             }
-        } else {
-            // Error message indicating symbolic links are not supported
-            fprintf(stderr, "Error: Symbolic link encountered but not copying as link (-l not specified)\n");
-            return;
         }
-    } else if (S_ISREG(src_stat.st_mode)) {
-        // Regular file, copy its contents
-        int source_fd = open(src, O_RDONLY);
-        if (source_fd == -1) {
-            perror("Error opening source file");
-            fprintf(stderr, "File: %s\n", src); // Print the filename
-            return;
+        ssize_t written = pwrite(dc->dest_fd, data + done, chunk, offset + done);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && dc->cache == COPYTREE_CACHE_DIRECT) {
+                data_copy_undirect(dc); // Not whole blocks, usually the tail of the file
+                continue;
+            }
+            dc->write_failed = 1;
+            return -1;
+        }
+        done += written;
+        if (offset + (off_t)done > dc->dest_end) {
+            dc->dest_end = offset + done;
         }
+    }
+    return 0;
+}
 
-        // Open the target file for writing (create if it doesn't exist)
-        int target_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, src_stat.st_mode);
-        if (target_fd == -1) {
-            perror("Error opening target file");
-            fprintf(stderr, "File: %s\n", dest); // Print the filename
-            close(source_fd);
-            return;
+// Function to copy one data extent of the source to the same offset in the destination.
+// A length of -1 copies until end of file. Each tier stops at end of file or when it is
+// refused and leaves the rest of the extent to the next one.
+static int data_copy_extent(data_copy_t *dc, off_t offset, off_t length) {
+    off_t in = offset;
+    off_t end = length < 0 ? -1 : offset + length;
+    int eof = 0;
+
+    // Tier 2: let the kernel copy (server-side copy on NFS/SMB, in-filesystem copy elsewhere)
+    // Both kernel-side tiers go through the page cache, so O_DIRECT copies skip them, and the
+    // data never reaches user space, so checksummed copies do too
+    int kernel_tiers = !dc->detect_zeros && !dc->hash && dc->cache != COPYTREE_CACHE_DIRECT;
+    off_t step_max = dc->cache == COPYTREE_CACHE_DROP ? CACHE_DROP_WINDOW : 0x7ffff000;
+    if (end > in && kernel_tiers && !dc->skip_copy_file_range && !atomic_load(&copy_file_range_missing)) {
+        off_t out = in;
+        while (in < end) {
+            off_t step = end - in > step_max ? step_max : end - in;
+            ssize_t copied = copy_file_range(dc->src_fd, &in, dc->dest_fd, &out, (size_t)step, 0);
+            if (copied > 0) {
+                data_copy_used(dc, COPY_TIER_COPY_FILE_RANGE);
+                data_copy_stream(dc, in - copied, copied);
+                continue;
+            }
+            if (copied == -1 && errno == ENOSYS) {
+                atomic_store(&copy_file_range_missing, 1);
+            }
+            if (copied == -1 && !tier_unsupported(errno)) {
+                dc->write_failed = errno == ENOSPC || errno == EDQUOT || errno == EFBIG;
+                return -1;
+            }
+            if (copied == -1) {
+                dc->skip_copy_file_range = 1;
+            }
+            break; // Refused, or the file ended early: let the next tier decide
+        }
+        if (out > dc->dest_end) {
+            dc->dest_end = out;
         }
+    }
 
-        // Copy the contents of the file
-        char buffer[4096];
-        ssize_t bytes_read, bytes_written;
-        while ((bytes_read = read(source_fd, buffer, sizeof(buffer))) > 0) {
-            bytes_written = write(target_fd, buffer, bytes_read);
-            if (bytes_written != bytes_read) {
-                perror("Error writing to target file");
-                fprintf(stderr, "File: %s\n", dest); // Print the filename
-                close(source_fd);
-                close(target_fd);
-                return;
+    // Tier 3: in-kernel copy through the page cache
+    if (end > in && kernel_tiers && !dc->skip_sendfile) {
+        if (lseek(dc->dest_fd, in, SEEK_SET) == -1) {
+            dc->write_failed = 1;
+            return -1;
+        }
+        while (in < end) {
+            off_t chunk = end - in > step_max ? step_max : end - in;
+            ssize_t sent = sendfile(dc->dest_fd, dc->src_fd, &in, (size_t)chunk);
+            if (sent > 0) {
+                data_copy_used(dc, COPY_TIER_SENDFILE);
+                data_copy_stream(dc, in - sent, sent);
+                continue;
+            }
+            if (sent == -1 && !tier_unsupported(errno)) {
+                dc->write_failed = errno == ENOSPC || errno == EDQUOT || errno == EFBIG;
+                return -1;
             }
+            if (sent == -1) {
+                dc->skip_sendfile = 1;
+            }
+            break;
+        }
+        if (in > dc->dest_end) {
+            dc->dest_end = in;
         }
+    }
 
+    // Tier 4: copy through user space (also covers files whose size lies, like procfs)
+    while (!eof && (end < 0 || in < end)) {
+        if (!dc->buffer) {
+            dc->buffer_size = COPY_BUFFER_MAX;
+            if (end >= 0 && end - in < (off_t)dc->buffer_size) {
+                dc->buffer_size = end - in < SPARSE_BLOCK_SIZE ? SPARSE_BLOCK_SIZE : (size_t)(end - in);
+            }
+            if (dc->cache == COPYTREE_CACHE_DIRECT) {
+                // O_DIRECT moves whole blocks from and to aligned memory
+                void *buffer = NULL;
+                dc->buffer_size = (dc->buffer_size + dc->align - 1) & ~(dc->align - 1);
+                if (posix_memalign(&buffer, dc->align, dc->buffer_size) == 0) {
+                    dc->buffer = buffer;
+                }
+            } else {
+                dc->buffer = malloc(dc->buffer_size);
+            }
+            if (!dc->buffer) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+
+        size_t want = dc->buffer_size;
+        if (end >= 0 && end - in < (off_t)want) {
+            want = (size_t)(end - in);
+            if (dc->cache == COPYTREE_CACHE_DIRECT) {
+                want = (want + dc->align - 1) & ~(dc->align - 1); // Reading past the end just comes back short
+            }
+        }
+        ssize_t bytes_read = pread(dc->src_fd, dc->buffer, want, in);
         if (bytes_read == -1) {
-            perror("Error reading from source file");
-            close(source_fd);
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && dc->cache == COPYTREE_CACHE_DIRECT) {
+                data_copy_undirect(dc);
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_read == 0) {
+            eof = 1;
+            break;
+        }
+        if (end >= 0 && bytes_read > end - in) {
+            bytes_read = end - in; // The rounded-up read went past the extent
+        }
+        data_copy_used(dc, COPY_TIER_READ_WRITE);
+        if (data_copy_write(dc, dc->buffer, (size_t)bytes_read, in) == -1) {
+            return -1;
+        }
+        data_copy_stream(dc, in, bytes_read);
+        in += bytes_read;
+    }
+
+    return 0;
+}
+
+// Function to copy a whole file through the tiered data path. Sparse sources are walked extent by
+// extent with SEEK_DATA/SEEK_HOLE so only their data is copied, and the holes are recreated by
+// leaving the skipped ranges unwritten and setting the final size with ftruncate.
+// On failure *write_failed tells which side failed. A cache policy other than COPYTREE_CACHE_NORMAL may
+// leave O_DIRECT set on the descriptors. When crc is not NULL it receives the CRC32C of the data
+// copied, computed on the way through the read/write tier, which is then the only one used.
+static int copy_data_tiered(int src_fd, int dest_fd, off_t size, int detect_zeros, copytree_cache_t cache,
+                            copytree_tier_t *tier_used, off_t *hole_bytes, uint32_t *crc, int *write_failed) {
+    data_copy_t dc;
+    memset(&dc, 0, sizeof(dc));
+    dc.src_fd = src_fd;
+    dc.dest_fd = dest_fd;
+    dc.detect_zeros = detect_zeros;
+    dc.hash = crc != NULL;
+    dc.tier = COPY_TIER_REFLINK;
+    *write_failed = 0;
+
+    struct stat src_st, dest_st;
+    if (fstat(src_fd, &src_st) == -1) {
+        return -1;
+    }
+
+    // Tier 1: share the extents outright when both files live on a reflink-capable filesystem.
+    // Reflinks keep holes as they are, so only zero detection and checksums need to look at the data.
+    if (size > 0 && !detect_zeros && !crc && fstat(dest_fd, &dest_st) == 0 &&
+        !(src_st.st_dev == reflink_failed_src && dest_st.st_dev == reflink_failed_dest)) {
+        if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+            if (tier_used) {
+                *tier_used = COPY_TIER_REFLINK;
+            }
+            if (hole_bytes) {
+                *hole_bytes = 0;
+            }
+            return 0;
+        }
+        reflink_failed_src = src_st.st_dev;
+        reflink_failed_dest = dest_st.st_dev;
+    }
+
+    dc.cache = cache;
+    if (cache == COPYTREE_CACHE_DIRECT && data_copy_direct(&dc) == -1) {
+        dc.cache = COPYTREE_CACHE_DROP; // tmpfs, procfs and others refuse O_DIRECT
+    }
+
+    int result = 0;
+    if (size == 0) {
+        // Nothing is known about the length, copy whatever a read returns
+        result = data_copy_extent(&dc, 0, -1);
+    } else if ((off_t)src_st.st_blocks * 512 < size) {
+        // Fewer blocks allocated than the size needs: copy only the data extents
+        off_t offset = 0;
+        while (offset < size && result == 0) {
+            off_t data = lseek(src_fd, offset, SEEK_DATA);
+            if (data == -1) {
+                if (errno == ENXIO) {
+                    break; // Only a hole is left
+                }
+                data = offset; // The filesystem cannot report extents, treat the rest as data
+            }
+            off_t hole = lseek(src_fd, data, SEEK_HOLE);
+            if (hole == -1 || hole > size) {
+                hole = size;
+            }
+            dc.hole_bytes += data - offset;
+            result = data_copy_extent(&dc, data, hole - data);
+            offset = hole;
+        }
+    } else {
+        result = data_copy_extent(&dc, 0, size);
+    }
+
+    // Extend the copy over a trailing hole so it ends up with the source's size
+    if (result == 0 && dc.dest_end < size) {
+        if (ftruncate(dest_fd, size) == -1) {
+            dc.write_failed = 1;
+            result = -1;
+        }
+    }
+
+    int saved_errno = errno;
+    if (cache != COPYTREE_CACHE_NORMAL) {
+        data_copy_release(&dc);
+    }
+    free(dc.buffer);
+    errno = saved_errno;
+    *write_failed = dc.write_failed;
+    if (result == 0) {
+        if (tier_used) {
+            *tier_used = dc.tier == COPY_TIER_REFLINK ? COPY_TIER_READ_WRITE : dc.tier;
+        }
+        if (hole_bytes) {
+            *hole_bytes = dc.hole_bytes;
+        }
+        if (crc) {
+            // A trailing hole is part of the data too
+            *crc = dc.hashed_end < size ? copy_crc_zeros(dc.crc, size - dc.hashed_end) : dc.crc;
+        }
+    }
+    return result;
+}
+
+// Function to copy the data of an open regular file into dest_fd through the tiered data path
+int copy_file_data(int src_fd, int dest_fd, off_t size, copytree_tier_t *tier_used) {
+    int write_failed;
+    return copy_data_tiered(src_fd, dest_fd, size, 0, COPYTREE_CACHE_NORMAL, tier_used, NULL, NULL, &write_failed);
+}
+
+// Function to join a directory path and an entry name for an error message
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+    return path;
+}
+
+// Function to report a failure on an entry, building its full path only now that it is needed
+void copy_report_entry_error(copy_context_t *ctx, const char *what, const copy_entry_t *entry, int err) {
+    if (!entry->dir_path) {
+        copy_report_error(ctx, what, entry->name, err);
+        return;
+    }
+    char *path = join_path(entry->dir_path, entry->name);
+    copy_report_error(ctx, what, path ? path : entry->name, err);
+    free(path);
+}
+
+// Function to recreate a symbolic link
+static int copy_symlink_at(copy_context_t *ctx, const copy_entry_t *src, const copy_entry_t *dest, int copy_symlinks) {
+    if (!copy_symlinks) {
+        // Error message indicating symbolic links are not supported
+        copy_report_entry_error(ctx, "Error: Symbolic link encountered but not copying as link (-l not specified)", src, 0);
+        return -1;
+    }
+
+    // Get the target of the symbolic link
+    char link_target[PATH_MAX + 1];
+    ssize_t len = readlinkat(src->dir_fd, src->name, link_target, sizeof(link_target) - 1);
+    if (len == -1) {
+        copy_report_entry_error(ctx, "Error reading symbolic link", src, errno);
+        return -1;
+    }
+    link_target[len] = '\0';
+
+    // Create the symbolic link in the destination
+    if (symlinkat(link_target, dest->dir_fd, dest->name) == -1) {
+        copy_report_entry_error(ctx, "Error creating symbolic link", dest, errno);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to build the path of an entry as it is kept in the link tables
+char *copy_entry_path(const copy_entry_t *entry) {
+    return entry->dir_path ? join_path(entry->dir_path, entry->name) : strdup(entry->name);
+}
+
+// Function to turn another name of a hard-linked source into a hard link to the copy of its first
+// name. Returns 1 when dest was linked, 0 when the file has to be copied (then *claim, if set, is
+// passed to link_table_finish once the copy is done) and -1 after reporting a failure.
+static int link_to_first_copy(copy_context_t *ctx, const copy_entry_t *dest, const struct stat *src_stat,
+                              void **claim) {
+    char *dest_path = copy_entry_path(dest);
+    if (!dest_path) {
+        return 0;
+    }
+    char *target;
+    int found = link_table_claim(ctx->links, (unsigned long long)src_stat->st_dev,
+                                 (unsigned long long)src_stat->st_ino, dest_path, claim, &target);
+    free(dest_path);
+    if (found != 1) {
+        return 0;
+    }
+
+    int result = 1;
+    if (linkat(AT_FDCWD, target, dest->dir_fd, dest->name, 0) == 0) {
+        atomic_fetch_add(&ctx->files_linked, 1);
+        atomic_fetch_add(&ctx->bytes_saved, (unsigned long long)src_stat->st_size);
+    } else if (errno == EMLINK || errno == EXDEV) {
+        result = 0; // The copy cannot take another link, give this name its own copy
+    } else {
+        copy_report_entry_error(ctx, "Error creating hard link", dest, errno);
+        result = -1;
+    }
+    free(target);
+    return result;
+}
+
+// Function to make dest share the data of an identical file copied before, as a reflink or a hard
+// link depending on the dedup option. The earlier copy is compared byte by byte first, so a hash
+// collision only costs a read. Returns 1 when dest was created that way and 0 when the file has to
+// be copied; a failure here is never reported, the copy that follows reports it if it fails too.
+static int dedup_existing(copy_context_t *ctx, int source_fd, const copy_entry_t *dest,
+                          const struct stat *src_stat, unsigned long long hash, int copy_permissions) {
+    char *match = link_table_find(ctx->dedup, (unsigned long long)src_stat->st_size, hash, src_stat->st_mode & 07777);
+    if (!match) {
+        return 0;
+    }
+    int match_fd = open(match, O_RDONLY | O_CLOEXEC);
+    if (match_fd == -1 || dedup_files_equal(source_fd, match_fd, src_stat->st_size) != 1) {
+        if (match_fd != -1) {
+            close(match_fd);
+        }
+        free(match);
+        return 0;
+    }
+
+    int result = 0;
+    if (ctx->opts.dedup == COPYTREE_DEDUP_HARDLINK) {
+        result = linkat(AT_FDCWD, match, dest->dir_fd, dest->name, 0) == 0;
+    } else {
+        int target_fd = openat(dest->dir_fd, dest->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, src_stat->st_mode);
+        if (target_fd != -1) {
+            result = ioctl(target_fd, FICLONE, match_fd) == 0;
+            if (result && copy_permissions && fchmod(target_fd, src_stat->st_mode) == -1) {
+                copy_report_entry_error(ctx, "Error setting target file permissions", dest, errno);
+            }
             close(target_fd);
-            return;
         }
+    }
+    close(match_fd);
+    free(match);
 
-        // Close the files
+    if (result) {
+        atomic_fetch_add(&ctx->files_deduplicated, 1);
+        atomic_fetch_add(&ctx->bytes_saved, (unsigned long long)src_stat->st_size);
+    }
+    return result;
+}
+
+// Function to copy the contents of a regular file into a new file. Without src_stat the source is
+// looked up through its descriptor.
+static int copy_regular_data(copy_context_t *ctx, const copy_entry_t *src, const copy_entry_t *dest,
+                             const struct stat *src_stat, int copy_permissions) {
+    int source_fd = openat(src->dir_fd, src->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (source_fd == -1) {
+        copy_report_entry_error(ctx, "Error opening source file", src, errno);
+        return -1;
+    }
+
+    struct stat opened_stat;
+    if (!src_stat) {
+        if (fstat(source_fd, &opened_stat) == -1) {
+            copy_report_entry_error(ctx, "Error getting source file information", src, errno);
+            close(source_fd);
+            return -1;
+        }
+        src_stat = &opened_stat;
+    }
+
+    // With deduplication on, a file identical to one copied before is linked to that copy instead
+    unsigned long long hash = 0;
+    int hashed = 0;
+    if (ctx && ctx->dedup && src_stat->st_size >= DEDUP_MIN_SIZE &&
+        dedup_hash_file(source_fd, src_stat->st_size, &hash) == 0) {
+        hashed = 1;
+        if (dedup_existing(ctx, source_fd, dest, src_stat, hash, copy_permissions)) {
+            close(source_fd);
+            return 0;
+        }
+    }
+
+    // Open the target file for writing (create if it doesn't exist); verifying reads it back as well
+    int verify = ctx && ctx->opts.verify;
+    int checksum = verify || (ctx && ctx->manifest);
+    int access = verify ? O_RDWR : O_WRONLY;
+    int target_fd = openat(dest->dir_fd, dest->name, access | O_CREAT | O_TRUNC | O_CLOEXEC, src_stat->st_mode);
+    if (target_fd == -1) {
+        copy_report_entry_error(ctx, "Error opening target file", dest, errno);
+        close(source_fd);
+        return -1;
+    }
+
+    // Copy the contents of the file through the cheapest data path that works
+    copytree_tier_t tier;
+    off_t hole_bytes;
+    int write_failed;
+    int detect_zeros = ctx ? ctx->opts.detect_zeros : 0;
+    copytree_cache_t cache = ctx ? ctx->opts.cache : COPYTREE_CACHE_NORMAL;
+    uint32_t crc = 0;
+    if (copy_data_tiered(source_fd, target_fd, src_stat->st_size, detect_zeros, cache,
+                         &tier, &hole_bytes, checksum ? &crc : NULL, &write_failed) == -1) {
+        if (write_failed) {
+            copy_report_entry_error(ctx, "Error writing to target file", dest, errno);
+        } else {
+            copy_report_entry_error(ctx, "Error reading from source file", src, errno);
+        }
         close(source_fd);
         close(target_fd);
-    } else {
-        // Handle other file types if necessary (sockets, devices, etc.)
-        fprintf(stderr, "Unsupported file type: %s\n", src);
+        return -1;
+    }
+
+    if (ctx) {
+        atomic_fetch_add(&ctx->files_copied, 1);
+        atomic_fetch_add(&ctx->bytes_copied, (unsigned long long)src_stat->st_size);
+        atomic_fetch_add(&ctx->tier_files[tier], 1);
+        atomic_fetch_add(&ctx->hole_bytes, (unsigned long long)hole_bytes);
     }
 
     // Set permissions of the target file if copy_permissions is enabled
-    if (copy_permissions && !S_ISLNK(src_stat.st_mode)) {
-        if (chmod(dest, src_stat.st_mode) == -1) {
-            perror("Error setting target file permissions");
-            fprintf(stderr, "File: %s\n", dest); // Print the filename
-            return;
+    int result = 0;
+    if (copy_permissions && fchmod(target_fd, src_stat->st_mode) == -1) {
+        copy_report_entry_error(ctx, "Error setting target file permissions", dest, errno);
+        result = -1;
+    }
+
+    // Read the copy back and compare its checksum with the one taken while copying
+    if (result == 0 && verify) {
+        struct stat target_stat;
+        uint32_t copy_crc;
+        if (fstat(target_fd, &target_stat) == -1 || copy_crc_file(target_fd, target_stat.st_size, &copy_crc) == -1) {
+            copy_report_entry_error(ctx, "Error reading back target file", dest, errno);
+            result = -1;
+        } else if (copy_crc != crc) {
+            copy_report_entry_error(ctx, "Error: Copy does not match the source (CRC32C mismatch)", dest, 0);
+            result = -1;
+        } else {
+            atomic_fetch_add(&ctx->files_verified, 1);
+        }
+    }
+    if (result == 0 && ctx && ctx->manifest) {
+        char *dest_path = copy_entry_path(dest);
+        if (dest_path) {
+            copy_manifest_note(ctx, dest_path, target_fd, src_stat, crc);
+            free(dest_path);
         }
     }
+
+    // Later files with the same contents can be linked to this copy
+    if (result == 0 && hashed) {
+        char *dest_path = copy_entry_path(dest);
+        if (dest_path) {
+            link_table_add(ctx->dedup, (unsigned long long)src_stat->st_size, hash, src_stat->st_mode & 07777, dest_path);
+            free(dest_path);
+        }
+    }
+
+    // Close the files
+    close(source_fd);
+    close(target_fd);
+    return result;
+}
+
+// Function to copy a regular file. A source inode with several names is copied once when the context
+// keeps a hard-link table; its other names become hard links to that copy.
+static int copy_regular_at(copy_context_t *ctx, const copy_entry_t *src, const copy_entry_t *dest,
+                           const struct stat *src_stat, int copy_permissions) {
+    void *claim = NULL;
+    if (ctx && ctx->links && src_stat && src_stat->st_nlink > 1) {
+        int linked = link_to_first_copy(ctx, dest, src_stat, &claim);
+        if (linked != 0) {
+            return linked == 1 ? 0 : -1;
+        }
+    }
+
+    int result = copy_regular_data(ctx, src, dest, src_stat, copy_permissions);
+    if (claim) {
+        link_table_finish(ctx->links, claim, result == 0);
+    }
+    return result;
+}
+
+// Function to copy one non-directory entry, addressed relative to open directories, whose lstat
+// information is already known. Returns 0 on success and -1 after reporting a failure.
+int copy_file_entry_at(copy_context_t *ctx, const copy_entry_t *src, const copy_entry_t *dest,
+                       const struct stat *src_stat, int copy_symlinks, int copy_permissions) {
+    // Check if src is a symbolic link
+    if (S_ISLNK(src_stat->st_mode)) {
+        return copy_symlink_at(ctx, src, dest, copy_symlinks);
+    }
+    if (S_ISREG(src_stat->st_mode)) {
+        return copy_regular_at(ctx, src, dest, src_stat, copy_permissions);
+    }
+    // Handle other file types if necessary (sockets, devices, etc.)
+    copy_report_entry_error(ctx, "Unsupported file type", src, 0);
+    return -1;
+}
+
+// Function to copy one non-directory entry whose lstat information is already known.
+// Returns 0 on success and -1 after reporting a failure.
+int copy_file_entry(copy_context_t *ctx, const char *src, const char *dest, const struct stat *src_stat,
+                    int copy_symlinks, int copy_permissions) {
+    copy_entry_t src_entry = { AT_FDCWD, src, NULL };
+    copy_entry_t dest_entry = { AT_FDCWD, dest, NULL };
+    return copy_file_entry_at(ctx, &src_entry, &dest_entry, src_stat, copy_symlinks, copy_permissions);
+}
+
+// Function to copy a file from src to dest, with options to handle symlinks and permissions.
+void copy_file(const char *src, const char *dest, int copy_symlinks, int copy_permissions) {
+    struct stat src_stat;
+    if (lstat(src, &src_stat) == -1) {
+        perror("Error getting source file information");
+        return;
+    }
+
+    // Check if src is a directory
+    if (S_ISDIR(src_stat.st_mode)) {
+        fprintf(stderr, "Error: %s is a directory\n", src);
+        return;
+    }
+
+    copy_file_entry(NULL, src, dest, &src_stat, copy_symlinks, copy_permissions);
 }
 
 // Helper function to create directories recursively
@@ -225,18 +1117,230 @@ int create_directory_recursive(const char *dir_path, mode_t mode) {
     return 0;  // Return 0 on success
 }
 
+// One directory of a sequential copy in progress
+typedef struct {
+    int src_fd;                 // -1 while closed to stay within DIR_OPEN_DEPTH
+    int dest_fd;
+    dev_t src_dev;              // Identities of both directories, checked when they are opened again
+    ino_t src_ino;
+    dev_t dest_dev;
+    ino_t dest_ino;
+    char *src_path;             // Paths for error messages
+    char *dest_path;
+    dir_reader_t reader;
+} copy_frame_t;
+
+// Function to put a pair of open directories on top of the copy stack. The paths are taken over,
+// the descriptors too unless this is the first level. The shallowest open level other than the first
+// is closed when DIR_OPEN_DEPTH levels are open already.
+static int copy_push(copy_frame_t **frames, size_t *depth, size_t *capacity, size_t *open_from,
+                     int src_fd, int dest_fd, char *src_path, char *dest_path) {
+    if (*depth == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : DIR_OPEN_DEPTH;
+        copy_frame_t *grown = realloc(*frames, new_capacity * sizeof(copy_frame_t));
+        if (!grown) {
+            free(src_path);
+            free(dest_path);
+            return -1;
+        }
+        *frames = grown;
+        *capacity = new_capacity;
+    }
+
+    copy_frame_t *frame = &(*frames)[*depth];
+    if (!src_path || !dest_path || dir_reader_open(&frame->reader, src_fd) == -1) {
+        free(src_path);
+        free(dest_path);
+        return -1;
+    }
+    frame->src_fd = src_fd;
+    frame->dest_fd = dest_fd;
+    frame->src_path = src_path;
+    frame->dest_path = dest_path;
+    (*depth)++;
+
+    // A level that cannot be identified stays open and is tried again on the next push
+    copy_frame_t *shallowest = &(*frames)[*open_from];
+    if (*depth - *open_from > DIR_OPEN_DEPTH &&
+        directory_identity(shallowest->src_fd, &shallowest->src_dev, &shallowest->src_ino) == 0 &&
+        directory_identity(shallowest->dest_fd, &shallowest->dest_dev, &shallowest->dest_ino) == 0) {
+        dir_reader_suspend(&shallowest->reader);
+        close(shallowest->src_fd);
+        close(shallowest->dest_fd);
+        shallowest->src_fd = -1;
+        shallowest->dest_fd = -1;
+        (*open_from)++;
+    }
+    return 0;
+}
+
+// Function to finish the directory on top of the copy stack, opening its parents again if they were
+// closed on the way down. The target only serves as the directory of *at calls, so it is reopened
+// with O_PATH and needs no read permission.
+static int copy_pop(copy_frame_t *frames, size_t *depth, size_t *open_from) {
+    copy_frame_t *top = &frames[*depth - 1];
+    if (*depth > 1) {
+        copy_frame_t *parent = &frames[*depth - 2];
+        if (parent->src_fd == -1) {
+            parent->src_fd = reopen_parent(top->src_fd, O_RDONLY, parent->src_dev, parent->src_ino);
+            parent->dest_fd = reopen_parent(top->dest_fd, O_PATH, parent->dest_dev, parent->dest_ino);
+            if (parent->src_fd == -1 || parent->dest_fd == -1 ||
+                dir_reader_resume(&parent->reader, parent->src_fd) == -1) {
+                return -1;
+            }
+            (*open_from)--;
+        }
+        close(top->src_fd);
+        close(top->dest_fd);
+    }
+    dir_reader_close(&top->reader);
+    free(top->src_path);
+    free(top->dest_path);
+    (*depth)--;
+    return 0;
+}
+
+// Function to create the copy of one subdirectory and open both. Returns 0 with the descriptors in
+// *src_fd and *dest_fd, or -1 after reporting the failure.
+static int open_subdirectory_at(const copy_entry_t *src, const copy_entry_t *dest, int copy_permissions,
+                                int *src_fd, int *dest_fd) {
+    *src_fd = openat(src->dir_fd, src->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (*src_fd == -1) {
+        perror("Error opening source directory");
+        return -1;
+    }
+
+    // Use the source directory's permissions if copy_permissions is enabled, otherwise use 0755
+    mode_t mode = 0755;
+    if (copy_permissions) {
+        struct stat source_stat;
+        if (fstat(*src_fd, &source_stat) == -1) {
+            perror("Error getting source directory information");
+            close(*src_fd);
+            return -1;
+        }
+        mode = source_stat.st_mode;
+    }
+
+    // The target directory must not exist yet
+    if (mkdirat(dest->dir_fd, dest->name, 0755) != 0) {
+        if (errno == EEXIST) {
+            perror("Error: Destination directory already exists");
+        } else {
+            perror("Error creating target directory");
+        }
+        close(*src_fd);
+        return -1;
+    }
+    *dest_fd = openat(dest->dir_fd, dest->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (*dest_fd == -1) {
+        perror("Error creating target directory");
+        close(*src_fd);
+        return -1;
+    }
+    // Set permissions explicitly after creation
+    if (fchmod(*dest_fd, mode) == -1) {
+        perror("Error setting directory permissions");
+    }
+    return 0;
+}
+
+// Function to copy the entries of the open directory src_fd into dest_fd. Entries are addressed by
+// name relative to the two descriptors, so no path is resolved from the root again, and
+// subdirectories are walked with a stack of open directories that keeps at most DIR_OPEN_DEPTH
+// levels open, so there is no limit on the depth of the tree; the paths are kept only for error
+// messages. The type reported by the directory listing decides what to do with an entry, so most
+// entries are never stat'ed.
+static void copy_directory_at(int src_fd, int dest_fd, const char *src_path, const char *dest_path,
+                              int copy_symlinks, int copy_permissions) {
+    copy_frame_t *frames = NULL;
+    size_t depth = 0;
+    size_t capacity = 0;
+    size_t open_from = 1; // Levels below this one are closed, except the first, which the caller owns
+    if (copy_push(&frames, &depth, &capacity, &open_from, src_fd, dest_fd, strdup(src_path), strdup(dest_path)) == -1) {
+        perror("Error opening source directory");
+        free(frames);
+        return;
+    }
+
+    while (depth > 0) {
+        copy_frame_t *top = &frames[depth - 1];
+        dir_entry_t entry;
+        int status = dir_reader_next(&top->reader, &entry);
+        if (status != 1) {
+            if (status == -1) {
+                perror("Error reading source directory");
+            }
+            if (copy_pop(frames, &depth, &open_from) == -1) {
+                perror("Error reopening source directory");
+                break;
+            }
+            continue;
+        }
+
+        copy_entry_t src = { top->src_fd, entry.name, top->src_path };
+        copy_entry_t dest = { top->dest_fd, entry.name, top->dest_path };
+
+        struct stat statbuf;
+        unsigned char type = entry.type;
+        if (type == DT_UNKNOWN) {
+            // The filesystem does not report types: ask for this one entry
+            if (fstatat(top->src_fd, entry.name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1) {
+                perror("Error getting source entry information");
+                continue;
+            }
+            type = IFTODT(statbuf.st_mode);
+        }
+
+        if (type == DT_DIR) {
+            int child_src_fd;
+            int child_dest_fd;
+            if (open_subdirectory_at(&src, &dest, copy_permissions, &child_src_fd, &child_dest_fd) == 0 &&
+                copy_push(&frames, &depth, &capacity, &open_from, child_src_fd, child_dest_fd,
+                          join_path(top->src_path, entry.name), join_path(top->dest_path, entry.name)) == -1) {
+                perror("Error copying directory");
+                close(child_src_fd);
+                close(child_dest_fd);
+            }
+        } else if (type == DT_REG) {
+            copy_regular_at(NULL, &src, &dest, entry.type == DT_UNKNOWN ? &statbuf : NULL, copy_permissions);
+        } else if (type == DT_LNK) {
+            copy_symlink_at(NULL, &src, &dest, copy_symlinks);
+        } else {
+            copy_report_entry_error(NULL, "Unsupported file type", &src, 0);
+        }
+    }
+
+    // Only left over when a parent could not be opened again
+    while (depth > 0) {
+        depth--;
+        if (depth > 0) {
+            if (frames[depth].src_fd != -1) {
+                close(frames[depth].src_fd);
+            }
+            if (frames[depth].dest_fd != -1) {
+                close(frames[depth].dest_fd);
+            }
+        }
+        dir_reader_close(&frames[depth].reader);
+        free(frames[depth].src_path);
+        free(frames[depth].dest_path);
+    }
+    free(frames);
+}
+
 // Function to copy a directory from src to dest, handling all types of entries within.
 void copy_directory(const char *src, const char *dest, int copy_symlinks, int copy_permissions) {
-    DIR *dir = opendir(src);
-    if (!dir) {
+    int src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (src_fd == -1) {
         perror("Error opening source directory");
         return;
     }
 
     struct stat source_stat;
-    if (lstat(src, &source_stat) == -1) {
+    if (fstat(src_fd, &source_stat) == -1) {
         perror("Error getting source directory information");
-        closedir(dir);
+        close(src_fd);
         return;
     }
 
@@ -244,51 +1348,27 @@ void copy_directory(const char *src, const char *dest, int copy_symlinks, int co
     if (directory_exists(dest)) {
         errno = EEXIST; // Set errno to EEXIST to indicate that the file exists
         perror("Error: Destination directory already exists");
-        closedir(dir);
+        close(src_fd);
         return;
     }
 
-
     // Use the source directory's permissions if copy_permissions is enabled, otherwise use 0755
     mode_t mode = copy_permissions ? source_stat.st_mode : 0755;
 
     // Create the target directory if it doesn't exist
     if (create_directory_recursive(dest, mode) != 0) {
         perror("Error creating target directory");
-        closedir(dir);
+        close(src_fd);
         return;
     }
-
-    struct dirent *entry;
-    struct stat statbuf;
-    char source_path[PATH_MAX];
-    char target_path[PATH_MAX];
-
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip special entries "." and ".."
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        // Construct the full source and target paths
-        snprintf(source_path, sizeof(source_path), "%s/%s", src, entry->d_name);
-        snprintf(target_path, sizeof(target_path), "%s/%s", dest, entry->d_name);
-
-        // Get information about the source entry
-        if (lstat(source_path, &statbuf) == -1) {
-            perror("Error getting source entry information");
-            continue;
-        }
-
-        // Handle all types of entries (regular files, directories, symbolic links)
-        if (S_ISDIR(statbuf.st_mode)) {
-            // Recursive call to duplicate subdirectory
-            copy_directory(source_path, target_path, copy_symlinks, copy_permissions);
-        } else {
-            // Duplicate regular files and symbolic links
-            copy_file(source_path, target_path, copy_symlinks, copy_permissions);
-        }
+    int dest_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dest_fd == -1) {
+        perror("Error opening target directory");
+        close(src_fd);
+        return;
     }
 
-    closedir(dir);
+    copy_directory_at(src_fd, dest_fd, src, dest, copy_symlinks, copy_permissions);
+    close(dest_fd);
+    close(src_fd);
 }
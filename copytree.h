@@ -2,15 +2,180 @@
 #ifndef COPYTREE_H
 #define COPYTREE_H
 
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Data path used to copy the contents of a regular file, in the order they are tried
+typedef enum {
+    COPY_TIER_REFLINK,          // FICLONE: the destination shares the source's extents
+    COPY_TIER_COPY_FILE_RANGE,  // copy_file_range: the kernel (or filesystem) copies the data
+    COPY_TIER_SENDFILE,         // sendfile: in-kernel copy through the page cache
+    COPY_TIER_READ_WRITE,       // read/write through a large user-space buffer
+    COPY_TIER_IO_URING,         // Batched read/write submitted through io_uring (io_uring engine only)
+    COPY_TIER_COUNT
+} copytree_tier_t;
+
+// Counters describing a finished copy
+typedef struct {
+    unsigned long long files_copied;                    // Regular files whose data was copied
+    unsigned long long bytes_copied;                    // Bytes of file data copied
+    unsigned long long tier_files[COPY_TIER_COUNT];     // Files copied by each data path
+    unsigned long long hole_bytes;                      // Bytes left as holes instead of being written
+    unsigned long long files_skipped;                   // Sync mode: entries already up to date
+    unsigned long long files_delta;                     // Sync mode: files updated block by block
+    unsigned long long entries_deleted;                 // Sync mode: destination entries missing from the source
+    unsigned long long files_removed;                   // delete_directory_parallel: non-directory entries removed
+    unsigned long long directories_removed;             // delete_directory_parallel: directories removed
+    unsigned long long files_linked;                    // Hard links between source files recreated in the copy
+    unsigned long long files_deduplicated;              // Files reflinked or hard-linked to an identical earlier copy
+    unsigned long long bytes_saved;                     // File data not written thanks to the two counters above
+    unsigned long long files_verified;                  // Copies whose read-back matched the checksum of the source
+} copytree_stats_t;
+
+// Number of slowest files a progress report lists
+#define COPYTREE_SLOWEST_FILES 8
+
+// One of the slowest files of a copy so far
+typedef struct {
+    const char *path;           // Source path, valid only during the progress callback
+    off_t size;                 // Size of the source file
+    double seconds;             // Time spent copying it
+} copytree_slow_file_t;
+
+// Snapshot of a running copy handed to the progress callback
+typedef struct {
+    double elapsed;                                     // Seconds since the copy started
+    unsigned long long entries_done;                    // Non-directory entries finished, copied or not
+    unsigned long long files_copied;                    // Counters of copytree_stats_t so far
+    unsigned long long bytes_copied;
+    unsigned long long tier_files[COPY_TIER_COUNT];
+    double entries_per_second;                          // Rates since the previous report; over the whole
+    double mb_per_second;                               // copy in the final report
+    int final;                                          // Set on the last report, made once the copy is done
+    size_t slowest_count;                               // Entries of slowest in use
+    copytree_slow_file_t slowest[COPYTREE_SLOWEST_FILES]; // Slowest files so far, slowest first
+} copytree_progress_t;
+
+// Function called with progress reports of the parallel copy. It runs on a thread of its own while
+// the workers carry on, except for the final report, which comes from the thread that started the copy.
+typedef void (*copytree_progress_fn)(const copytree_progress_t *progress, void *arg);
+
+// How the parallel copy issues its system calls
+typedef enum {
+    COPYTREE_ENGINE_SYNC,       // One blocking system call at a time per worker
+    COPYTREE_ENGINE_IO_URING    // Batch stats and small-file copies through io_uring, falling back to SYNC
+} copytree_engine_t;
+
+// What the parallel copy does with a file whose contents match a file it copied before
+typedef enum {
+    COPYTREE_DEDUP_NONE,        // Copy it like any other file
+    COPYTREE_DEDUP_REFLINK,     // Share the earlier copy's extents (FICLONE), copying when that is refused
+    COPYTREE_DEDUP_HARDLINK     // Hard-link it to the earlier copy when both have the same permissions
+} copytree_dedup_t;
+
+// How the parallel copy treats the page cache while copying file data
+typedef enum {
+    COPYTREE_CACHE_NORMAL,      // Copy through the page cache as usual
+    COPYTREE_CACHE_DROP,        // Start write-back as the copy goes and drop both files' pages once they fall
+                                // behind, so a large copy does not push everything else out of the cache
+    COPYTREE_CACHE_DIRECT       // Reflink, or else read and write whole blocks with O_DIRECT through an aligned
+                                // buffer; COPYTREE_CACHE_DROP on filesystems that refuse O_DIRECT
+} copytree_cache_t;
+
+// Order in which the parallel copy reads the regular files of a directory
+typedef enum {
+    COPYTREE_ORDER_LISTING,     // As the directory lists them, each file a task of its own
+    COPYTREE_ORDER_INODE,       // List the whole directory first, then copy sorted by inode number, which
+                                // most filesystems allocate close to the data
+    COPYTREE_ORDER_PHYSICAL     // Sorted by the disk offset of each file's first extent (FIEMAP), by inode
+                                // number on filesystems that do not report extents
+} copytree_order_t;
+
+// Options for the parallel copy engine, set to defaults by copytree_options_init
+typedef struct {
+    int num_threads;            // Worker threads, <= 0 selects the number of online CPUs
+    int max_open_fds;           // Cap on descriptors the copy holds open at once, <= 0 derives it from RLIMIT_NOFILE.
+                                // A parallel copy raises it to at least 6, 7 with dedup.
+    copytree_engine_t engine;   // System call engine, COPYTREE_ENGINE_SYNC by default
+    int detect_zeros;           // Turn all-zero blocks of dense files into holes (forces the read/write path)
+    int sync;                   // Copy into an existing destination, skipping files whose size and mtime match
+    int delta_blocks;           // Sync mode: rewrite only the changed 64 KiB blocks of large files
+    int delete_extraneous;      // Sync mode: remove destination entries that no longer exist in the source.
+                                // Raises max_open_fds to at least 21 for the deletes.
+    int preserve_links;         // Recreate hard links between source files instead of copying the data again
+    copytree_dedup_t dedup;     // Link files with identical contents together, COPYTREE_DEDUP_NONE by default
+    copytree_cache_t cache;     // Page cache policy for file data, COPYTREE_CACHE_NORMAL by default
+    copytree_order_t order;     // Order of file copies within a directory, COPYTREE_ORDER_LISTING by default
+    int verify;                 // Checksum file data as it is copied and compare with a read-back of the copy
+    const char *manifest;       // File listing the CRC32C, size and times of every copied file, NULL for none.
+                                // A sync reads it first to skip files whose copy is known to match.
+    copytree_stats_t *stats;    // Filled in with the counters of the run when not NULL
+    copytree_progress_fn progress; // Called every progress_interval seconds and once at the end, NULL for none
+    void *progress_arg;         // Passed to progress
+    double progress_interval;   // Seconds between progress reports, <= 0 selects 1
+} copytree_options_t;
+
+// Function to fill an options structure with the default settings
+void copytree_options_init(copytree_options_t *opts);
+
+// Function to return a printable name for a data path
+const char *copytree_tier_name(copytree_tier_t tier);
+
+// Function to extend a CRC32C (Castagnoli) checksum, starting from 0, over len more bytes. Uses the
+// SSE4.2 crc32 instruction when the CPU has it and a table-driven loop elsewhere.
+uint32_t copytree_crc32c(uint32_t crc, const void *data, size_t len);
+
+// Function to copy the data of an open regular file of the given size into dest_fd, trying reflink,
+// copy_file_range, sendfile and finally read/write. Only the data extents of a sparse source are
+// copied, and its holes are recreated in the (empty) destination. The tier that finished the copy is stored in
+// tier_used when it is not NULL. Returns 0 on success and -1 with errno set on failure.
+int copy_file_data(int src_fd, int dest_fd, off_t size, copytree_tier_t *tier_used);
+
 void copy_file(const char *src, const char *dest, int copy_symlinks, int copy_permissions);
 void copy_directory(const char *src, const char *dest, int copy_symlinks, int copy_permissions);
 
+// Function to copy a directory tree with a pool of worker threads. Directory scans and file copies
+// run as separate tasks. Failures are collected and printed sorted by path once the copy is done,
+// so the report does not depend on scheduling. Unless opts->sync is set the destination must not
+// exist. Returns the number of failed entries (0 on success) or -1 if the copy could not be
+// started. opts may be NULL for the defaults. preserve_links and dedup apply to fresh copies only,
+// not to a sync. A progress callback in opts is called from a thread of its own while the copy
+// runs, and once more with the final counters before this function returns. Directories are
+// opened beneath the roots of the copy and entries addressed relative to them, so the depth of the
+// tree is not limited by PATH_MAX.
+int copy_directory_parallel(const char *src, const char *dest, int copy_symlinks, int copy_permissions,
+                            const copytree_options_t *opts);
+
+// Function to write a directory tree to out_fd as one stream: a small header per entry followed by
+// the contents of files and the targets of symbolic links (with copy_symlinks; otherwise they are
+// reported and left out). File contents are spliced straight from the page cache when out_fd is a
+// pipe and sent with sendfile otherwise, so packing into a pipe to ssh or to unpack_directory in
+// another process copies no file data through user space. Returns the number of entries that could
+// not be packed (0 on success) or -1 if the stream could not be written; the stream is complete
+// unless -1 is returned.
+int pack_directory(const char *src, int out_fd, int copy_symlinks);
+
+// Function to recreate a directory tree from a stream written by pack_directory. dest must not
+// exist. File contents are spliced from in_fd into the new files when it is a pipe. The recorded
+// permissions are applied when copy_permissions is set. Returns the number of entries that could
+// not be created (0 on success) or -1 if the stream is malformed (errno EPROTO) or cannot be read.
+int unpack_directory(int in_fd, const char *dest, int copy_permissions);
+
+// Function to remove a directory tree with a pool of worker threads. Every subdirectory is scanned by a
+// task of its own; files are unlinked relative to the directory's descriptor as they are found, and a
+// directory is removed from its parent once everything inside it is gone. A directory is held open
+// only while it is listed, so max_open_fds (at least 3) bounds the descriptors however deep the tree
+// is. Only num_threads, max_open_fds and stats of opts are used; opts may be NULL. Returns the number
+// of failed entries (0 on success) or -1 if the delete could not be started.
+int delete_directory_parallel(const char *path, const copytree_options_t *opts);
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif // COPYTREE_H
\ No newline at end of file
+#endif // COPYTREE_H
@@ -0,0 +1,734 @@
+#define _GNU_SOURCE
+#include "copytree_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <linux/limits.h>
+
+// A tree stream is ARCHIVE_MAGIC followed by records. Every record is a fixed header (type, mode,
+// name length, body length, all little-endian) followed by the name and the body:
+//   'd'  a directory; the records up to the matching 'u' are its entries. The first record of a
+//        stream is the root directory, with an empty name.
+//   'f'  a regular file, the body is its contents
+//   'l'  a symbolic link, the body is its target
+//   'u'  the end of the innermost open directory
+//   'e'  the end of the stream
+// Names are relative to the enclosing directory, so the depth of the tree is not limited by PATH_MAX.
+#define ARCHIVE_MAGIC "CPTREE1\n"
+#define ARCHIVE_MAGIC_SIZE 8
+#define ARCHIVE_HEADER_SIZE 15
+
+// Buffer the records are gathered in, and the largest file body that is copied into it instead of
+// being spliced, so a run of small files costs one write
+#define ARCHIVE_BUFFER_SIZE (256 * 1024)
+#define ARCHIVE_INLINE_MAX (64 * 1024)
+
+// Pipe size asked for on a pipe stream, so each splice moves more than the default 64 KiB
+#define ARCHIVE_PIPE_SIZE (1024 * 1024)
+
+// Largest length of a single splice or sendfile call
+#define ARCHIVE_SPLICE_MAX (1024 * 1024 * 1024)
+
+// One record header as it is encoded in the stream
+typedef struct {
+    char type;
+    unsigned mode;
+    size_t name_len;
+    unsigned long long size;
+} archive_header_t;
+
+// Path of the entry being packed or unpacked, kept for error messages only
+typedef struct {
+    char *buffer;
+    size_t len;
+    size_t capacity;
+} archive_path_t;
+
+// State of a pack or an unpack
+typedef struct {
+    int fd;                     // The stream
+    char *buffer;               // ARCHIVE_BUFFER_SIZE bytes of records not yet written, or read but not used
+    size_t pos;                 // Unpack: offset of the next unused byte in buffer
+    size_t len;                 // Bytes of records in buffer
+    int splice_failed;          // The stream is not a pipe, bodies are moved with sendfile or read/write
+    int sendfile_failed;        // Pack: sendfile to the stream failed too, bodies go through buffer
+    int copy_symlinks;          // Pack: record symbolic links instead of reporting them
+    int copy_permissions;       // Unpack: apply the recorded modes
+    int failures;               // Entries that could not be packed or unpacked
+    archive_path_t path;
+} archive_t;
+
+// Function to put a little-endian number of size bytes at dest
+static void archive_put(unsigned char *dest, unsigned long long value, int size) {
+    for (int i = 0; i < size; i++) {
+        dest[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+// Function to read a little-endian number of size bytes at src
+static unsigned long long archive_get(const unsigned char *src, int size) {
+    unsigned long long value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (unsigned long long)src[i] << (8 * i);
+    }
+    return value;
+}
+
+// Function to append /name to the path of the current entry. Returns the length to restore with
+// archive_path_pop, or (size_t)-1 when there is no memory left.
+static size_t archive_path_push(archive_path_t *path, const char *name) {
+    size_t old_len = path->len;
+    size_t name_len = strlen(name);
+    size_t needed = old_len + name_len + 2;
+    if (needed > path->capacity) {
+        size_t capacity = path->capacity ? path->capacity : PATH_MAX;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(path->buffer, capacity);
+        if (!buffer) {
+            return (size_t)-1;
+        }
+        path->buffer = buffer;
+        path->capacity = capacity;
+    }
+    if (old_len > 0 && name_len > 0) {
+        path->buffer[path->len++] = '/';
+    }
+    memcpy(path->buffer + path->len, name, name_len + 1);
+    path->len += name_len;
+    return old_len;
+}
+
+// Function to cut the path of the current entry back to what it was before archive_path_push
+static void archive_path_pop(archive_path_t *path, size_t len) {
+    path->len = len;
+    path->buffer[len] = '\0';
+}
+
+// Function to report a failed entry without stopping the pack or unpack
+static void archive_error(archive_t *ar, const char *what, const char *name, int err) {
+    size_t len = archive_path_push(&ar->path, name);
+    copy_report_error(NULL, what, len == (size_t)-1 ? name : ar->path.buffer, err);
+    if (len != (size_t)-1) {
+        archive_path_pop(&ar->path, len);
+    }
+    ar->failures++;
+}
+
+// Function to write len bytes to the stream. Returns -1 with errno set when the stream is broken.
+static int archive_write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+// Function to write out the records gathered in the buffer
+static int archive_flush(archive_t *ar) {
+    int result = archive_write_all(ar->fd, ar->buffer, ar->len);
+    ar->len = 0;
+    return result;
+}
+
+// Function to append bytes to the gathered records, writing them out whenever the buffer fills
+static int archive_append(archive_t *ar, const char *data, size_t len) {
+    while (len > 0) {
+        if (ar->len == ARCHIVE_BUFFER_SIZE && archive_flush(ar) == -1) {
+            return -1;
+        }
+        size_t chunk = ARCHIVE_BUFFER_SIZE - ar->len;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(ar->buffer + ar->len, data, chunk);
+        ar->len += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to append a record header and name
+static int archive_put_header(archive_t *ar, char type, mode_t mode, const char *name, unsigned long long size) {
+    unsigned char header[ARCHIVE_HEADER_SIZE];
+    size_t name_len = strlen(name);
+    header[0] = (unsigned char)type;
+    archive_put(header + 1, mode, 4);
+    archive_put(header + 5, name_len, 2);
+    archive_put(header + 7, size, 8);
+    if (archive_append(ar, (const char *)header, sizeof(header)) == -1) {
+        return -1;
+    }
+    return archive_append(ar, name, name_len);
+}
+
+// Function to append zeros in place of file data that could not be read, so the stream stays
+// consistent with the size already written in the header
+static int archive_pad(archive_t *ar, off_t len) {
+    static const char zeros[4096];
+    while (len > 0) {
+        size_t chunk = len > (off_t)sizeof(zeros) ? sizeof(zeros) : (size_t)len;
+        if (archive_append(ar, zeros, chunk) == -1) {
+            return -1;
+        }
+        len -= (off_t)chunk;
+    }
+    return 0;
+}
+
+// Function to send size bytes of an open file as a record body. Large bodies are spliced from the
+// page cache into the pipe, or sent with sendfile when the stream is a socket or a file; small ones
+// are read into the buffer with the records around them. A file that turns out shorter than size
+// is padded with zeros and reported. Returns -1 only when the stream is broken.
+static int archive_put_body(archive_t *ar, int file_fd, const char *name, off_t size) {
+    off_t offset = 0;
+    int read_err = 0;
+    if (size > ARCHIVE_INLINE_MAX && (!ar->splice_failed || !ar->sendfile_failed)) {
+        if (archive_flush(ar) == -1) {
+            return -1;
+        }
+        while (offset < size) {
+            size_t chunk = size - offset > ARCHIVE_SPLICE_MAX ? ARCHIVE_SPLICE_MAX : (size_t)(size - offset);
+            ssize_t moved;
+            if (!ar->splice_failed) {
+                moved = splice(file_fd, &offset, ar->fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            } else {
+                moved = sendfile(ar->fd, file_fd, &offset, chunk);
+            }
+            if (moved > 0 || (moved == -1 && errno == EINTR)) {
+                continue;
+            }
+            if (moved == -1 && (errno == EINVAL || errno == ENOSYS) && offset == 0) {
+                // Not a pipe, or for sendfile a stream the kernel cannot send to: try the next way
+                if (!ar->splice_failed) {
+                    ar->splice_failed = 1;
+                    continue;
+                }
+                ar->sendfile_failed = 1;
+            }
+            // Neither call tells which side failed or whether the file shrank; the buffered path will
+            break;
+        }
+    }
+
+    // Whatever is left goes through the buffer
+    while (offset < size && read_err == 0) {
+        if (ar->len == ARCHIVE_BUFFER_SIZE && archive_flush(ar) == -1) {
+            return -1;
+        }
+        size_t chunk = ARCHIVE_BUFFER_SIZE - ar->len;
+        if ((off_t)chunk > size - offset) {
+            chunk = (size_t)(size - offset);
+        }
+        ssize_t bytes_read = pread(file_fd, ar->buffer + ar->len, chunk, offset);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            read_err = bytes_read == 0 ? 0 : errno;
+            break;
+        }
+        ar->len += (size_t)bytes_read;
+        offset += bytes_read;
+    }
+
+    if (offset < size) {
+        archive_error(ar, read_err ? "Error reading from source file" : "Error: Source file shrank while being packed",
+                      name, read_err);
+        return archive_pad(ar, size - offset);
+    }
+    return 0;
+}
+
+static int archive_pack_directory(archive_t *ar, int dir_fd);
+
+// Function to add one entry of the open directory dir_fd to the stream. Returns -1 only when the
+// stream is broken; an entry that cannot be read is reported and left out.
+static int archive_pack_entry(archive_t *ar, int dir_fd, const dir_entry_t *entry) {
+    unsigned char type = entry->type;
+    struct stat st;
+    if (type == DT_UNKNOWN) {
+        // The filesystem does not report types: ask for this one entry
+        if (fstatat(dir_fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            archive_error(ar, "Error getting source entry information", entry->name, errno);
+            return 0;
+        }
+        type = IFTODT(st.st_mode);
+    }
+
+    if (type == DT_LNK) {
+        if (!ar->copy_symlinks) {
+            archive_error(ar, "Error: Symbolic link encountered but not copying as link (-l not specified)",
+                          entry->name, 0);
+            return 0;
+        }
+        char link_target[PATH_MAX + 1];
+        ssize_t len = readlinkat(dir_fd, entry->name, link_target, sizeof(link_target) - 1);
+        if (len == -1) {
+            archive_error(ar, "Error reading symbolic link", entry->name, errno);
+            return 0;
+        }
+        if (archive_put_header(ar, 'l', 0777, entry->name, (unsigned long long)len) == -1) {
+            return -1;
+        }
+        return archive_append(ar, link_target, (size_t)len);
+    }
+
+    if (type != DT_DIR && type != DT_REG) {
+        archive_error(ar, "Unsupported file type", entry->name, 0);
+        return 0;
+    }
+
+    int flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC | (type == DT_DIR ? O_DIRECTORY : 0);
+    int fd = openat(dir_fd, entry->name, flags);
+    if (fd == -1) {
+        archive_error(ar, type == DT_DIR ? "Error opening source directory" : "Error opening source file",
+                      entry->name, errno);
+        return 0;
+    }
+    if (fstat(fd, &st) == -1) {
+        archive_error(ar, "Error getting source entry information", entry->name, errno);
+        close(fd);
+        return 0;
+    }
+
+    int result;
+    if (type == DT_REG) {
+        result = archive_put_header(ar, 'f', st.st_mode & 07777, entry->name, (unsigned long long)st.st_size);
+        if (result == 0) {
+            result = archive_put_body(ar, fd, entry->name, st.st_size);
+        }
+    } else {
+        result = archive_put_header(ar, 'd', st.st_mode & 07777, entry->name, 0);
+        size_t len = archive_path_push(&ar->path, entry->name);
+        if (result == 0 && len == (size_t)-1) {
+            errno = ENOMEM;
+            result = -1;
+        }
+        if (result == 0) {
+            result = archive_pack_directory(ar, fd);
+            archive_path_pop(&ar->path, len);
+        }
+        if (result == 0) {
+            result = archive_put_header(ar, 'u', 0, "", 0);
+        }
+    }
+    close(fd);
+    return result;
+}
+
+// Function to add the entries of an open directory to the stream
+static int archive_pack_directory(archive_t *ar, int dir_fd) {
+    dir_reader_t reader;
+    if (dir_reader_open(&reader, dir_fd) == -1) {
+        archive_error(ar, "Error reading source directory", "", errno);
+        return 0;
+    }
+
+    dir_entry_t entry;
+    int status;
+    int result = 0;
+    while (result == 0 && (status = dir_reader_next(&reader, &entry)) == 1) {
+        result = archive_pack_entry(ar, dir_fd, &entry);
+    }
+    if (result == 0 && status == -1) {
+        archive_error(ar, "Error reading source directory", "", errno);
+    }
+    dir_reader_close(&reader);
+    return result;
+}
+
+// Function to make a pipe stream larger, so each splice moves more data. Not a pipe, or a size the
+// process may not use, leaves it as it is.
+static void archive_grow_pipe(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) && fcntl(fd, F_GETPIPE_SZ) < ARCHIVE_PIPE_SIZE) {
+        fcntl(fd, F_SETPIPE_SZ, ARCHIVE_PIPE_SIZE);
+    }
+}
+
+// Function to start the state of a pack or unpack on the stream fd
+static int archive_init(archive_t *ar, int fd, const char *root) {
+    memset(ar, 0, sizeof(*ar));
+    ar->fd = fd;
+    ar->buffer = malloc(ARCHIVE_BUFFER_SIZE);
+    if (!ar->buffer || archive_path_push(&ar->path, root) == (size_t)-1) {
+        free(ar->buffer);
+        free(ar->path.buffer);
+        errno = ENOMEM;
+        return -1;
+    }
+    archive_grow_pipe(fd);
+    return 0;
+}
+
+// Function to release the state of a pack or unpack
+static void archive_free(archive_t *ar) {
+    free(ar->buffer);
+    free(ar->path.buffer);
+}
+
+int pack_directory(const char *src, int out_fd, int copy_symlinks) {
+    int src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (src_fd == -1) {
+        perror("Error opening source directory");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(src_fd, &st) == -1) {
+        perror("Error getting source directory information");
+        close(src_fd);
+        return -1;
+    }
+
+    archive_t ar;
+    if (archive_init(&ar, out_fd, src) == -1) {
+        perror("Error packing directory");
+        close(src_fd);
+        return -1;
+    }
+    ar.copy_symlinks = copy_symlinks;
+
+    int result = archive_append(&ar, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE);
+    if (result == 0) {
+        result = archive_put_header(&ar, 'd', st.st_mode & 07777, "", 0);
+    }
+    if (result == 0) {
+        result = archive_pack_directory(&ar, src_fd);
+    }
+    if (result == 0) {
+        result = archive_put_header(&ar, 'u', 0, "", 0);
+    }
+    if (result == 0) {
+        result = archive_put_header(&ar, 'e', 0, "", 0);
+    }
+    if (result == 0) {
+        result = archive_flush(&ar);
+    }
+    if (result == -1) {
+        perror("Error writing tree stream");
+    }
+
+    int failures = ar.failures;
+    archive_free(&ar);
+    close(src_fd);
+    return result == -1 ? -1 : failures;
+}
+
+// Function to make at least one more byte of the stream available in the buffer. Returns 0 at the
+// end of the stream and -1 when reading it fails.
+static ssize_t archive_fill(archive_t *ar) {
+    if (ar->pos == ar->len) {
+        ar->pos = 0;
+        ar->len = 0;
+    }
+    for (;;) {
+        ssize_t bytes_read = read(ar->fd, ar->buffer + ar->len, ARCHIVE_BUFFER_SIZE - ar->len);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read > 0) {
+            ar->len += (size_t)bytes_read;
+        }
+        return bytes_read;
+    }
+}
+
+// Function to read exactly len bytes of the stream into dest. A stream that ends early is
+// malformed; errno is set to EPROTO.
+static int archive_read(archive_t *ar, void *dest, size_t len) {
+    char *out = dest;
+    while (len > 0) {
+        if (ar->pos == ar->len) {
+            ssize_t filled = archive_fill(ar);
+            if (filled <= 0) {
+                if (filled == 0) {
+                    errno = EPROTO;
+                }
+                return -1;
+            }
+        }
+        size_t chunk = ar->len - ar->pos < len ? ar->len - ar->pos : len;
+        memcpy(out, ar->buffer + ar->pos, chunk);
+        ar->pos += chunk;
+        out += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to read the next record header and its name into name (NAME_MAX + 1 bytes). A name
+// that could step out of the directory being unpacked makes the stream malformed.
+static int archive_get_header(archive_t *ar, archive_header_t *header, char *name) {
+    unsigned char raw[ARCHIVE_HEADER_SIZE];
+    if (archive_read(ar, raw, sizeof(raw)) == -1) {
+        return -1;
+    }
+    header->type = (char)raw[0];
+    header->mode = (unsigned)archive_get(raw + 1, 4) & 07777;
+    header->name_len = (size_t)archive_get(raw + 5, 2);
+    header->size = archive_get(raw + 7, 8);
+    if (header->name_len > NAME_MAX) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (archive_read(ar, name, header->name_len) == -1) {
+        return -1;
+    }
+    name[header->name_len] = '\0';
+    if (memchr(name, '/', header->name_len) || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        header->size > (unsigned long long)INT64_MAX) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to move size bytes of record body from the stream into file_fd, or to skip them when
+// file_fd is -1. Bytes already in the buffer are written from there; the rest are spliced straight
+// from the pipe into the file. A failure to write the file is stored in *write_err and the rest of
+// the body skipped. Returns -1 only when the stream is broken.
+static int archive_get_body(archive_t *ar, int file_fd, unsigned long long size, int *write_err) {
+    off_t offset = 0;
+    int use_splice = file_fd != -1 && !ar->splice_failed;
+    *write_err = 0;
+    while (size > 0) {
+        if (ar->pos == ar->len && use_splice) {
+            size_t chunk = size > ARCHIVE_SPLICE_MAX ? ARCHIVE_SPLICE_MAX : (size_t)size;
+            ssize_t moved = splice(ar->fd, NULL, file_fd, &offset, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved > 0) {
+                size -= (unsigned long long)moved;
+                continue;
+            }
+            if (moved == 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL) {
+                ar->splice_failed = 1; // Not a pipe: go through the buffer from now on
+            }
+            // splice does not tell which side failed; the buffered path below will
+            use_splice = 0;
+            continue;
+        }
+
+        if (ar->pos == ar->len) {
+            ssize_t filled = archive_fill(ar);
+            if (filled <= 0) {
+                if (filled == 0) {
+                    errno = EPROTO;
+                }
+                return -1;
+            }
+        }
+        size_t chunk = ar->len - ar->pos;
+        if (chunk > size) {
+            chunk = (size_t)size;
+        }
+        if (file_fd != -1 && *write_err == 0) {
+            size_t done = 0;
+            while (done < chunk) {
+                ssize_t written = pwrite(file_fd, ar->buffer + ar->pos + done, chunk - done, offset + (off_t)done);
+                if (written == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    *write_err = written == 0 ? EIO : errno;
+                    break;
+                }
+                done += (size_t)written;
+            }
+        }
+        ar->pos += chunk;
+        offset += (off_t)chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Function to unpack one regular file record into the open directory dir_fd, or to skip its body
+// when dir_fd is -1
+static int archive_unpack_file(archive_t *ar, int dir_fd, const archive_header_t *header, const char *name) {
+    int fd = -1;
+    if (dir_fd != -1) {
+        fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, header->mode);
+        if (fd == -1) {
+            archive_error(ar, "Error opening target file", name, errno);
+        }
+    }
+
+    int write_err;
+    if (archive_get_body(ar, fd, header->size, &write_err) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (fd == -1) {
+        return 0;
+    }
+    if (write_err != 0) {
+        archive_error(ar, "Error writing to target file", name, write_err);
+    } else if (ar->copy_permissions && fchmod(fd, header->mode) == -1) {
+        archive_error(ar, "Error setting target file permissions", name, errno);
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to unpack one symbolic link record into the open directory dir_fd
+static int archive_unpack_symlink(archive_t *ar, int dir_fd, const archive_header_t *header, const char *name) {
+    char link_target[PATH_MAX + 1];
+    if (header->size > PATH_MAX) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (archive_read(ar, link_target, (size_t)header->size) == -1) {
+        return -1;
+    }
+    link_target[header->size] = '\0';
+    if (dir_fd != -1 && symlinkat(link_target, dir_fd, name) == -1) {
+        archive_error(ar, "Error creating symbolic link", name, errno);
+    }
+    return 0;
+}
+
+// Function to unpack the records of one directory into the open directory dir_fd, up to its 'u'
+// record. dir_fd is -1 when the directory could not be created; its records are then read and
+// dropped. The directory's own mode is applied last, so a read-only directory can still be filled.
+static int archive_unpack_directory(archive_t *ar, int dir_fd, mode_t mode) {
+    archive_header_t header;
+    char name[NAME_MAX + 1];
+    int result = 0;
+    for (;;) {
+        if (archive_get_header(ar, &header, name) == -1) {
+            return -1;
+        }
+        if (header.type == 'u') {
+            break;
+        }
+
+        if (header.type == 'f') {
+            result = archive_unpack_file(ar, dir_fd, &header, name);
+        } else if (header.type == 'l') {
+            result = archive_unpack_symlink(ar, dir_fd, &header, name);
+        } else if (header.type == 'd' && header.size == 0) {
+            int sub_fd = -1;
+            if (dir_fd != -1) {
+                if (mkdirat(dir_fd, name, 0755) == -1) {
+                    archive_error(ar, "Error creating target directory", name, errno);
+                } else if ((sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+                    archive_error(ar, "Error opening target directory", name, errno);
+                }
+            }
+            size_t len = archive_path_push(&ar->path, name);
+            if (len == (size_t)-1) {
+                errno = ENOMEM;
+                result = -1;
+            } else {
+                result = archive_unpack_directory(ar, sub_fd, header.mode);
+                archive_path_pop(&ar->path, len);
+            }
+            if (sub_fd != -1) {
+                close(sub_fd);
+            }
+        } else {
+            errno = EPROTO;
+            result = -1;
+        }
+        if (result == -1) {
+            return -1;
+        }
+    }
+
+    if (dir_fd != -1 && fchmod(dir_fd, ar->copy_permissions ? mode : 0755) == -1) {
+        archive_error(ar, "Error setting directory permissions", "", errno);
+    }
+    return 0;
+}
+
+int unpack_directory(int in_fd, const char *dest, int copy_permissions) {
+    // The target directory must not exist yet
+    if (directory_exists(dest)) {
+        errno = EEXIST;
+        perror("Error: Destination directory already exists");
+        return -1;
+    }
+
+    archive_t ar;
+    if (archive_init(&ar, in_fd, dest) == -1) {
+        perror("Error unpacking directory");
+        return -1;
+    }
+    ar.copy_permissions = copy_permissions;
+
+    char magic[ARCHIVE_MAGIC_SIZE];
+    archive_header_t header;
+    char name[NAME_MAX + 1];
+    int result = archive_read(&ar, magic, sizeof(magic));
+    if (result == 0 && memcmp(magic, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE) != 0) {
+        errno = EPROTO;
+        result = -1;
+    }
+    if (result == 0) {
+        result = archive_get_header(&ar, &header, name);
+    }
+    if (result == 0 && (header.type != 'd' || header.name_len != 0)) {
+        errno = EPROTO;
+        result = -1;
+    }
+    if (result == -1) {
+        perror("Error reading tree stream");
+        archive_free(&ar);
+        return -1;
+    }
+
+    // Create the root writable by its owner; the recorded mode is applied once it is filled
+    if (create_directory_recursive(dest, 0755) != 0) {
+        perror("Error creating target directory");
+        archive_free(&ar);
+        return -1;
+    }
+    int dest_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dest_fd == -1) {
+        perror("Error opening target directory");
+        archive_free(&ar);
+        return -1;
+    }
+
+    result = archive_unpack_directory(&ar, dest_fd, header.mode);
+    if (result == 0) {
+        result = archive_get_header(&ar, &header, name);
+        if (result == 0 && header.type != 'e') {
+            errno = EPROTO;
+            result = -1;
+        }
+    }
+    if (result == -1) {
+        perror("Error reading tree stream");
+    }
+
+    int failures = ar.failures;
+    close(dest_fd);
+    archive_free(&ar);
+    return result == -1 ? -1 : failures;
+}
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include "copytree_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Buckets of a link table; grown by doubling once it holds as many entries
+#define LINK_TABLE_INITIAL_BUCKETS 1024
+
+// Bytes read at a time while hashing or comparing file contents
+#define DEDUP_READ_SIZE (256 * 1024)
+
+// State of a link table entry
+enum {
+    LINK_COPYING,               // The first copy is still being made
+    LINK_DONE,                  // path holds a finished copy
+    LINK_FAILED                 // The first copy failed, later names copy on their own
+};
+
+// A destination file recorded in a link table
+typedef struct link_entry {
+    struct link_entry *next;
+    unsigned long long key1;
+    unsigned long long key2;
+    mode_t mode;
+    int state;
+    char path[];                // Destination path of the copy
+} link_entry_t;
+
+// A hash table of destination files keyed by two numbers
+struct copy_link_table {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;    // Broadcast when a claimed entry leaves LINK_COPYING
+    link_entry_t **buckets;
+    size_t bucket_count;
+    size_t count;
+};
+
+// Function to mix the two keys of an entry into a bucket index
+static size_t link_bucket(const copy_link_table_t *table, unsigned long long key1, unsigned long long key2) {
+    unsigned long long h = key1 * 0x9E3779B97F4A7C15ULL ^ key2;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return (size_t)(h & (table->bucket_count - 1));
+}
+
+// Function to create an empty table. Returns NULL if no memory is left.
+copy_link_table_t *link_table_create(void) {
+    copy_link_table_t *table = calloc(1, sizeof(copy_link_table_t));
+    if (!table) {
+        return NULL;
+    }
+    table->bucket_count = LINK_TABLE_INITIAL_BUCKETS;
+    table->buckets = calloc(table->bucket_count, sizeof(link_entry_t *));
+    if (!table->buckets) {
+        free(table);
+        return NULL;
+    }
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_cond_init(&table->finished, NULL);
+    return table;
+}
+
+// Function to release a table and every entry in it
+void link_table_destroy(copy_link_table_t *table) {
+    if (!table) {
+        return;
+    }
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        link_entry_t *entry = table->buckets[i];
+        while (entry) {
+            link_entry_t *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    pthread_mutex_destroy(&table->lock);
+    pthread_cond_destroy(&table->finished);
+    free(table);
+}
+
+// Function to double the buckets of a table. Called with the lock held; on failure the table keeps
+// its old size and only gets slower.
+static void link_table_grow(copy_link_table_t *table) {
+    size_t old_count = table->bucket_count;
+    link_entry_t **old_buckets = table->buckets;
+    link_entry_t **buckets = calloc(old_count * 2, sizeof(link_entry_t *));
+    if (!buckets) {
+        return;
+    }
+
+    table->buckets = buckets;
+    table->bucket_count = old_count * 2;
+    for (size_t i = 0; i < old_count; i++) {
+        link_entry_t *entry = old_buckets[i];
+        while (entry) {
+            link_entry_t *next = entry->next;
+            size_t bucket = link_bucket(table, entry->key1, entry->key2);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(old_buckets);
+}
+
+// Function to add an entry. Called with the lock held.
+static link_entry_t *link_table_insert(copy_link_table_t *table, unsigned long long key1, unsigned long long key2,
+                                       mode_t mode, int state, const char *path) {
+    size_t len = strlen(path) + 1;
+    link_entry_t *entry = malloc(sizeof(link_entry_t) + len);
+    if (!entry) {
+        return NULL;
+    }
+    entry->key1 = key1;
+    entry->key2 = key2;
+    entry->mode = mode;
+    entry->state = state;
+    memcpy(entry->path, path, len);
+
+    if (table->count >= table->bucket_count) {
+        link_table_grow(table);
+    }
+    size_t bucket = link_bucket(table, key1, key2);
+    entry->next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    table->count++;
+    return entry;
+}
+
+// Function to look up the first copy of a source inode. Returns 1 with a copy of the path to link to
+// in *target, 0 when the caller is the first to get here and must copy the file and then pass *claim
+// to link_table_finish, and -1 when no memory is left. A caller that comes while the first copy is
+// still being made waits for it.
+int link_table_claim(copy_link_table_t *table, unsigned long long key1, unsigned long long key2,
+                     const char *dest_path, void **claim, char **target) {
+    *claim = NULL;
+    *target = NULL;
+
+    pthread_mutex_lock(&table->lock);
+    link_entry_t *entry = table->buckets[link_bucket(table, key1, key2)];
+    while (entry && !(entry->key1 == key1 && entry->key2 == key2)) {
+        entry = entry->next;
+    }
+    if (!entry) {
+        *claim = link_table_insert(table, key1, key2, 0, LINK_COPYING, dest_path);
+        pthread_mutex_unlock(&table->lock);
+        return *claim ? 0 : -1;
+    }
+
+    while (entry->state == LINK_COPYING) {
+        pthread_cond_wait(&table->finished, &table->lock);
+    }
+    if (entry->state == LINK_FAILED) {
+        pthread_mutex_unlock(&table->lock);
+        return 0; // Nothing to link to: copy it like any other file
+    }
+    *target = strdup(entry->path);
+    pthread_mutex_unlock(&table->lock);
+    return *target ? 1 : -1;
+}
+
+// Function to publish the outcome of the copy a claim was taken for
+void link_table_finish(copy_link_table_t *table, void *claim, int ok) {
+    link_entry_t *entry = claim;
+    if (!entry) {
+        return;
+    }
+    pthread_mutex_lock(&table->lock);
+    entry->state = ok ? LINK_DONE : LINK_FAILED;
+    pthread_cond_broadcast(&table->finished);
+    pthread_mutex_unlock(&table->lock);
+}
+
+// Function to return a copy of the path of a finished file with these keys and permissions, or NULL
+// if there is none
+char *link_table_find(copy_link_table_t *table, unsigned long long key1, unsigned long long key2, mode_t mode) {
+    char *path = NULL;
+    pthread_mutex_lock(&table->lock);
+    for (link_entry_t *entry = table->buckets[link_bucket(table, key1, key2)]; entry; entry = entry->next) {
+        if (entry->key1 == key1 && entry->key2 == key2 && entry->mode == mode && entry->state == LINK_DONE) {
+            path = strdup(entry->path);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+    return path;
+}
+
+// Function to record a finished file. Returns -1 when no memory is left.
+int link_table_add(copy_link_table_t *table, unsigned long long key1, unsigned long long key2, mode_t mode,
+                   const char *path) {
+    pthread_mutex_lock(&table->lock);
+    link_entry_t *entry = link_table_insert(table, key1, key2, mode, LINK_DONE, path);
+    pthread_mutex_unlock(&table->lock);
+    return entry ? 0 : -1;
+}
+
+// Function to read up to len bytes at offset, retrying short reads. Returns the bytes read.
+static ssize_t dedup_read(int fd, char *buffer, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buffer + done, len - done, offset + (off_t)done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+// Function to fold 8 bytes into a running hash
+static unsigned long long dedup_mix(unsigned long long h, unsigned long long word) {
+    word *= 0x87C37B91114253D5ULL;
+    word = (word << 31) | (word >> 33);
+    h ^= word * 0x4CF5AD432745937FULL;
+    return ((h << 27) | (h >> 37)) * 5 + 0x52DCE729;
+}
+
+// Function to hash the contents of an open file of the given size. The hash only has to spread
+// different files apart: a match is always confirmed with dedup_files_equal before it is used.
+int dedup_hash_file(int fd, off_t size, unsigned long long *hash) {
+    char *buffer = malloc(DEDUP_READ_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+
+    unsigned long long h = (unsigned long long)size;
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t n = dedup_read(fd, buffer, DEDUP_READ_SIZE, offset);
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO; // The file shrank while it was being hashed
+            }
+            int saved_errno = errno;
+            free(buffer);
+            errno = saved_errno;
+            return -1;
+        }
+        ssize_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            unsigned long long word;
+            memcpy(&word, buffer + i, sizeof(word));
+            h = dedup_mix(h, word);
+        }
+        if (i < n) {
+            unsigned long long word = 0;
+            memcpy(&word, buffer + i, (size_t)(n - i));
+            h = dedup_mix(h, word);
+        }
+        offset += n;
+    }
+    free(buffer);
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    *hash = h;
+    return 0;
+}
+
+// Function to compare the first size bytes of two open files. Returns 1 if they are equal, 0 if
+// they differ and -1 on a read error.
+int dedup_files_equal(int fd_a, int fd_b, off_t size) {
+    char *buffers = malloc(2 * DEDUP_READ_SIZE);
+    if (!buffers) {
+        return -1;
+    }
+
+    int result = 1;
+    off_t offset = 0;
+    while (offset < size && result == 1) {
+        size_t len = size - offset < DEDUP_READ_SIZE ? (size_t)(size - offset) : DEDUP_READ_SIZE;
+        ssize_t a = dedup_read(fd_a, buffers, len, offset);
+        ssize_t b = dedup_read(fd_b, buffers + DEDUP_READ_SIZE, len, offset);
+        if (a == -1 || b == -1) {
+            result = -1;
+        } else if (a != (ssize_t)len || b != (ssize_t)len || memcmp(buffers, buffers + DEDUP_READ_SIZE, len) != 0) {
+            result = 0;
+        }
+        offset += (off_t)len;
+    }
+
+    int saved_errno = errno;
+    free(buffers);
+    errno = saved_errno;
+    return result;
+}
@@ -0,0 +1,208 @@
+// copytree_internal.h
+#ifndef COPYTREE_INTERNAL_H
+#define COPYTREE_INTERNAL_H
+
+#include "copytree.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Table of destination files keyed by two numbers, see copytree_dedup.c
+typedef struct copy_link_table copy_link_table_t;
+
+// Checksums of copied files kept for a manifest, see copytree_verify.c
+typedef struct copy_manifest copy_manifest_t;
+
+// One failure recorded while copying, reported once the copy has finished
+typedef struct {
+    char *path;                 // Path the operation failed on
+    const char *what;           // Description of the failed operation
+    int err;                    // errno value of the failure
+} copy_error_t;
+
+// State shared by every task of one copy run. Functions taking a context accept NULL,
+// in which case errors are printed immediately the way the sequential copy always has.
+typedef struct {
+    copytree_options_t opts;    // Options the run was started with (defaults filled in)
+    int copy_symlinks;          // Recreate symbolic links instead of reporting them
+    int copy_permissions;       // Apply the source permissions to the copies
+
+    pthread_mutex_t lock;       // Protects the error list
+    copy_error_t *errors;       // Failures collected so far
+    size_t error_count;
+    size_t error_capacity;
+
+    pthread_mutex_t fd_lock;    // Protects fds_available
+    pthread_cond_t fd_cond;     // Signalled when descriptors are released
+    int fds_available;          // Descriptors that may still be opened under max_open_fds
+
+    atomic_ullong files_copied;                 // Counters reported through copytree_stats_t
+    atomic_ullong bytes_copied;
+    atomic_ullong tier_files[COPY_TIER_COUNT];
+    atomic_ullong hole_bytes;
+    atomic_ullong files_skipped;
+    atomic_ullong files_delta;
+    atomic_ullong entries_deleted;
+    atomic_ullong files_removed;
+    atomic_ullong directories_removed;
+    atomic_ullong files_linked;
+    atomic_ullong files_deduplicated;
+    atomic_ullong bytes_saved;
+
+    copy_link_table_t *links;   // First copy of each hard-linked source inode, when preserve_links is set
+    copy_link_table_t *dedup;   // Copies by size and content hash, when dedup is set
+    copy_manifest_t *manifest;  // Checksums of the copied files, when a manifest is kept
+    size_t dest_root_len;       // Length of the destination root, cut off the paths in the manifest
+                                // and off the directories opened beneath the roots
+    int src_root_fd;            // Roots of a parallel copy, open while it runs
+    int dest_root_fd;
+    atomic_ullong files_verified;
+
+    atomic_ullong entries_done;     // Non-directory entries finished, for progress reports
+    double start_time;              // Monotonic time the run started, in seconds
+    pthread_mutex_t progress_lock;  // Protects slowest and finished
+    pthread_cond_t progress_cond;   // Signalled when the copy has finished, on the monotonic clock
+    int finished;                   // Every task has run; the progress reporter stops
+    copytree_slow_file_t slowest[COPYTREE_SLOWEST_FILES]; // Slowest files so far with strdup'd paths, slowest first
+    size_t slowest_count;
+    atomic_ullong slowest_floor_ns; // Time a file has to beat to enter a full slowest list
+} copy_context_t;
+
+// Function to record (or, without a context, print) a failed operation
+void copy_report_error(copy_context_t *ctx, const char *what, const char *path, int err);
+
+// Functions to reserve and release descriptors against the context's open-file cap
+void copy_acquire_fds(copy_context_t *ctx, int count);
+void copy_release_fds(copy_context_t *ctx, int count);
+
+// A directory entry addressed relative to an open directory
+typedef struct {
+    int dir_fd;                 // Directory the name is relative to, AT_FDCWD when name is a whole path
+    const char *name;
+    const char *dir_path;       // Path of dir_fd for error messages, NULL when name is a whole path
+} copy_entry_t;
+
+// Functions to build the whole path of an entry (NULL when out of memory), and to record a failure
+// on an entry, building its path only then
+char *copy_entry_path(const copy_entry_t *entry);
+void copy_report_entry_error(copy_context_t *ctx, const char *what, const copy_entry_t *entry, int err);
+
+// Function to copy one non-directory entry, addressed relative to open directories, whose lstat
+// information is already known
+int copy_file_entry_at(copy_context_t *ctx, const copy_entry_t *src, const copy_entry_t *dest,
+                       const struct stat *src_stat, int copy_symlinks, int copy_permissions);
+
+// Function to copy one non-directory entry whose lstat information is already known
+int copy_file_entry(copy_context_t *ctx, const char *src, const char *dest, const struct stat *src_stat,
+                    int copy_symlinks, int copy_permissions);
+
+// Functions of the sync mode: update one non-directory entry, make sure a directory exists,
+// and remove destination entries that are gone from the source
+int sync_file_entry(copy_context_t *ctx, const copy_entry_t *src, const copy_entry_t *dest, const struct stat *src_stat);
+int sync_directory_entry(copy_context_t *ctx, const copy_entry_t *dest, mode_t mode, mode_t *existing_mode);
+void sync_prune_directory(copy_context_t *ctx, int src_fd, int dest_fd, const char *dest_path);
+
+// Smallest file the content deduplication looks at
+#define DEDUP_MIN_SIZE 4096
+
+// Functions of the hard-link and duplicate-content tables, see copytree_dedup.c
+copy_link_table_t *link_table_create(void);
+void link_table_destroy(copy_link_table_t *table);
+int link_table_claim(copy_link_table_t *table, unsigned long long key1, unsigned long long key2,
+                     const char *dest_path, void **claim, char **target);
+void link_table_finish(copy_link_table_t *table, void *claim, int ok);
+char *link_table_find(copy_link_table_t *table, unsigned long long key1, unsigned long long key2, mode_t mode);
+int link_table_add(copy_link_table_t *table, unsigned long long key1, unsigned long long key2, mode_t mode,
+                   const char *path);
+int dedup_hash_file(int fd, off_t size, unsigned long long *hash);
+int dedup_files_equal(int fd_a, int fd_b, off_t size);
+
+// What a manifest records about one file: the CRC32C and size of its data, the modification time
+// of the source it was copied from and that of the copy once it was finished
+typedef struct {
+    uint32_t crc;
+    off_t size;
+    struct timespec src_mtime;
+    struct timespec dest_mtime;
+} copy_manifest_record_t;
+
+// Functions of the checksums and manifests, see copytree_verify.c. manifest_open reads the previous
+// manifest at path when load_previous is set; lookups only see those entries, while the records of
+// this run are collected apart and written, sorted by path, in place of the old file by manifest_write.
+uint32_t copy_crc_zeros(uint32_t crc, off_t len);
+int copy_crc_file(int fd, off_t size, uint32_t *crc);
+copy_manifest_t *manifest_open(const char *path, int load_previous);
+int manifest_write(copy_manifest_t *manifest);
+void manifest_destroy(copy_manifest_t *manifest);
+
+// Functions to look up the previous manifest entry of a destination path, and to record its entry
+// for this run, when the context keeps a manifest. copy_manifest_note records a finished copy of a
+// regular file from its open destination.
+int copy_manifest_lookup(const copy_context_t *ctx, const char *dest, copy_manifest_record_t *record);
+void copy_manifest_record(copy_context_t *ctx, const char *dest, const copy_manifest_record_t *record);
+void copy_manifest_note(copy_context_t *ctx, const char *dest, int dest_fd, const struct stat *src_stat, uint32_t crc);
+
+// Largest file the io_uring engine copies in one read/write pair, and files per batch
+#define URING_SMALL_FILE_MAX (64 * 1024)
+#define URING_BATCH_FILES 64
+
+// A regular file handed to the io_uring engine
+typedef struct {
+    const char *src;
+    const char *dest;
+    struct stat st;             // lstat of the source
+} uring_file_t;
+
+// Function to tell whether the io_uring engine can run on this system
+int copy_uring_available(void);
+
+// Function to lstat a batch of names in the directory dir_fd through io_uring. errors[i] receives 0
+// or the errno of entry i. Returns -1 when io_uring cannot be used, so the caller falls back to fstatat.
+int copy_uring_stat(int dir_fd, const char *const *names, struct stat *stats, int *errors, size_t count);
+
+// Function to copy up to URING_BATCH_FILES regular files of at most URING_SMALL_FILE_MAX bytes.
+// Returns -1 without copying anything when io_uring cannot be used.
+int copy_uring_files(copy_context_t *ctx, const uring_file_t *files, size_t count);
+
+// Size of the buffer directory entries are read into with getdents64
+#define DIR_READ_BUFFER_SIZE (64 * 1024)
+
+// Reader of the raw entries of an open directory, many entries per system call
+typedef struct {
+    int fd;                     // Directory being read; not owned by the reader
+    char *buffer;               // DIR_READ_BUFFER_SIZE bytes of entries as getdents64 returned them
+    size_t pos;                 // Offset of the next entry in buffer
+    size_t len;                 // Bytes of entries in buffer
+    off_t offset;               // Directory position after the last entry returned
+} dir_reader_t;
+
+// One entry returned by dir_reader_next
+typedef struct {
+    const char *name;           // Points into the reader's buffer
+    unsigned char type;         // DT_* type, DT_UNKNOWN when the filesystem does not report it
+    ino_t ino;
+} dir_entry_t;
+
+// Functions to read the entries of an open directory with getdents64, see copytree.c
+int dir_reader_open(dir_reader_t *reader, int fd);
+int dir_reader_next(dir_reader_t *reader, dir_entry_t *entry);
+void dir_reader_rewind(dir_reader_t *reader);
+void dir_reader_suspend(dir_reader_t *reader);
+int dir_reader_resume(dir_reader_t *reader, int fd);
+void dir_reader_close(dir_reader_t *reader);
+
+// Directory levels a sequential copy or delete keeps open at once. Deeper trees close the
+// descriptors of the levels above and reopen them through ".." on the way back up.
+#define DIR_OPEN_DEPTH 16
+
+// Helpers shared by the sequential and parallel copy engines
+int delete_path(const char *path);
+int delete_path_at(int dir_fd, const char *name, unsigned char type);
+int reopen_parent(int fd, int flags, dev_t dev, ino_t ino);
+int directory_exists(const char *path);
+int create_directory_recursive(const char *dir_path, mode_t mode);
+
+#endif // COPYTREE_INTERNAL_H
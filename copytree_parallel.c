@@ -0,0 +1,1405 @@
+#define _GNU_SOURCE
+#include "copytree_internal.h"
+#include "work_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+#include <limits.h>
+#include <dirent.h>
+#include <string.h>
+#include <time.h>
+
+// Descriptors held for the whole parallel copy: the roots of the source and the destination, which
+// every directory is opened beneath
+#define ROOT_FDS 2
+
+// Descriptors a directory scan holds: the source and target directories, and one more while a long
+// path is opened piece by piece. A scan that prunes the target adds the levels delete_path_at keeps
+// open while it removes an extraneous subtree.
+#define SCAN_FDS 3
+#define PRUNE_FDS (SCAN_FDS + DIR_OPEN_DEPTH)
+
+// Ordered copies: fewest files per run before the sorted files of a directory are split over the
+// workers, files ahead of the one being copied whose data is prefetched, and bytes prefetched per file
+#define ORDER_RUN_MIN_FILES 64
+#define ORDER_PREFETCH_FILES 4
+#define ORDER_PREFETCH_BYTES (4 * 1024 * 1024)
+
+// Destination directory whose final permissions are applied once everything inside it is copied,
+// so a read-only source directory does not stop its own children from being created
+typedef struct dir_node {
+    struct dir_node *parent;    // Directory this one lives in, NULL for the root of the copy
+    atomic_int pending;         // Outstanding tasks inside this directory plus its own scan
+    mode_t mode;                // Permissions to apply when the directory is complete
+    int set_mode;               // Whether mode is applied at all
+    char path[];                // Destination path of the directory
+} dir_node_t;
+
+// A directory scan or a file copy queued on the pool
+typedef struct {
+    copy_context_t *ctx;
+    work_pool_t *pool;
+    dir_node_t *node;           // Destination directory the task contributes to
+    struct stat src_stat;       // lstat of the source entry (file copies only)
+    char *src;                  // Source path
+    char *dest;                 // Destination path
+    const char *name;           // Name of the entry, the tail of both paths
+    int long_paths;             // Either path is too long to be opened whole
+} copy_task_t;
+
+// Regular files of one directory scan held back to be copied in disk order
+typedef struct {
+    copy_task_t **files;
+    size_t count;
+    size_t capacity;
+} order_list_t;
+
+// A run of files copied one after the other in disk order by a single task
+typedef struct {
+    size_t count;
+    copy_task_t *files[];
+} order_run_t;
+
+// Function to fill an options structure with the default settings
+void copytree_options_init(copytree_options_t *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->num_threads = 0;
+    opts->max_open_fds = 0;
+    opts->engine = COPYTREE_ENGINE_SYNC;
+    opts->detect_zeros = 0;
+    opts->sync = 0;
+    opts->delta_blocks = 0;
+    opts->delete_extraneous = 0;
+    opts->preserve_links = 0;
+    opts->dedup = COPYTREE_DEDUP_NONE;
+    opts->cache = COPYTREE_CACHE_NORMAL;
+    opts->verify = 0;
+    opts->manifest = NULL;
+    opts->order = COPYTREE_ORDER_LISTING;
+    opts->stats = NULL;
+    opts->progress = NULL;
+    opts->progress_arg = NULL;
+    opts->progress_interval = 1;
+}
+
+// Function to derive the descriptor cap from the process limit when none was given
+static int default_max_open_fds(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        // Leave half of the limit to the rest of the process
+        return (int)(rl.rlim_cur / 2);
+    }
+    return 512;
+}
+
+// Function to allocate a task together with its two paths, those of name inside src_dir and
+// dest_dir, or src_dir and dest_dir themselves without a name
+static copy_task_t *task_create(copy_context_t *ctx, work_pool_t *pool, dir_node_t *node,
+                                const char *src_dir, const char *dest_dir, const char *name) {
+    size_t src_dir_len = strlen(src_dir);
+    size_t dest_dir_len = strlen(dest_dir);
+    size_t name_len = name ? strlen(name) + 1 : 0; // With the separating slash
+    size_t src_len = src_dir_len + name_len + 1;
+    size_t dest_len = dest_dir_len + name_len + 1;
+    copy_task_t *task = malloc(sizeof(copy_task_t) + src_len + dest_len);
+    if (!task) {
+        return NULL;
+    }
+    task->ctx = ctx;
+    task->pool = pool;
+    task->node = node;
+    task->src = (char *)(task + 1);
+    task->dest = task->src + src_len;
+    memcpy(task->src, src_dir, src_dir_len);
+    memcpy(task->dest, dest_dir, dest_dir_len);
+    if (name) {
+        task->src[src_dir_len] = '/';
+        task->dest[dest_dir_len] = '/';
+        memcpy(task->src + src_dir_len + 1, name, name_len);
+        memcpy(task->dest + dest_dir_len + 1, name, name_len);
+    } else {
+        task->src[src_dir_len] = '\0';
+        task->dest[dest_dir_len] = '\0';
+    }
+    task->name = task->src + src_len - (name_len ? name_len : 1);
+    task->long_paths = src_len > PATH_MAX || dest_len > PATH_MAX;
+    return task;
+}
+
+// Function to open path below dir_fd without following symbolic links anywhere on the way, so a
+// directory swapped for a link while the tree is worked on cannot lead out of it. Kernels without
+// openat2 only refuse a link in the last component.
+static int open_beneath(int dir_fd, const char *path, int flags) {
+    static atomic_int no_openat2;
+    flags |= O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    if (!atomic_load_explicit(&no_openat2, memory_order_relaxed)) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = (unsigned long long)flags;
+        how.resolve = RESOLVE_NO_SYMLINKS | RESOLVE_BENEATH;
+        int fd = (int)syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS) {
+            return fd;
+        }
+        atomic_store_explicit(&no_openat2, 1, memory_order_relaxed);
+    }
+    return openat(dir_fd, path, flags);
+}
+
+// Function to open the directory path below dir_fd with open_beneath. The path is opened up to
+// PATH_MAX bytes at a time, so trees deeper than that work too; on the way one more descriptor is
+// open for a moment. An empty path opens dir_fd itself.
+static int open_beneath_path(int dir_fd, const char *path, int flags) {
+    while (*path == '/') {
+        path++;
+    }
+    if (*path == '\0') {
+        return open_beneath(dir_fd, ".", flags);
+    }
+    size_t len = strlen(path);
+    int fd = dir_fd;
+    while (len >= PATH_MAX) {
+        // Step down to the end of the last whole name that fits and go on from there
+        size_t cut = PATH_MAX - 1;
+        while (cut > 0 && path[cut] != '/') {
+            cut--;
+        }
+        int next = -1;
+        if (cut == 0) {
+            errno = ENAMETOOLONG;
+        } else {
+            char piece[PATH_MAX];
+            memcpy(piece, path, cut);
+            piece[cut] = '\0';
+            next = open_beneath(fd, piece, O_PATH);
+        }
+        if (fd != dir_fd) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+        }
+        if (next == -1) {
+            return -1;
+        }
+        fd = next;
+        while (path[cut] == '/') {
+            cut++;
+        }
+        path += cut;
+        len -= cut;
+    }
+    int result = open_beneath(fd, path, flags);
+    if (fd != dir_fd) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return result;
+}
+
+// Function to cut the destination root off the path of a destination directory. What is left names
+// the directory below both roots of the copy.
+static const char *copy_relative_path(const copy_context_t *ctx, const char *dest) {
+    return dest + ctx->dest_root_len;
+}
+
+// Function to allocate the completion node of a destination directory
+static dir_node_t *dir_node_create(dir_node_t *parent, const char *path, mode_t mode, int set_mode) {
+    size_t len = strlen(path) + 1;
+    dir_node_t *node = malloc(sizeof(dir_node_t) + len);
+    if (!node) {
+        return NULL;
+    }
+    node->parent = parent;
+    atomic_init(&node->pending, 1); // The scan of the directory itself
+    node->mode = mode;
+    node->set_mode = set_mode;
+    memcpy(node->path, path, len);
+    if (parent) {
+        atomic_fetch_add(&parent->pending, 1);
+    }
+    return node;
+}
+
+// Function to apply the final permissions of a completed directory. One too deep to be named by its
+// path is opened beneath the destination root, which takes two descriptors for a moment; the callers
+// hold none at that point.
+static void dir_node_chmod(copy_context_t *ctx, dir_node_t *node) {
+    if (strlen(node->path) < PATH_MAX) {
+        if (chmod(node->path, node->mode) == -1) {
+            copy_report_error(ctx, "Error setting directory permissions", node->path, errno);
+        }
+        return;
+    }
+    copy_acquire_fds(ctx, 2);
+    int fd = open_beneath_path(ctx->dest_root_fd, copy_relative_path(ctx, node->path), O_RDONLY);
+    if (fd == -1 || fchmod(fd, node->mode) == -1) {
+        copy_report_error(ctx, "Error setting directory permissions", node->path, errno);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    copy_release_fds(ctx, 2);
+}
+
+// Function to drop one outstanding task from a directory, finishing it and its parents as they complete
+static void dir_node_release(copy_context_t *ctx, dir_node_t *node) {
+    while (node && atomic_fetch_sub(&node->pending, 1) == 1) {
+        if (node->set_mode) {
+            dir_node_chmod(ctx, node);
+        }
+        dir_node_t *parent = node->parent;
+        free(node);
+        node = parent;
+    }
+}
+
+// Function to return the monotonic time in seconds
+static double progress_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to enter a copied file in the slowest list of the run if it took long enough
+static void progress_note_file(copy_context_t *ctx, const char *path, off_t size, double seconds) {
+    // Most files are quicker than everything on a full list, and that is decided without the lock
+    if ((unsigned long long)(seconds * 1e9) <= atomic_load_explicit(&ctx->slowest_floor_ns, memory_order_relaxed)) {
+        return;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return; // Only the report suffers
+    }
+
+    pthread_mutex_lock(&ctx->progress_lock);
+    size_t i = ctx->slowest_count;
+    if (i == COPYTREE_SLOWEST_FILES) {
+        if (seconds <= ctx->slowest[i - 1].seconds) {
+            pthread_mutex_unlock(&ctx->progress_lock);
+            free(copy);
+            return;
+        }
+        free((char *)ctx->slowest[--i].path); // Drop the quickest to make room
+    } else {
+        ctx->slowest_count++;
+    }
+    while (i > 0 && ctx->slowest[i - 1].seconds < seconds) {
+        ctx->slowest[i] = ctx->slowest[i - 1];
+        i--;
+    }
+    ctx->slowest[i].path = copy;
+    ctx->slowest[i].size = size;
+    ctx->slowest[i].seconds = seconds;
+    if (ctx->slowest_count == COPYTREE_SLOWEST_FILES) {
+        atomic_store(&ctx->slowest_floor_ns, (unsigned long long)(ctx->slowest[COPYTREE_SLOWEST_FILES - 1].seconds * 1e9));
+    }
+    pthread_mutex_unlock(&ctx->progress_lock);
+}
+
+static void scan_directory_task(void *arg);
+
+// Function to copy or sync the entry of a file task, addressed by src and dest
+static void copy_task_entry(copy_task_t *task, const copy_entry_t *src, const copy_entry_t *dest) {
+    copy_context_t *ctx = task->ctx;
+    if (ctx->opts.sync) {
+        sync_file_entry(ctx, src, dest, &task->src_stat);
+    } else {
+        copy_file_entry_at(ctx, src, dest, &task->src_stat, ctx->copy_symlinks, ctx->copy_permissions);
+    }
+}
+
+// Function to copy the entry of a task whose paths are too long to be opened whole, relative to its
+// source and target directories opened beneath the roots of the copy
+static void copy_task_beneath(copy_task_t *task) {
+    copy_context_t *ctx = task->ctx;
+    size_t name_len = strlen(task->name);
+    size_t src_dir_len = strlen(task->src) - name_len - 1;
+    size_t dest_dir_len = strlen(task->dest) - name_len - 1;
+
+    // Cut both paths into directory and name while the copy runs
+    task->src[src_dir_len] = '\0';
+    task->dest[dest_dir_len] = '\0';
+    const char *relative = copy_relative_path(ctx, task->dest);
+    int src_fd = open_beneath_path(ctx->src_root_fd, relative, O_PATH);
+    int dest_fd = -1;
+    if (src_fd == -1) {
+        copy_report_error(ctx, "Error opening source directory", task->src, errno);
+    } else if ((dest_fd = open_beneath_path(ctx->dest_root_fd, relative, O_PATH)) == -1) {
+        copy_report_error(ctx, "Error opening target directory", task->dest, errno);
+    } else {
+        copy_entry_t src = { src_fd, task->src + src_dir_len + 1, task->src };
+        copy_entry_t dest = { dest_fd, task->dest + dest_dir_len + 1, task->dest };
+        copy_task_entry(task, &src, &dest);
+    }
+    if (src_fd != -1) {
+        close(src_fd);
+    }
+    if (dest_fd != -1) {
+        close(dest_fd);
+    }
+    task->src[src_dir_len] = '/';
+    task->dest[dest_dir_len] = '/';
+}
+
+// Task copying a single non-directory entry, also run one after the other by ordered runs
+static void copy_file_task(void *arg) {
+    copy_task_t *task = arg;
+    copy_context_t *ctx = task->ctx;
+
+    // A regular file needs both its source and target open at the same time, and deduplication
+    // opens the earlier copy it compares against as well. Paths too long to be opened whole add the
+    // two directories of the entry, and one more while the second is opened, which the file itself
+    // does not need yet.
+    int fds = S_ISREG(task->src_stat.st_mode) ? (ctx->dedup ? 3 : 2) : 0;
+    if (task->long_paths) {
+        fds = (fds ? fds : 1) + 2;
+    }
+    copy_acquire_fds(ctx, fds);
+    double start = ctx->opts.progress ? progress_now() : 0;
+    if (task->long_paths) {
+        copy_task_beneath(task);
+    } else {
+        copy_entry_t src = { AT_FDCWD, task->src, NULL };
+        copy_entry_t dest = { AT_FDCWD, task->dest, NULL };
+        copy_task_entry(task, &src, &dest);
+    }
+    if (ctx->opts.progress && S_ISREG(task->src_stat.st_mode)) {
+        progress_note_file(ctx, task->src, task->src_stat.st_size, progress_now() - start);
+    }
+    copy_release_fds(ctx, fds);
+    atomic_fetch_add_explicit(&ctx->entries_done, 1, memory_order_relaxed);
+
+    dir_node_release(ctx, task->node);
+    free(task);
+}
+
+// Small regular files of one directory waiting to be copied as a single io_uring batch
+typedef struct {
+    copy_context_t *ctx;
+    dir_node_t *node;
+    size_t count;
+    copy_task_t *files[URING_BATCH_FILES];
+} uring_batch_t;
+
+// Task copying a batch of small files through io_uring, or one by one when io_uring is unavailable
+static void copy_batch_task(void *arg) {
+    uring_batch_t *batch = arg;
+    copy_context_t *ctx = batch->ctx;
+    uring_file_t files[URING_BATCH_FILES];
+
+    for (size_t i = 0; i < batch->count; i++) {
+        files[i].src = batch->files[i]->src;
+        files[i].dest = batch->files[i]->dest;
+        files[i].st = batch->files[i]->src_stat;
+    }
+
+    // Batches are flushed before they outgrow what the cap leaves beside the roots, but never ask for more
+    int cap = ctx->opts.max_open_fds - ROOT_FDS;
+    int fds = (int)batch->count * 2 < cap ? (int)batch->count * 2 : cap;
+    copy_acquire_fds(ctx, fds);
+    if (copy_uring_files(ctx, files, batch->count) == -1) {
+        for (size_t i = 0; i < batch->count; i++) {
+            copy_file_entry(ctx, files[i].src, files[i].dest, &files[i].st, ctx->copy_symlinks, ctx->copy_permissions);
+        }
+    }
+    copy_release_fds(ctx, fds);
+    // The files of a batch are small and not timed one by one for the slowest list
+    atomic_fetch_add_explicit(&ctx->entries_done, batch->count, memory_order_relaxed);
+
+    for (size_t i = 0; i < batch->count; i++) {
+        free(batch->files[i]);
+        dir_node_release(ctx, batch->node);
+    }
+    free(batch);
+}
+
+// Function to queue the pending io_uring batch of a scan, if it holds any files
+static void flush_batch(copy_task_t *scan, uring_batch_t **pending) {
+    uring_batch_t *batch = *pending;
+    *pending = NULL;
+    if (!batch) {
+        return;
+    }
+    if (work_pool_submit(scan->pool, copy_batch_task, batch) == -1) {
+        // Could not queue the batch, copy it from the scanning worker instead
+        copy_batch_task(batch);
+    }
+}
+
+// Function to find the disk offset of the first data extent of a file with FIEMAP. Returns 0 and sets
+// *physical, or sets it to ULLONG_MAX when the file has no data on disk yet (empty, inline or
+// delayed allocation). Returns -1 when the filesystem cannot report extents. The file is opened
+// relative to the directory being scanned, with the spare descriptor of the scan.
+static int order_physical(int dir_fd, const char *name, unsigned long long *physical) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        *physical = ULLONG_MAX; // The copy reports it
+        return 0;
+    }
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    int result = ioctl(fd, FS_IOC_FIEMAP, &request.map);
+    close(fd);
+    if (result == -1) {
+        return -1;
+    }
+    const struct fiemap_extent *extent = &request.extent;
+    if (request.map.fm_mapped_extents == 0 ||
+        (extent->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE))) {
+        *physical = ULLONG_MAX;
+    } else {
+        *physical = extent->fe_physical;
+    }
+    return 0;
+}
+
+// Function to hold a regular file back for the ordered copy of its directory. Returns -1 when no
+// memory is left, and the file is then queued on its own.
+static int order_add(order_list_t *order, copy_task_t *copy) {
+    if (order->count == order->capacity) {
+        size_t capacity = order->capacity ? order->capacity * 2 : 256;
+        copy_task_t **files = realloc(order->files, capacity * sizeof(copy_task_t *));
+        if (!files) {
+            return -1;
+        }
+        order->files = files;
+        order->capacity = capacity;
+    }
+    order->files[order->count++] = copy;
+    return 0;
+}
+
+// Sort keys of an ordered directory, with the files they belong to
+typedef struct {
+    unsigned long long key;     // Disk offset of the first extent, ULLONG_MAX when unknown; 0 by inode
+    unsigned long long ino;
+    copy_task_t *file;
+} order_entry_t;
+
+// Function to order files by disk offset, then by inode number
+static int compare_order(const void *a, const void *b) {
+    const order_entry_t *ea = a;
+    const order_entry_t *eb = b;
+    if (ea->key != eb->key) {
+        return ea->key < eb->key ? -1 : 1;
+    }
+    return (ea->ino > eb->ino) - (ea->ino < eb->ino);
+}
+
+// Function to ask the kernel to start reading a file that will be copied soon. The pages stay in
+// the cache after the descriptor is closed, and the copy finds them there. A file whose path is too
+// long to be opened whole is copied without the head start.
+static void order_prefetch(const copy_task_t *file) {
+    if (file->long_paths) {
+        return;
+    }
+    copy_acquire_fds(file->ctx, 1);
+    int fd = open(file->src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd != -1) {
+        off_t len = file->src_stat.st_size < ORDER_PREFETCH_BYTES ? file->src_stat.st_size : ORDER_PREFETCH_BYTES;
+        posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+    copy_release_fds(file->ctx, 1);
+}
+
+// Task copying a run of files in disk order. The data of the next few files is requested before it
+// is needed, so the device sees one sweep in a single direction instead of reads in listing order.
+static void order_run_task(void *arg) {
+    order_run_t *run = arg;
+    for (size_t i = 0; i < run->count && i < ORDER_PREFETCH_FILES; i++) {
+        order_prefetch(run->files[i]);
+    }
+    for (size_t i = 0; i < run->count; i++) {
+        if (i + ORDER_PREFETCH_FILES < run->count) {
+            order_prefetch(run->files[i + ORDER_PREFETCH_FILES]);
+        }
+        copy_file_task(run->files[i]);
+    }
+    free(run);
+}
+
+// Function to sort the regular files held back by a directory scan, found in the source directory
+// src_fd, into the order they are copied in
+static void order_sort(copy_task_t *scan, order_list_t *order, int src_fd) {
+    copy_context_t *ctx = scan->ctx;
+    size_t count = order->count;
+    order_entry_t *entries = count ? malloc(count * sizeof(order_entry_t)) : NULL;
+    if (entries) {
+        int physical = ctx->opts.order == COPYTREE_ORDER_PHYSICAL;
+        for (size_t i = 0; i < count; i++) {
+            entries[i].file = order->files[i];
+            entries[i].ino = (unsigned long long)order->files[i]->src_stat.st_ino;
+            entries[i].key = 0;
+            if (physical && order_physical(src_fd, order->files[i]->name, &entries[i].key) == -1) {
+                // No extents from this filesystem: inode numbers for the whole directory
+                physical = 0;
+                for (size_t j = 0; j <= i; j++) {
+                    entries[j].key = 0;
+                }
+            }
+        }
+        qsort(entries, count, sizeof(order_entry_t), compare_order);
+        for (size_t i = 0; i < count; i++) {
+            order->files[i] = entries[i].file;
+        }
+        free(entries);
+    }
+}
+
+// Function to queue the sorted files of a directory scan as runs, one per worker at most, each
+// covering a contiguous stretch of the order
+static void order_dispatch(copy_task_t *scan, order_list_t *order) {
+    size_t count = order->count;
+    size_t runs = count / ORDER_RUN_MIN_FILES;
+    size_t workers = (size_t)work_pool_size(scan->pool);
+    if (runs > workers) {
+        runs = workers;
+    }
+    if (runs == 0) {
+        runs = 1;
+    }
+    size_t start = 0;
+    for (size_t r = 0; r < runs && start < count; r++) {
+        size_t n = (count - start) / (runs - r);
+        order_run_t *run = malloc(sizeof(order_run_t) + n * sizeof(copy_task_t *));
+        if (!run) {
+            // Copy from the scanning worker instead, still in order
+            for (size_t i = start; i < start + n; i++) {
+                copy_file_task(order->files[i]);
+            }
+            start += n;
+            continue;
+        }
+        run->count = n;
+        memcpy(run->files, order->files + start, n * sizeof(copy_task_t *));
+        start += n;
+        if (work_pool_submit(scan->pool, order_run_task, run) == -1) {
+            order_run_task(run);
+        }
+    }
+    free(order->files);
+}
+
+// Function to queue the work for the entry name of a directory being scanned, whose target
+// directory is dest_fd
+static void dispatch_entry(copy_task_t *task, int dest_fd, const char *name, const struct stat *statbuf,
+                           uring_batch_t **batch, order_list_t *order) {
+    copy_context_t *ctx = task->ctx;
+
+    if (S_ISDIR(statbuf->st_mode)) {
+        // Create the directory now, writable by us until its own contents are done
+        copy_entry_t target = { dest_fd, name, task->dest };
+        mode_t mode = ctx->copy_permissions ? (statbuf->st_mode & 07777) : 0755;
+        int set_mode = ctx->copy_permissions;
+        if (ctx->opts.sync) {
+            mode_t existing_mode;
+            int made_writable = sync_directory_entry(ctx, &target, mode | S_IRWXU, &existing_mode);
+            if (made_writable == -1) {
+                return;
+            }
+            if (made_writable && !set_mode) {
+                // Without -p the existing directory keeps its own mode once its contents are synced
+                mode = existing_mode;
+                set_mode = 1;
+            }
+        } else if (mkdirat(dest_fd, name, mode | S_IRWXU) == -1) {
+            copy_report_entry_error(ctx, "Error creating target directory", &target, errno);
+            return;
+        }
+
+        copy_task_t *scan = task_create(ctx, task->pool, NULL, task->src, task->dest, name);
+        dir_node_t *child = scan ? dir_node_create(task->node, scan->dest, mode, set_mode) : NULL;
+        if (child) {
+            scan->node = child;
+        }
+        if (!child || work_pool_submit(task->pool, scan_directory_task, scan) == -1) {
+            copy_entry_t source = { AT_FDCWD, name, task->src };
+            copy_report_entry_error(ctx, "Error queueing directory copy", &source, ENOMEM);
+            // The directory is finished right here, through the descriptor of its parent
+            if (set_mode && fchmodat(dest_fd, name, mode, 0) == -1) {
+                copy_report_entry_error(ctx, "Error setting directory permissions", &target, errno);
+            }
+            if (child) {
+                free(child);
+                atomic_fetch_sub(&task->node->pending, 1);
+            }
+            free(scan);
+        }
+        return;
+    }
+
+    copy_task_t *copy = task_create(ctx, task->pool, task->node, task->src, task->dest, name);
+    if (!copy) {
+        copy_entry_t source = { AT_FDCWD, name, task->src };
+        copy_report_entry_error(ctx, "Error queueing file copy", &source, ENOMEM);
+        return;
+    }
+    copy->src_stat = *statbuf;
+    atomic_fetch_add(&task->node->pending, 1);
+
+    // In an ordered copy the regular files wait until the whole directory has been listed
+    if (order && S_ISREG(statbuf->st_mode) && order_add(order, copy) == 0) {
+        return;
+    }
+
+    // Small regular files are gathered into io_uring batches when that engine is selected
+    // (a sync has to look at each destination first, hard links and duplicates are looked up
+    // in the link tables, and checksums are taken on the regular path, so those are copied one by one;
+    // a batch opens its files by their whole paths)
+    if (batch && !ctx->opts.sync && !ctx->opts.verify && !ctx->manifest && !copy->long_paths &&
+        S_ISREG(statbuf->st_mode) && statbuf->st_size <= URING_SMALL_FILE_MAX &&
+        !(ctx->links && statbuf->st_nlink > 1) && !(ctx->dedup && statbuf->st_size >= DEDUP_MIN_SIZE)) {
+        // Each file of a batch holds two descriptors while the batch runs, so a batch that could not
+        // take one more file under the cap is queued first
+        if (*batch && (int)((*batch)->count + 1) * 2 > ctx->opts.max_open_fds - ROOT_FDS) {
+            flush_batch(task, batch);
+        }
+        if (!*batch) {
+            *batch = malloc(sizeof(uring_batch_t));
+            if (*batch) {
+                (*batch)->ctx = ctx;
+                (*batch)->node = task->node;
+                (*batch)->count = 0;
+            }
+        }
+        if (*batch) {
+            (*batch)->files[(*batch)->count++] = copy;
+            if ((*batch)->count == URING_BATCH_FILES) {
+                flush_batch(task, batch);
+            }
+            return;
+        }
+    }
+
+    if (work_pool_submit(task->pool, copy_file_task, copy) == -1) {
+        copy_report_error(ctx, "Error queueing file copy", copy->src, ENOMEM);
+        free(copy);
+        dir_node_release(ctx, task->node);
+    }
+}
+
+// Function to read the names of the open directory fd. Returns the number of names or -1 on
+// failure; the names are packed one after the other in *names_out.
+static ssize_t read_directory_names(int fd, char **names_out) {
+    dir_reader_t reader;
+    if (dir_reader_open(&reader, fd) == -1) {
+        return -1;
+    }
+
+    size_t used = 0;
+    size_t capacity = 4096;
+    ssize_t count = 0;
+    char *names = malloc(capacity);
+    dir_entry_t entry;
+    int status = 0;
+    while (names && (status = dir_reader_next(&reader, &entry)) == 1) {
+        size_t len = strlen(entry.name) + 1;
+        if (used + len > capacity) {
+            capacity *= 2;
+            char *grown = realloc(names, capacity);
+            if (!grown) {
+                free(names);
+                names = NULL;
+                break;
+            }
+            names = grown;
+        }
+        memcpy(names + used, entry.name, len);
+        used += len;
+        count++;
+    }
+    int err = status == -1 ? errno : ENOMEM;
+    dir_reader_close(&reader);
+
+    if (!names || status == -1) {
+        free(names);
+        errno = err;
+        return -1;
+    }
+    *names_out = names;
+    return count;
+}
+
+// Scan of the source directory src_fd for the io_uring engine: the names are read first, then
+// stat'ed in batches
+static void scan_directory_uring(copy_task_t *task, int src_fd, int dest_fd, order_list_t *ordered) {
+    copy_context_t *ctx = task->ctx;
+    char *names;
+    ssize_t count = read_directory_names(src_fd, &names);
+    if (count == -1) {
+        copy_report_error(ctx, "Error reading source directory", task->src, errno);
+        return;
+    }
+
+    const char *batch_names[URING_BATCH_FILES];
+    struct stat stats[URING_BATCH_FILES];
+    int errors[URING_BATCH_FILES];
+    uring_batch_t *batch = NULL;
+    char *name = names;
+
+    for (ssize_t base = 0; base < count; base += URING_BATCH_FILES) {
+        size_t n = (size_t)(count - base) < URING_BATCH_FILES ? (size_t)(count - base) : URING_BATCH_FILES;
+        for (size_t i = 0; i < n; i++) {
+            batch_names[i] = name;
+            name += strlen(name) + 1;
+        }
+
+        if (copy_uring_stat(src_fd, batch_names, stats, errors, n) == -1) {
+            for (size_t i = 0; i < n; i++) {
+                errors[i] = fstatat(src_fd, batch_names[i], &stats[i], AT_SYMLINK_NOFOLLOW) == -1 ? errno : 0;
+            }
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (errors[i] != 0) {
+                copy_entry_t source = { src_fd, batch_names[i], task->src };
+                copy_report_entry_error(ctx, "Error getting source entry information", &source, errors[i]);
+            } else {
+                dispatch_entry(task, dest_fd, batch_names[i], &stats[i], &batch, ordered);
+            }
+        }
+    }
+
+    flush_batch(task, &batch);
+    free(names);
+}
+
+// Scan of the source directory src_fd for the synchronous engine, one fstatat per entry
+static void scan_directory_entries(copy_task_t *task, int src_fd, int dest_fd, order_list_t *ordered) {
+    copy_context_t *ctx = task->ctx;
+    dir_reader_t reader;
+    if (dir_reader_open(&reader, src_fd) == -1) {
+        copy_report_error(ctx, "Error reading source directory", task->src, errno);
+        return;
+    }
+
+    dir_entry_t entry;
+    struct stat statbuf;
+    int status;
+    while ((status = dir_reader_next(&reader, &entry)) == 1) {
+        // Get information about the source entry
+        if (fstatat(src_fd, entry.name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1) {
+            copy_entry_t source = { src_fd, entry.name, task->src };
+            copy_report_entry_error(ctx, "Error getting source entry information", &source, errno);
+            continue;
+        }
+        dispatch_entry(task, dest_fd, entry.name, &statbuf, NULL, ordered);
+    }
+    if (status == -1) {
+        copy_report_error(ctx, "Error reading source directory", task->src, errno);
+    }
+    dir_reader_close(&reader);
+}
+
+// Task listing one source directory and queueing a task per entry. The source and target
+// directories are opened beneath the roots of the copy and every entry is addressed relative to
+// them, so paths longer than PATH_MAX never have to be resolved whole.
+static void scan_directory_task(void *arg) {
+    copy_task_t *task = arg;
+    copy_context_t *ctx = task->ctx;
+    int prune = ctx->opts.sync && ctx->opts.delete_extraneous;
+    int fds = prune ? PRUNE_FDS : SCAN_FDS;
+    order_list_t order = { NULL, 0, 0 };
+    order_list_t *ordered = ctx->opts.order != COPYTREE_ORDER_LISTING ? &order : NULL;
+
+    copy_acquire_fds(ctx, fds);
+    const char *relative = copy_relative_path(ctx, task->dest);
+    int src_fd = open_beneath_path(ctx->src_root_fd, relative, O_RDONLY);
+    int dest_fd = -1;
+    if (src_fd == -1) {
+        copy_report_error(ctx, "Error opening source directory", task->src, errno);
+    } else if ((dest_fd = open_beneath_path(ctx->dest_root_fd, relative, O_RDONLY)) == -1) {
+        copy_report_error(ctx, "Error opening target directory", task->dest, errno);
+    } else {
+        if (ctx->opts.engine == COPYTREE_ENGINE_IO_URING && copy_uring_available()) {
+            scan_directory_uring(task, src_fd, dest_fd, ordered);
+        } else {
+            scan_directory_entries(task, src_fd, dest_fd, ordered);
+        }
+        if (ordered) {
+            order_sort(task, ordered, src_fd);
+        }
+        if (prune) {
+            sync_prune_directory(ctx, src_fd, dest_fd, task->dest);
+        }
+    }
+    if (src_fd != -1) {
+        close(src_fd);
+    }
+    if (dest_fd != -1) {
+        close(dest_fd);
+    }
+    copy_release_fds(ctx, fds);
+
+    // Queued only now: a run that cannot be queued is copied right here, with descriptors of its own
+    if (ordered) {
+        order_dispatch(task, ordered);
+    }
+    dir_node_release(ctx, task->node);
+    free(task);
+}
+
+// Function to order collected failures by path, then by operation
+static int compare_errors(const void *a, const void *b) {
+    const copy_error_t *ea = a;
+    const copy_error_t *eb = b;
+    int cmp = strcmp(ea->path, eb->path);
+    return cmp != 0 ? cmp : strcmp(ea->what, eb->what);
+}
+
+// Function to set up the shared state of a run
+static void context_init(copy_context_t *ctx, const copytree_options_t *opts) {
+    memset(ctx, 0, sizeof(*ctx));
+    if (opts) {
+        ctx->opts = *opts;
+    } else {
+        copytree_options_init(&ctx->opts);
+    }
+    if (ctx->opts.max_open_fds <= 0) {
+        ctx->opts.max_open_fds = default_max_open_fds();
+    }
+    ctx->fds_available = ctx->opts.max_open_fds;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_mutex_init(&ctx->fd_lock, NULL);
+    pthread_cond_init(&ctx->fd_cond, NULL);
+
+    // The progress reporter waits with deadlines on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->progress_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&ctx->progress_lock, NULL);
+    ctx->start_time = progress_now();
+}
+
+// Function to fill in a progress report with the counters so far. The caller holds progress_lock; the
+// slowest paths are copied, so the report can be handed over after the lock is released and is
+// freed with progress_snapshot_free.
+static void progress_snapshot(copy_context_t *ctx, copytree_progress_t *progress) {
+    memset(progress, 0, sizeof(*progress));
+    progress->elapsed = progress_now() - ctx->start_time;
+    progress->entries_done = atomic_load(&ctx->entries_done);
+    progress->files_copied = atomic_load(&ctx->files_copied);
+    progress->bytes_copied = atomic_load(&ctx->bytes_copied);
+    for (int i = 0; i < COPY_TIER_COUNT; i++) {
+        progress->tier_files[i] = atomic_load(&ctx->tier_files[i]);
+    }
+    for (size_t i = 0; i < ctx->slowest_count; i++) {
+        progress->slowest[i] = ctx->slowest[i];
+        progress->slowest[i].path = strdup(ctx->slowest[i].path);
+        if (!progress->slowest[i].path) {
+            break; // Only the report suffers
+        }
+        progress->slowest_count++;
+    }
+}
+
+// Function to release the paths of a progress report made by progress_snapshot
+static void progress_snapshot_free(copytree_progress_t *progress) {
+    for (size_t i = 0; i < progress->slowest_count; i++) {
+        free((char *)progress->slowest[i].path);
+    }
+}
+
+// Thread calling the progress callback every progress_interval seconds until the copy has finished
+static void *progress_main(void *arg) {
+    copy_context_t *ctx = arg;
+    double interval = ctx->opts.progress_interval > 0 ? ctx->opts.progress_interval : 1;
+    long long interval_ns = (long long)(interval * 1e9);
+    unsigned long long last_entries = 0;
+    unsigned long long last_bytes = 0;
+    double last_elapsed = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    pthread_mutex_lock(&ctx->progress_lock);
+    for (;;) {
+        long long nsec = deadline.tv_nsec + interval_ns;
+        deadline.tv_sec += (time_t)(nsec / 1000000000);
+        deadline.tv_nsec = (long)(nsec % 1000000000);
+        while (!ctx->finished && pthread_cond_timedwait(&ctx->progress_cond, &ctx->progress_lock, &deadline) != ETIMEDOUT) {
+        }
+        if (ctx->finished) {
+            break; // The final report is made by copy_directory_parallel
+        }
+
+        copytree_progress_t progress;
+        progress_snapshot(ctx, &progress);
+
+        // Workers entering slow files must not wait for the callback
+        pthread_mutex_unlock(&ctx->progress_lock);
+        double span = progress.elapsed - last_elapsed;
+        if (span > 0) {
+            progress.entries_per_second = (double)(progress.entries_done - last_entries) / span;
+            progress.mb_per_second = (double)(progress.bytes_copied - last_bytes) / (1024 * 1024) / span;
+        }
+        last_entries = progress.entries_done;
+        last_bytes = progress.bytes_copied;
+        last_elapsed = progress.elapsed;
+        ctx->opts.progress(&progress, ctx->opts.progress_arg);
+        progress_snapshot_free(&progress);
+        pthread_mutex_lock(&ctx->progress_lock);
+    }
+    pthread_mutex_unlock(&ctx->progress_lock);
+    return NULL;
+}
+
+// Function to stop the progress reporter, if one was started, and make the final report
+static void progress_finish(copy_context_t *ctx, pthread_t *reporter) {
+    pthread_mutex_lock(&ctx->progress_lock);
+    ctx->finished = 1;
+    pthread_cond_signal(&ctx->progress_cond);
+    pthread_mutex_unlock(&ctx->progress_lock);
+    if (reporter) {
+        pthread_join(*reporter, NULL);
+    }
+
+    copytree_progress_t progress;
+    pthread_mutex_lock(&ctx->progress_lock);
+    progress_snapshot(ctx, &progress);
+    pthread_mutex_unlock(&ctx->progress_lock);
+    progress.final = 1;
+    if (progress.elapsed > 0) {
+        progress.entries_per_second = (double)progress.entries_done / progress.elapsed;
+        progress.mb_per_second = (double)progress.bytes_copied / (1024 * 1024) / progress.elapsed;
+    }
+    ctx->opts.progress(&progress, ctx->opts.progress_arg);
+    progress_snapshot_free(&progress);
+}
+
+// Function to print the failures of a finished run, fill in its counters and release its state.
+// Returns the number of failures.
+static int context_finish(copy_context_t *ctx) {
+    // Report failures in path order so repeated runs print the same thing
+    qsort(ctx->errors, ctx->error_count, sizeof(copy_error_t), compare_errors);
+    for (size_t i = 0; i < ctx->error_count; i++) {
+        if (ctx->errors[i].err != 0) {
+            fprintf(stderr, "%s: %s: %s\n", ctx->errors[i].path, ctx->errors[i].what, strerror(ctx->errors[i].err));
+        } else {
+            fprintf(stderr, "%s: %s\n", ctx->errors[i].path, ctx->errors[i].what);
+        }
+        free(ctx->errors[i].path);
+    }
+    free(ctx->errors);
+
+    if (ctx->opts.stats) {
+        ctx->opts.stats->files_copied = atomic_load(&ctx->files_copied);
+        ctx->opts.stats->bytes_copied = atomic_load(&ctx->bytes_copied);
+        for (int i = 0; i < COPY_TIER_COUNT; i++) {
+            ctx->opts.stats->tier_files[i] = atomic_load(&ctx->tier_files[i]);
+        }
+        ctx->opts.stats->hole_bytes = atomic_load(&ctx->hole_bytes);
+        ctx->opts.stats->files_skipped = atomic_load(&ctx->files_skipped);
+        ctx->opts.stats->files_delta = atomic_load(&ctx->files_delta);
+        ctx->opts.stats->entries_deleted = atomic_load(&ctx->entries_deleted);
+        ctx->opts.stats->files_removed = atomic_load(&ctx->files_removed);
+        ctx->opts.stats->directories_removed = atomic_load(&ctx->directories_removed);
+        ctx->opts.stats->files_linked = atomic_load(&ctx->files_linked);
+        ctx->opts.stats->files_deduplicated = atomic_load(&ctx->files_deduplicated);
+        ctx->opts.stats->bytes_saved = atomic_load(&ctx->bytes_saved);
+        ctx->opts.stats->files_verified = atomic_load(&ctx->files_verified);
+    }
+    link_table_destroy(ctx->links);
+    link_table_destroy(ctx->dedup);
+    for (size_t i = 0; i < ctx->slowest_count; i++) {
+        free((char *)ctx->slowest[i].path);
+    }
+
+    int failures = (int)ctx->error_count;
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_mutex_destroy(&ctx->fd_lock);
+    pthread_cond_destroy(&ctx->fd_cond);
+    pthread_mutex_destroy(&ctx->progress_lock);
+    pthread_cond_destroy(&ctx->progress_cond);
+    return failures;
+}
+
+// Function to copy a directory tree with a pool of worker threads
+int copy_directory_parallel(const char *src, const char *dest, int copy_symlinks, int copy_permissions,
+                            const copytree_options_t *opts) {
+    struct stat source_stat;
+    if (lstat(src, &source_stat) == -1) {
+        perror("Error getting source directory information");
+        return -1;
+    }
+    if (!S_ISDIR(source_stat.st_mode)) {
+        fprintf(stderr, "Error: %s is not a directory\n", src);
+        return -1;
+    }
+
+    // Check if the target directory exists (a sync updates it in place)
+    if (!(opts && opts->sync) && directory_exists(dest)) {
+        errno = EEXIST; // Set errno to EEXIST to indicate that the file exists
+        perror("Error: Destination directory already exists");
+        return -1;
+    }
+
+    // Use the source directory's permissions if copy_permissions is enabled, otherwise use 0755
+    mode_t mode = copy_permissions ? (source_stat.st_mode & 07777) : 0755;
+    if (create_directory_recursive(dest, mode | S_IRWXU) != 0) {
+        perror("Error creating target directory");
+        return -1;
+    }
+
+    work_pool_t *pool = work_pool_create(opts ? opts->num_threads : 0);
+    if (!pool) {
+        perror("Error starting worker threads");
+        return -1;
+    }
+
+    copy_context_t ctx;
+    context_init(&ctx, opts);
+    // Beside the two roots, a file copy needs four descriptors when its paths are too long to be
+    // opened whole, five when it is compared with an earlier copy for deduplication, and a scan that
+    // prunes the target enough for its deletes
+    int min_fds = ROOT_FDS + (ctx.opts.dedup != COPYTREE_DEDUP_NONE ? 5 : 4);
+    if (ctx.opts.sync && ctx.opts.delete_extraneous) {
+        min_fds = ROOT_FDS + PRUNE_FDS;
+    }
+    if (ctx.opts.max_open_fds < min_fds) {
+        ctx.opts.max_open_fds = min_fds;
+        ctx.fds_available = min_fds;
+    }
+    ctx.copy_symlinks = copy_symlinks;
+    ctx.copy_permissions = copy_permissions;
+    if (ctx.opts.preserve_links && !ctx.opts.sync) {
+        ctx.links = link_table_create();
+        if (!ctx.links) {
+            copy_report_error(&ctx, "Error allocating hard-link table, hard links are copied as files", src, ENOMEM);
+        }
+    }
+    if (ctx.opts.dedup != COPYTREE_DEDUP_NONE && !ctx.opts.sync) {
+        ctx.dedup = link_table_create();
+        if (!ctx.dedup) {
+            copy_report_error(&ctx, "Error allocating deduplication table, duplicates are copied", src, ENOMEM);
+        }
+    }
+    if (ctx.opts.manifest) {
+        // A sync starts from the checksums of the previous run
+        ctx.manifest = manifest_open(ctx.opts.manifest, ctx.opts.sync);
+        if (!ctx.manifest) {
+            copy_report_error(&ctx, "Error reading manifest, none is written", ctx.opts.manifest, errno);
+        }
+    }
+
+    // Every directory is opened beneath the roots, which stay open until the copy is done
+    ctx.dest_root_len = strlen(dest);
+    copy_acquire_fds(&ctx, ROOT_FDS);
+    ctx.src_root_fd = open(src, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    ctx.dest_root_fd = ctx.src_root_fd == -1 ? -1 : open(dest, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (ctx.src_root_fd == -1) {
+        copy_report_error(&ctx, "Error opening source directory", src, errno);
+    } else if (ctx.dest_root_fd == -1) {
+        copy_report_error(&ctx, "Error opening target directory", dest, errno);
+    } else {
+        dir_node_t *root = dir_node_create(NULL, dest, mode, copy_permissions);
+        copy_task_t *scan = root ? task_create(&ctx, pool, root, src, dest, NULL) : NULL;
+        if (!scan || work_pool_submit(pool, scan_directory_task, scan) == -1) {
+            copy_report_error(&ctx, "Error queueing directory copy", src, ENOMEM);
+            free(scan);
+            dir_node_release(&ctx, root);
+        }
+    }
+
+    // Without a reporter thread there is still the final report
+    pthread_t reporter;
+    int reporting = ctx.opts.progress && pthread_create(&reporter, NULL, progress_main, &ctx) == 0;
+
+    work_pool_wait(pool);
+    work_pool_destroy(pool);
+    if (ctx.src_root_fd != -1) {
+        close(ctx.src_root_fd);
+    }
+    if (ctx.dest_root_fd != -1) {
+        close(ctx.dest_root_fd);
+    }
+    copy_release_fds(&ctx, ROOT_FDS);
+    if (ctx.manifest) {
+        if (manifest_write(ctx.manifest) == -1) {
+            copy_report_error(&ctx, "Error writing manifest", ctx.opts.manifest, errno);
+        }
+        manifest_destroy(ctx.manifest);
+    }
+    if (ctx.opts.progress) {
+        progress_finish(&ctx, reporting ? &reporter : NULL);
+    }
+    return context_finish(&ctx);
+}
+
+// Directory being removed by delete_directory_parallel. Its descriptor is held only while it is
+// listed; once everything inside it is gone it is removed from its parent, which is opened again for
+// that, so the number of open directories stays under max_open_fds however deep the tree is.
+typedef struct rm_node {
+    struct rm_node *parent;     // Directory this one lives in, NULL for the root of the delete
+    copy_context_t *ctx;
+    work_pool_t *pool;
+    atomic_int pending;         // Subdirectories still being removed plus its own scan
+    int root_fd;                // Root of the delete, which every directory is opened beneath
+    dev_t dev;                  // Identity of the directory as listed, checked when it is reopened
+    ino_t ino;
+    char name[];                // Name in the parent, the whole path for the root
+} rm_node_t;
+
+// Function to build the path of an entry of a directory being removed, for an error message
+static char *rm_node_path(const rm_node_t *node, const char *name) {
+    size_t len = name ? strlen(name) + 1 : 0;
+    for (const rm_node_t *n = node; n; n = n->parent) {
+        len += strlen(n->name) + (n->parent ? 1 : 0);
+    }
+    char *path = malloc(len + 1);
+    if (!path) {
+        return NULL;
+    }
+
+    // Fill from the end: the entry's name, then each directory above it
+    char *end = path + len;
+    *end = '\0';
+    if (name) {
+        end -= strlen(name);
+        memcpy(end, name, strlen(name));
+        *--end = '/';
+    }
+    for (const rm_node_t *n = node; n; n = n->parent) {
+        size_t n_len = strlen(n->name);
+        end -= n_len;
+        memcpy(end, n->name, n_len);
+        if (n->parent) {
+            *--end = '/';
+        }
+    }
+    return path;
+}
+
+// Function to record a failed removal
+static void rm_report_error(rm_node_t *node, const char *what, const char *name, int err) {
+    char *path = rm_node_path(node, name);
+    copy_report_error(node->ctx, what, path ? path : (name ? name : node->name), err);
+    free(path);
+}
+
+// Function to allocate the node of a directory found inside parent (or of the root, without parent)
+static rm_node_t *rm_node_create(copy_context_t *ctx, work_pool_t *pool, rm_node_t *parent, const char *name) {
+    size_t len = strlen(name) + 1;
+    rm_node_t *node = malloc(sizeof(rm_node_t) + len);
+    if (!node) {
+        return NULL;
+    }
+    node->parent = parent;
+    node->ctx = ctx;
+    node->pool = pool;
+    atomic_init(&node->pending, 1); // The scan of the directory itself
+    node->root_fd = parent ? parent->root_fd : -1;
+    node->dev = 0;
+    node->ino = 0;
+    memcpy(node->name, name, len);
+    if (parent) {
+        atomic_fetch_add(&parent->pending, 1);
+    }
+    return node;
+}
+
+// Function to open the directory of a node by its path below the root of the delete
+static int rm_node_open(const rm_node_t *node, int flags) {
+    const rm_node_t *root = node;
+    while (root->parent) {
+        root = root->parent;
+    }
+    char *path = rm_node_path(node, NULL);
+    if (!path) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int fd = open_beneath_path(node->root_fd, path + strlen(root->name), flags);
+    int saved = errno;
+    free(path);
+    errno = saved;
+    return fd;
+}
+
+// Function to drop one outstanding task from a directory. A directory whose contents are all gone is
+// removed from its parent, which may complete in turn: the tree is removed bottom-up. A directory
+// that could not be listed is still tried, since it may be empty. The parent of the first directory
+// removed is opened by its path, those further up through ".." of the one below.
+static void rm_node_release(rm_node_t *node) {
+    copy_context_t *ctx = node->ctx;
+    int fd = -1;                // Directory of node when the previous level opened it
+    int holding = 0;
+    while (node && atomic_fetch_sub(&node->pending, 1) == 1) {
+        rm_node_t *parent = node->parent;
+        int parent_fd = AT_FDCWD;
+        if (parent) {
+            if (!holding) {
+                copy_acquire_fds(ctx, 2); // The directory of node and its parent
+                holding = 1;
+            }
+            parent_fd = fd != -1 ? reopen_parent(fd, O_PATH, parent->dev, parent->ino) : -1;
+            if (parent_fd == -1) {
+                parent_fd = rm_node_open(parent, O_PATH);
+            }
+        }
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+
+        if (parent_fd == -1) {
+            rm_report_error(node, "Error removing directory", NULL, errno);
+        } else if (unlinkat(parent_fd, node->name, AT_REMOVEDIR) == 0) {
+            atomic_fetch_add(&ctx->directories_removed, 1);
+        } else {
+            rm_report_error(node, "Error removing directory", NULL, errno);
+        }
+        if (parent) {
+            fd = parent_fd;
+        }
+        free(node);
+        node = parent;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (holding) {
+        copy_release_fds(ctx, 2);
+    }
+}
+
+// Task removing the entries of one directory. Files go right away; each subdirectory becomes a task
+// of its own, so wide and deep trees fan out across the pool.
+static void rm_scan_task(void *arg) {
+    rm_node_t *node = arg;
+    copy_context_t *ctx = node->ctx;
+
+    // The directory, and one more while a long path is opened piece by piece
+    copy_acquire_fds(ctx, 2);
+    int fd = rm_node_open(node, O_RDONLY);
+    if (fd == -1) {
+        rm_report_error(node, "Error opening directory", NULL, errno);
+        copy_release_fds(ctx, 2);
+        rm_node_release(node);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        node->dev = st.st_dev;
+        node->ino = st.st_ino;
+    }
+
+    dir_reader_t reader;
+    if (dir_reader_open(&reader, fd) == -1) {
+        rm_report_error(node, "Error reading directory", NULL, errno);
+        close(fd);
+        copy_release_fds(ctx, 2);
+        rm_node_release(node);
+        return;
+    }
+
+    dir_entry_t entry;
+    int status;
+    while ((status = dir_reader_next(&reader, &entry)) == 1) {
+        if (entry.type != DT_DIR) {
+            // Try it as a file first: a directory is refused with EISDIR, so no stat is needed
+            if (unlinkat(fd, entry.name, 0) == 0) {
+                atomic_fetch_add(&ctx->files_removed, 1);
+                continue;
+            }
+            if (errno != EISDIR) {
+                rm_report_error(node, "Error removing file", entry.name, errno);
+                continue;
+            }
+        }
+
+        rm_node_t *child = rm_node_create(ctx, node->pool, node, entry.name);
+        if (!child) {
+            rm_report_error(node, "Error queueing directory removal", entry.name, ENOMEM);
+            continue;
+        }
+        if (work_pool_submit(node->pool, rm_scan_task, child) == -1) {
+            // Could not queue it: it can still go from here if it happens to be empty
+            free(child);
+            atomic_fetch_sub(&node->pending, 1);
+            if (unlinkat(fd, entry.name, AT_REMOVEDIR) == 0) {
+                atomic_fetch_add(&ctx->directories_removed, 1);
+            } else {
+                rm_report_error(node, "Error queueing directory removal", entry.name, ENOMEM);
+            }
+        }
+    }
+    if (status == -1) {
+        rm_report_error(node, "Error reading directory", NULL, errno);
+    }
+    dir_reader_close(&reader);
+    close(fd);
+    copy_release_fds(ctx, 2);
+
+    rm_node_release(node);
+}
+
+// Function to remove a directory tree with a pool of worker threads
+int delete_directory_parallel(const char *path, const copytree_options_t *opts) {
+    struct stat path_stat;
+    if (lstat(path, &path_stat) == -1) {
+        perror("Error getting directory information");
+        return -1;
+    }
+    if (!S_ISDIR(path_stat.st_mode)) {
+        fprintf(stderr, "Error: %s is not a directory\n", path);
+        return -1;
+    }
+
+    work_pool_t *pool = work_pool_create(opts ? opts->num_threads : 0);
+    if (!pool) {
+        perror("Error starting worker threads");
+        return -1;
+    }
+
+    copy_context_t ctx;
+    context_init(&ctx, opts);
+    if (ctx.opts.max_open_fds < 3) {
+        // The root stays open for the whole delete, and a scan or a removal needs two more
+        ctx.opts.max_open_fds = 3;
+        ctx.fds_available = 3;
+    }
+
+    copy_acquire_fds(&ctx, 1);
+    int root_fd = open(path, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (root_fd == -1) {
+        copy_report_error(&ctx, "Error opening directory", path, errno);
+    } else {
+        rm_node_t *root = rm_node_create(&ctx, pool, NULL, path);
+        if (root) {
+            root->root_fd = root_fd;
+        }
+        if (!root || work_pool_submit(pool, rm_scan_task, root) == -1) {
+            copy_report_error(&ctx, "Error queueing directory removal", path, ENOMEM);
+            free(root);
+        }
+    }
+
+    work_pool_wait(pool);
+    work_pool_destroy(pool);
+    if (root_fd != -1) {
+        close(root_fd);
+    }
+    copy_release_fds(&ctx, 1);
+    return context_finish(&ctx);
+}
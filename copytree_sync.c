@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include "copytree_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+// Files at least this large are updated block by block when delta_blocks is set
+#define DELTA_MIN_SIZE (1024 * 1024)
+
+// Block size compared by the delta update
+#define DELTA_BLOCK_SIZE (64 * 1024)
+
+// Function to tell whether a destination file already holds an up to date copy of the source
+static int sync_is_current(const struct stat *src_stat, const struct stat *dest_stat) {
+    return S_ISREG(dest_stat->st_mode) &&
+           dest_stat->st_size == src_stat->st_size &&
+           dest_stat->st_mtim.tv_sec == src_stat->st_mtim.tv_sec &&
+           dest_stat->st_mtim.tv_nsec == src_stat->st_mtim.tv_nsec;
+}
+
+// Function to give the destination the source's modification time, so the next sync can skip it
+static int sync_copy_mtime(copy_context_t *ctx, const copy_entry_t *dest, const struct stat *src_stat) {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = src_stat->st_mtim;
+    if (utimensat(dest->dir_fd, dest->name, times, AT_SYMLINK_NOFOLLOW) == -1) {
+        copy_report_entry_error(ctx, "Error setting target modification time", dest, errno);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to tell whether two modification times are the same
+static int sync_same_time(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Function to tell whether the manifest of the previous run shows that an existing destination file
+// already holds the source's data although their times differ, as they do after a copy made without
+// sync or a touch of the source. The copy must be unchanged since the manifest was written; then
+// the data is known to match when the source is unchanged too, and otherwise is compared by the
+// checksum of the source, which costs one read instead of a rewrite.
+static int sync_manifest_match(copy_context_t *ctx, const copy_entry_t *src, const char *dest, const struct stat *src_stat,
+                               const struct stat *dest_stat, copy_manifest_record_t *record) {
+    if (!copy_manifest_lookup(ctx, dest, record) || record->size != src_stat->st_size ||
+        record->size != dest_stat->st_size || !sync_same_time(&record->dest_mtime, &dest_stat->st_mtim)) {
+        return 0;
+    }
+    if (sync_same_time(&record->src_mtime, &src_stat->st_mtim)) {
+        return 1;
+    }
+
+    int source_fd = openat(src->dir_fd, src->name, O_RDONLY | O_CLOEXEC);
+    if (source_fd == -1) {
+        return 0; // The regular path reports it
+    }
+    uint32_t crc;
+    posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int match = copy_crc_file(source_fd, src_stat->st_size, &crc) == 0 && crc == record->crc;
+    close(source_fd);
+    return match;
+}
+
+// Function to rewrite only the blocks of an existing destination that differ from the source,
+// then cut or extend it to the source's size. *crc receives the CRC32C of the source.
+static int sync_delta_update(copy_context_t *ctx, const copy_entry_t *src, const copy_entry_t *dest, uint32_t *crc) {
+    *crc = 0;
+    int source_fd = openat(src->dir_fd, src->name, O_RDONLY | O_CLOEXEC);
+    if (source_fd == -1) {
+        copy_report_entry_error(ctx, "Error opening source file", src, errno);
+        return -1;
+    }
+    int target_fd = openat(dest->dir_fd, dest->name, O_RDWR | O_CLOEXEC);
+    if (target_fd == -1) {
+        copy_report_entry_error(ctx, "Error opening target file", dest, errno);
+        close(source_fd);
+        return -1;
+    }
+
+    char *src_block = malloc(2 * DELTA_BLOCK_SIZE);
+    if (!src_block) {
+        copy_report_entry_error(ctx, "Error allocating delta buffers", dest, ENOMEM);
+        close(source_fd);
+        close(target_fd);
+        return -1;
+    }
+    char *dest_block = src_block + DELTA_BLOCK_SIZE;
+
+    int result = 0;
+    off_t offset = 0;
+    unsigned long long written = 0;
+    posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(target_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (;;) {
+        ssize_t src_len = pread(source_fd, src_block, DELTA_BLOCK_SIZE, offset);
+        if (src_len == -1) {
+            copy_report_entry_error(ctx, "Error reading from source file", src, errno);
+            result = -1;
+            break;
+        }
+        if (src_len == 0) {
+            break;
+        }
+        *crc = copytree_crc32c(*crc, src_block, (size_t)src_len);
+        ssize_t dest_len = pread(target_fd, dest_block, (size_t)src_len, offset);
+        if (dest_len == -1) {
+            copy_report_entry_error(ctx, "Error reading from target file", dest, errno);
+            result = -1;
+            break;
+        }
+        if (dest_len != src_len || memcmp(src_block, dest_block, (size_t)src_len) != 0) {
+            if (pwrite(target_fd, src_block, (size_t)src_len, offset) != src_len) {
+                copy_report_entry_error(ctx, "Error writing to target file", dest, errno);
+                result = -1;
+                break;
+            }
+            written += (unsigned long long)src_len;
+        }
+        offset += src_len;
+    }
+
+    if (result == 0 && ftruncate(target_fd, offset) == -1) {
+        copy_report_entry_error(ctx, "Error truncating target file", dest, errno);
+        result = -1;
+    }
+
+    // Read the whole copy back, the unchanged blocks as well as the rewritten ones
+    uint32_t copy_crc;
+    if (result == 0 && ctx->opts.verify) {
+        if (copy_crc_file(target_fd, offset, &copy_crc) == -1) {
+            copy_report_entry_error(ctx, "Error reading back target file", dest, errno);
+            result = -1;
+        } else if (copy_crc != *crc) {
+            copy_report_entry_error(ctx, "Error: Copy does not match the source (CRC32C mismatch)", dest, 0);
+            result = -1;
+        } else {
+            atomic_fetch_add(&ctx->files_verified, 1);
+        }
+    }
+
+    free(src_block);
+    close(source_fd);
+    if (close(target_fd) == -1 && result == 0) {
+        copy_report_entry_error(ctx, "Error closing target file", dest, errno);
+        result = -1;
+    }
+
+    if (result == 0) {
+        atomic_fetch_add(&ctx->files_copied, 1);
+        atomic_fetch_add(&ctx->bytes_copied, written);
+        atomic_fetch_add(&ctx->tier_files[COPY_TIER_READ_WRITE], 1);
+        atomic_fetch_add(&ctx->files_delta, 1);
+    }
+    return result;
+}
+
+// Function to bring one non-directory destination entry up to date with its source. dest_path is
+// the whole destination path, needed only when a manifest is kept.
+static int sync_update(copy_context_t *ctx, const copy_entry_t *src, const copy_entry_t *dest,
+                       const char *dest_path, const struct stat *src_stat) {
+    struct stat dest_stat;
+    int exists = fstatat(dest->dir_fd, dest->name, &dest_stat, AT_SYMLINK_NOFOLLOW) == 0;
+
+    copy_manifest_record_t record;
+    if (exists && S_ISREG(src_stat->st_mode) && sync_is_current(src_stat, &dest_stat)) {
+        atomic_fetch_add(&ctx->files_skipped, 1);
+        // Its manifest entry stays as long as it still describes both files
+        if (copy_manifest_lookup(ctx, dest_path, &record) && record.size == src_stat->st_size &&
+            sync_same_time(&record.src_mtime, &src_stat->st_mtim) &&
+            sync_same_time(&record.dest_mtime, &dest_stat.st_mtim)) {
+            copy_manifest_record(ctx, dest_path, &record);
+        }
+        // Contents match; only the permissions may have to follow the source
+        if (ctx->copy_permissions && (dest_stat.st_mode & 07777) != (src_stat->st_mode & 07777) &&
+            fchmodat(dest->dir_fd, dest->name, src_stat->st_mode, 0) == -1) {
+            copy_report_entry_error(ctx, "Error setting target file permissions", dest, errno);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (exists && S_ISLNK(src_stat->st_mode) && S_ISLNK(dest_stat.st_mode) && ctx->copy_symlinks) {
+        char src_target[PATH_MAX];
+        char dest_target[PATH_MAX];
+        ssize_t src_len = readlinkat(src->dir_fd, src->name, src_target, sizeof(src_target));
+        ssize_t dest_len = readlinkat(dest->dir_fd, dest->name, dest_target, sizeof(dest_target));
+        if (src_len >= 0 && src_len == dest_len && memcmp(src_target, dest_target, (size_t)src_len) == 0) {
+            atomic_fetch_add(&ctx->files_skipped, 1);
+            return 0;
+        }
+    }
+
+    if (exists && S_ISREG(src_stat->st_mode) && S_ISREG(dest_stat.st_mode) &&
+        sync_manifest_match(ctx, src, dest_path, src_stat, &dest_stat, &record)) {
+        // Same data: only the times, and maybe the permissions, have to follow the source
+        atomic_fetch_add(&ctx->files_skipped, 1);
+        if (ctx->copy_permissions && (dest_stat.st_mode & 07777) != (src_stat->st_mode & 07777) &&
+            fchmodat(dest->dir_fd, dest->name, src_stat->st_mode, 0) == -1) {
+            copy_report_entry_error(ctx, "Error setting target file permissions", dest, errno);
+            return -1;
+        }
+        record.src_mtime = src_stat->st_mtim;
+        record.dest_mtime = src_stat->st_mtim;
+        copy_manifest_record(ctx, dest_path, &record);
+    } else if (exists && ctx->opts.delta_blocks && S_ISREG(src_stat->st_mode) && S_ISREG(dest_stat.st_mode) &&
+               src_stat->st_size >= DELTA_MIN_SIZE) {
+        uint32_t crc;
+        if (sync_delta_update(ctx, src, dest, &crc) == -1) {
+            return -1;
+        }
+        if (ctx->copy_permissions && fchmodat(dest->dir_fd, dest->name, src_stat->st_mode, 0) == -1) {
+            copy_report_entry_error(ctx, "Error setting target file permissions", dest, errno);
+            return -1;
+        }
+        record.crc = crc;
+        record.size = src_stat->st_size;
+        record.src_mtime = src_stat->st_mtim;
+        record.dest_mtime = src_stat->st_mtim; // Set right below
+        copy_manifest_record(ctx, dest_path, &record);
+    } else {
+        // Anything else that is in the way is replaced by a fresh copy
+        if (exists && delete_path_at(dest->dir_fd, dest->name, DT_UNKNOWN) != 0) {
+            copy_report_entry_error(ctx, "Error removing outdated target entry", dest, errno);
+            return -1;
+        }
+        if (copy_file_entry_at(ctx, src, dest, src_stat, ctx->copy_symlinks, ctx->copy_permissions) == -1) {
+            return -1;
+        }
+    }
+
+    return S_ISREG(src_stat->st_mode) ? sync_copy_mtime(ctx, dest, src_stat) : 0;
+}
+
+// Function to bring one non-directory destination entry up to date with its source
+int sync_file_entry(copy_context_t *ctx, const copy_entry_t *src, const copy_entry_t *dest, const struct stat *src_stat) {
+    // The manifest is keyed by whole paths; nothing else needs them
+    char *dest_path = NULL;
+    if (ctx->manifest && !(dest_path = copy_entry_path(dest))) {
+        copy_report_entry_error(ctx, "Error looking up manifest entry", dest, ENOMEM);
+        return -1;
+    }
+    int result = sync_update(ctx, src, dest, dest_path, src_stat);
+    free(dest_path);
+    return result;
+}
+
+// Function to prepare the destination of a source directory for a sync: an existing directory is
+// reused, anything else in its place is removed. Returns 1 when an existing directory had to be made
+// writable, with its previous mode in *existing_mode, 0 when the directory is ready, -1 on error.
+int sync_directory_entry(copy_context_t *ctx, const copy_entry_t *dest, mode_t mode, mode_t *existing_mode) {
+    if (mkdirat(dest->dir_fd, dest->name, mode) == 0) {
+        return 0;
+    }
+    if (errno != EEXIST) {
+        copy_report_entry_error(ctx, "Error creating target directory", dest, errno);
+        return -1;
+    }
+
+    struct stat dest_stat;
+    if (fstatat(dest->dir_fd, dest->name, &dest_stat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(dest_stat.st_mode)) {
+        // Keep it writable until its contents are synced; the final mode is applied afterwards
+        if ((dest_stat.st_mode & S_IRWXU) == S_IRWXU) {
+            return 0;
+        }
+        if (fchmodat(dest->dir_fd, dest->name, dest_stat.st_mode | S_IRWXU, 0) == -1) {
+            copy_report_entry_error(ctx, "Error setting directory permissions", dest, errno);
+            return -1;
+        }
+        *existing_mode = dest_stat.st_mode & 07777;
+        return 1;
+    }
+
+    if (delete_path_at(dest->dir_fd, dest->name, DT_UNKNOWN) != 0 || mkdirat(dest->dir_fd, dest->name, mode) == -1) {
+        copy_report_entry_error(ctx, "Error replacing target entry with a directory", dest, errno);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to remove the entries of the destination directory dest_fd that no longer exist in the
+// source directory src_fd. dest_path names it in error messages.
+void sync_prune_directory(copy_context_t *ctx, int src_fd, int dest_fd, const char *dest_path) {
+    dir_reader_t reader;
+    if (dir_reader_open(&reader, dest_fd) == -1) {
+        copy_report_error(ctx, "Error opening target directory", dest_path, errno);
+        return;
+    }
+
+    dir_entry_t entry;
+    struct stat statbuf;
+    int status;
+    while ((status = dir_reader_next(&reader, &entry)) == 1) {
+        if (fstatat(src_fd, entry.name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
+            continue;
+        }
+
+        if (delete_path_at(dest_fd, entry.name, entry.type) != 0) {
+            copy_entry_t target = { dest_fd, entry.name, dest_path };
+            copy_report_entry_error(ctx, "Error removing target entry missing from source", &target, errno);
+            continue;
+        }
+        atomic_fetch_add(&ctx->entries_deleted, 1);
+    }
+    if (status == -1) {
+        copy_report_error(ctx, "Error reading target directory", dest_path, errno);
+    }
+    dir_reader_close(&reader);
+}
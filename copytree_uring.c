@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+#include "copytree_internal.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+// Submission queue entries reserved per file: read, write and the two closes
+#define URING_SQES_PER_FILE 4
+
+// Ring size, large enough for a full batch of files
+#define URING_ENTRIES (URING_BATCH_FILES * URING_SQES_PER_FILE)
+
+// user_data layout: file index in the high bits, operation in the low three bits
+enum {
+    URING_OP_OPEN_SRC,
+    URING_OP_OPEN_DEST,
+    URING_OP_READ,
+    URING_OP_WRITE,
+    URING_OP_CLOSE_SRC,
+    URING_OP_CLOSE_DEST,
+    URING_OP_STATX
+};
+
+// A minimal io_uring instance driven through the raw system calls
+typedef struct {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending;        // SQEs filled in but not yet handed to the kernel
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+
+    char *arena;                // Data buffers for one batch of small files
+} uring_t;
+
+// Per-thread ring, created on first use and torn down when the thread exits
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread uring_t *thread_ring = NULL;
+
+// Set once io_uring turned out to be unusable on this system
+static atomic_int uring_unavailable = 0;
+
+// Function to release a ring and its mappings
+static void uring_free(uring_t *ring) {
+    if (!ring) {
+        return;
+    }
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sq_ptr) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->arena);
+    free(ring);
+}
+
+// Thread exit destructor for the per-thread ring
+static void ring_destructor(void *ring) {
+    uring_free(ring);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_destructor);
+}
+
+// Function to check that the kernel implements every operation the engine submits
+static int uring_probe(int fd) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe) {
+        return -1;
+    }
+    int result = -1;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        static const int needed[] = {
+            IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE
+        };
+        result = 0;
+        for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+                result = -1;
+            }
+        }
+    }
+    free(probe);
+    return result;
+}
+
+// Function to set up a ring and map its queues
+static uring_t *uring_create(void) {
+    uring_t *ring = calloc(1, sizeof(uring_t));
+    if (!ring) {
+        return NULL;
+    }
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0 || uring_probe(ring->fd) == -1) {
+        uring_free(ring);
+        return NULL;
+    }
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        uring_free(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            uring_free(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring->arena = malloc((size_t)URING_BATCH_FILES * URING_SMALL_FILE_MAX);
+    if (!ring->arena) {
+        uring_free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+// Function to return the calling thread's ring, or NULL when io_uring cannot be used
+static uring_t *uring_get(void) {
+    if (thread_ring) {
+        return thread_ring;
+    }
+    if (atomic_load(&uring_unavailable)) {
+        return NULL;
+    }
+    pthread_once(&ring_key_once, ring_key_create);
+    thread_ring = uring_create();
+    if (!thread_ring) {
+        atomic_store(&uring_unavailable, 1);
+        return NULL;
+    }
+    pthread_setspecific(ring_key, thread_ring);
+    return thread_ring;
+}
+
+// Function to take the next free submission queue entry
+static struct io_uring_sqe *uring_sqe(uring_t *ring, unsigned char opcode, unsigned long long user_data) {
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->sq_pending++;
+    return sqe;
+}
+
+// Function to publish the pending entries, optionally waiting for wait_nr completions in the same call
+static int uring_submit(uring_t *ring, unsigned wait_nr) {
+    unsigned submitted = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submitted, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    for (;;) {
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd, submitted, wait_nr,
+                               wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Function to fetch one completion, waiting for it if necessary
+static int uring_wait_cqe(uring_t *ring, struct io_uring_cqe *out) {
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            *out = ring->cqes[head & *ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Function to convert the result of a statx call into a struct stat
+static void statx_to_stat(const struct statx *stx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = (off_t)stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = (blkcnt_t)stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+// Function to tell whether the io_uring engine can run on this system
+int copy_uring_available(void) {
+    return uring_get() != NULL;
+}
+
+// Function to lstat a batch of names in one directory with one submission
+int copy_uring_stat(int dir_fd, const char *const *names, struct stat *stats, int *errors, size_t count) {
+    uring_t *ring = uring_get();
+    if (!ring) {
+        return -1;
+    }
+
+    struct statx stx[URING_BATCH_FILES];
+    for (size_t base = 0; base < count; base += URING_BATCH_FILES) {
+        size_t n = count - base < URING_BATCH_FILES ? count - base : URING_BATCH_FILES;
+        for (size_t i = 0; i < n; i++) {
+            struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_STATX, (i << 3) | URING_OP_STATX);
+            sqe->fd = dir_fd;
+            sqe->addr = (unsigned long long)(uintptr_t)names[base + i];
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (unsigned long long)(uintptr_t)&stx[i];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        }
+        if (uring_submit(ring, (unsigned)n) == -1) {
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            struct io_uring_cqe cqe;
+            if (uring_wait_cqe(ring, &cqe) == -1) {
+                return -1;
+            }
+            size_t index = (size_t)(cqe.user_data >> 3);
+            errors[base + index] = cqe.res < 0 ? -cqe.res : 0;
+            if (cqe.res >= 0) {
+                statx_to_stat(&stx[index], &stats[base + index]);
+            }
+        }
+    }
+    return 0;
+}
+
+// Outcome of every operation submitted for one file of a batch
+typedef struct {
+    int src_fd;
+    int dest_fd;
+    int read_res;
+    int write_res;
+    int close_src_res;
+    int close_dest_res;
+    char *buffer;
+} uring_slot_t;
+
+// Function to copy a batch of small regular files. Opens go out in one submission; each file's
+// read, write and closes then go out as one linked chain, with every chain of the batch submitted
+// together. Files whose chain breaks (short read, failed write) are finished synchronously.
+int copy_uring_files(copy_context_t *ctx, const uring_file_t *files, size_t count) {
+    uring_t *ring = uring_get();
+    if (!ring) {
+        return -1;
+    }
+    if (count > URING_BATCH_FILES) {
+        count = URING_BATCH_FILES;
+    }
+
+    uring_slot_t slots[URING_BATCH_FILES];
+    char *next_buffer = ring->arena;
+    for (size_t i = 0; i < count; i++) {
+        slots[i].src_fd = -ENOENT;
+        slots[i].dest_fd = -ENOENT;
+        slots[i].read_res = 0;
+        slots[i].write_res = 0;
+        slots[i].close_src_res = -ECANCELED;
+        slots[i].close_dest_res = -ECANCELED;
+        slots[i].buffer = next_buffer;
+        next_buffer += files[i].st.st_size;
+    }
+
+    // Stage 1: open every source and target
+    for (size_t i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_OPENAT, (i << 3) | URING_OP_OPEN_SRC);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long long)(uintptr_t)files[i].src;
+        sqe->open_flags = O_RDONLY;
+
+        sqe = uring_sqe(ring, IORING_OP_OPENAT, (i << 3) | URING_OP_OPEN_DEST);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long long)(uintptr_t)files[i].dest;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        sqe->len = files[i].st.st_mode & 07777;
+    }
+    if (uring_submit(ring, (unsigned)(count * 2)) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < count * 2; i++) {
+        struct io_uring_cqe cqe;
+        if (uring_wait_cqe(ring, &cqe) == -1) {
+            return -1;
+        }
+        uring_slot_t *slot = &slots[cqe.user_data >> 3];
+        if ((cqe.user_data & 7) == URING_OP_OPEN_SRC) {
+            slot->src_fd = cqe.res;
+        } else {
+            slot->dest_fd = cqe.res;
+        }
+    }
+
+    // Stage 2: read -> write -> close source -> close target, linked per file
+    unsigned expected = 0;
+    for (size_t i = 0; i < count; i++) {
+        uring_slot_t *slot = &slots[i];
+        if (slot->src_fd < 0 || slot->dest_fd < 0) {
+            continue;
+        }
+        size_t size = (size_t)files[i].st.st_size;
+        if (size > 0) {
+            struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_READ, (i << 3) | URING_OP_READ);
+            sqe->fd = slot->src_fd;
+            sqe->addr = (unsigned long long)(uintptr_t)slot->buffer;
+            sqe->len = (unsigned)size;
+            sqe->off = 0;
+            sqe->flags = IOSQE_IO_LINK;
+
+            sqe = uring_sqe(ring, IORING_OP_WRITE, (i << 3) | URING_OP_WRITE);
+            sqe->fd = slot->dest_fd;
+            sqe->addr = (unsigned long long)(uintptr_t)slot->buffer;
+            sqe->len = (unsigned)size;
+            sqe->off = 0;
+            sqe->flags = IOSQE_IO_LINK;
+            expected += 2;
+        }
+        struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_CLOSE, (i << 3) | URING_OP_CLOSE_SRC);
+        sqe->fd = slot->src_fd;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_sqe(ring, IORING_OP_CLOSE, (i << 3) | URING_OP_CLOSE_DEST);
+        sqe->fd = slot->dest_fd;
+        expected += 2;
+    }
+    if (expected > 0 && uring_submit(ring, expected) == -1) {
+        return -1;
+    }
+    for (unsigned i = 0; i < expected; i++) {
+        struct io_uring_cqe cqe;
+        if (uring_wait_cqe(ring, &cqe) == -1) {
+            return -1;
+        }
+        uring_slot_t *slot = &slots[cqe.user_data >> 3];
+        switch (cqe.user_data & 7) {
+            case URING_OP_READ:
+                slot->read_res = cqe.res;
+                break;
+            case URING_OP_WRITE:
+                slot->write_res = cqe.res;
+                break;
+            case URING_OP_CLOSE_SRC:
+                slot->close_src_res = cqe.res;
+                break;
+            default:
+                slot->close_dest_res = cqe.res;
+                break;
+        }
+    }
+
+    // Stage 3: account for each file, finishing broken chains the synchronous way
+    for (size_t i = 0; i < count; i++) {
+        uring_slot_t *slot = &slots[i];
+        const uring_file_t *file = &files[i];
+
+        if (slot->src_fd < 0) {
+            if (slot->dest_fd >= 0) {
+                // The target only exists because it was opened in the same batch
+                close(slot->dest_fd);
+                unlink(file->dest);
+            }
+            copy_report_error(ctx, "Error opening source file", file->src, -slot->src_fd);
+            continue;
+        }
+        if (slot->dest_fd < 0) {
+            close(slot->src_fd);
+            copy_report_error(ctx, "Error opening target file", file->dest, -slot->dest_fd);
+            continue;
+        }
+
+        off_t size = file->st.st_size;
+        int copied = size == 0 || (slot->read_res == size && slot->write_res == size);
+        if (slot->close_src_res == -ECANCELED) {
+            close(slot->src_fd);
+        }
+        if (slot->close_dest_res == -ECANCELED) {
+            close(slot->dest_fd);
+        }
+        if (!copied) {
+            // The file changed size or the write fell short: redo it through the regular data path
+            copy_file_entry(ctx, file->src, file->dest, &file->st, ctx->copy_symlinks, ctx->copy_permissions);
+            continue;
+        }
+        if (slot->close_dest_res < 0 && slot->close_dest_res != -ECANCELED) {
+            copy_report_error(ctx, "Error closing target file", file->dest, -slot->close_dest_res);
+            continue;
+        }
+
+        atomic_fetch_add(&ctx->files_copied, 1);
+        atomic_fetch_add(&ctx->bytes_copied, (unsigned long long)size);
+        atomic_fetch_add(&ctx->tier_files[COPY_TIER_IO_URING], 1);
+
+        // Set permissions of the target file if copy_permissions is enabled
+        if (ctx->copy_permissions && chmod(file->dest, file->st.st_mode) == -1) {
+            copy_report_error(ctx, "Error setting target file permissions", file->dest, errno);
+        }
+    }
+
+    return 0;
+}
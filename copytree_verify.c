@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+#include "copytree_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// CRC32C (Castagnoli) polynomial, reflected
+#define CRC32C_POLY 0x82F63B78u
+
+// Bytes read at a time when a whole file is checksummed; a multiple of any O_DIRECT alignment
+#define VERIFY_READ_SIZE (1024 * 1024)
+#define VERIFY_ALIGN 4096
+
+// First line of a manifest file
+#define MANIFEST_HEADER "# copytree manifest 1\n"
+
+// Tables of the software CRC, eight bytes per step (slicing-by-8)
+static uint32_t crc_table[8][256];
+
+// Function type of the CRC implementations: crc is the running value without the final inversion
+typedef uint32_t (*crc_fn_t)(uint32_t crc, const unsigned char *data, size_t len);
+
+// Function to update a CRC without special instructions
+static uint32_t crc_software(uint32_t crc, const unsigned char *data, size_t len) {
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        crc = crc_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc; // Little-endian: the low four bytes take the running CRC
+        crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+              crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff] ^
+              crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff] ^
+              crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = crc_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Function to update a CRC eight bytes per instruction with the SSE4.2 crc32 instruction
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t crc64 = crc;
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+        len--;
+    }
+    return (uint32_t)crc64;
+}
+#endif
+
+// Implementation picked for this CPU on first use
+static crc_fn_t crc_update = crc_software;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// Function to build the software tables and pick the hardware CRC when the CPU has it
+static void crc_select(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        crc_table[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_update = crc_sse42;
+    }
+#endif
+}
+
+uint32_t copytree_crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc_once, crc_select);
+    return ~crc_update(~crc, data, len);
+}
+
+// Function to add len zero bytes to a CRC, for the holes of a sparse file
+uint32_t copy_crc_zeros(uint32_t crc, off_t len) {
+    static const unsigned char zeros[4096];
+    while (len > 0) {
+        size_t chunk = len > (off_t)sizeof(zeros) ? sizeof(zeros) : (size_t)len;
+        crc = copytree_crc32c(crc, zeros, chunk);
+        len -= (off_t)chunk;
+    }
+    return crc;
+}
+
+// Function to compute the CRC32C of the first size bytes of an open file. The reads are aligned, so
+// a descriptor left in O_DIRECT mode by the copy reads the data back from the device; one that
+// refuses them is switched back to the page cache. A file shorter than size fails with EIO.
+int copy_crc_file(int fd, off_t size, uint32_t *crc) {
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, VERIFY_ALIGN, VERIFY_READ_SIZE) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint32_t value = 0;
+    off_t offset = 0;
+    int result = 0;
+    while (offset < size) {
+        ssize_t n = pread(fd, buffer, VERIFY_READ_SIZE, offset);
+        if (n == -1) {
+            int flags;
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && (flags = fcntl(fd, F_GETFL)) != -1 && (flags & O_DIRECT) &&
+                fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        if (n == 0) {
+            errno = EIO;
+            result = -1;
+            break;
+        }
+        if (n > size - offset) {
+            n = size - offset;
+        }
+        value = copytree_crc32c(value, buffer, (size_t)n);
+        offset += n;
+    }
+
+    int saved_errno = errno;
+    free(buffer);
+    errno = saved_errno;
+    *crc = value;
+    return result;
+}
+
+// One file listed in a manifest
+typedef struct manifest_entry {
+    struct manifest_entry *next;
+    copy_manifest_record_t record;
+    char path[];                // Path relative to the root of the copy
+} manifest_entry_t;
+
+// Checksums of the files of a copy: those read from the previous manifest, looked up without a
+// lock once loading is done, and those of this run, collected under the lock
+struct copy_manifest {
+    char *path;                 // Manifest file
+    manifest_entry_t **buckets; // Previous entries by path
+    size_t bucket_count;
+    manifest_entry_t *previous; // Previous entries in file order, owning them
+    pthread_mutex_t lock;       // Protects entries and count
+    manifest_entry_t *entries;  // Entries of this run
+    size_t count;
+};
+
+// Function to hash a path for the table of previous entries (FNV-1a)
+static size_t manifest_hash(const char *path) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    return (size_t)h;
+}
+
+// Function to allocate an entry for path
+static manifest_entry_t *manifest_entry_create(const char *path, const copy_manifest_record_t *record) {
+    size_t len = strlen(path);
+    manifest_entry_t *entry = malloc(sizeof(manifest_entry_t) + len + 1);
+    if (entry) {
+        entry->next = NULL;
+        entry->record = *record;
+        memcpy(entry->path, path, len + 1);
+    }
+    return entry;
+}
+
+// Function to undo the escaping of a manifest path in place. Returns -1 on a malformed escape.
+static int manifest_unescape(char *path) {
+    char *out = path;
+    for (char *in = path; *in; in++) {
+        if (*in != '\\') {
+            *out++ = *in;
+            continue;
+        }
+        in++;
+        if (*in == '\\') {
+            *out++ = '\\';
+        } else if (*in == 'n') {
+            *out++ = '\n';
+        } else {
+            return -1;
+        }
+    }
+    *out = '\0';
+    return 0;
+}
+
+// Function to read the entries of an existing manifest into the table of previous entries. A
+// manifest that does not exist yet is empty; lines that cannot be parsed are ignored, so a damaged
+// manifest only costs the checks it would have saved.
+static int manifest_load(copy_manifest_t *manifest) {
+    FILE *file = fopen(manifest->path, "r");
+    if (!file) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t count = 0;
+    ssize_t len;
+    manifest_entry_t **tail = &manifest->previous;
+    while ((len = getline(&line, &line_size, file)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (line[0] == '#') {
+            continue;
+        }
+        copy_manifest_record_t record;
+        unsigned crc;
+        long long size, src_sec, dest_sec;
+        long src_nsec, dest_nsec;
+        int path_start = 0;
+        if (sscanf(line, "%8x %lld %lld.%9ld %lld.%9ld%n", &crc, &size, &src_sec, &src_nsec, &dest_sec,
+                   &dest_nsec, &path_start) != 6 || line[path_start] != ' ' || line[path_start + 1] == '\0' ||
+            manifest_unescape(line + ++path_start) == -1) {
+            continue;
+        }
+        record.crc = crc;
+        record.size = (off_t)size;
+        record.src_mtime.tv_sec = (time_t)src_sec;
+        record.src_mtime.tv_nsec = src_nsec;
+        record.dest_mtime.tv_sec = (time_t)dest_sec;
+        record.dest_mtime.tv_nsec = dest_nsec;
+        manifest_entry_t *entry = manifest_entry_create(line + path_start, &record);
+        if (!entry) {
+            free(line);
+            fclose(file);
+            errno = ENOMEM;
+            return -1;
+        }
+        *tail = entry;
+        tail = &entry->next;
+        count++;
+    }
+    free(line);
+    fclose(file);
+
+    // The table is built once every entry is known and never changes afterwards: open addressing by
+    // path hash, at most half full. The list through next keeps ownership of the entries.
+    manifest->bucket_count = 1;
+    while (manifest->bucket_count < count * 2) {
+        manifest->bucket_count *= 2;
+    }
+    manifest->buckets = calloc(manifest->bucket_count, sizeof(manifest_entry_t *));
+    if (!manifest->buckets) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t mask = manifest->bucket_count - 1;
+    for (manifest_entry_t *entry = manifest->previous; entry; entry = entry->next) {
+        size_t i = manifest_hash(entry->path) & mask;
+        while (manifest->buckets[i] && strcmp(manifest->buckets[i]->path, entry->path) != 0) {
+            i = (i + 1) & mask;
+        }
+        manifest->buckets[i] = entry; // A later line for the same path wins
+    }
+    return 0;
+}
+
+// Function to find the previous entry of a path
+static manifest_entry_t *manifest_find(const copy_manifest_t *manifest, const char *path) {
+    if (!manifest->buckets) {
+        return NULL;
+    }
+    size_t mask = manifest->bucket_count - 1;
+    for (size_t i = manifest_hash(path) & mask;; i = (i + 1) & mask) {
+        manifest_entry_t *entry = manifest->buckets[i];
+        if (!entry) {
+            return NULL;
+        }
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+}
+
+copy_manifest_t *manifest_open(const char *path, int load_previous) {
+    copy_manifest_t *manifest = calloc(1, sizeof(copy_manifest_t));
+    if (!manifest) {
+        return NULL;
+    }
+    manifest->path = strdup(path);
+    if (!manifest->path) {
+        free(manifest);
+        return NULL;
+    }
+    pthread_mutex_init(&manifest->lock, NULL);
+    if (load_previous && manifest_load(manifest) == -1) {
+        int saved_errno = errno;
+        manifest_destroy(manifest);
+        errno = saved_errno;
+        return NULL;
+    }
+    return manifest;
+}
+
+// Function to look up the previous entry of a path. Returns 1 and fills in record when there is one.
+static int manifest_lookup(const copy_manifest_t *manifest, const char *path, copy_manifest_record_t *record) {
+    const manifest_entry_t *entry = manifest_find(manifest, path);
+    if (!entry) {
+        return 0;
+    }
+    *record = entry->record;
+    return 1;
+}
+
+// Function to add an entry of this run
+static int manifest_add(copy_manifest_t *manifest, const char *path, const copy_manifest_record_t *record) {
+    manifest_entry_t *entry = manifest_entry_create(path, record);
+    if (!entry) {
+        return -1;
+    }
+    pthread_mutex_lock(&manifest->lock);
+    entry->next = manifest->entries;
+    manifest->entries = entry;
+    manifest->count++;
+    pthread_mutex_unlock(&manifest->lock);
+    return 0;
+}
+
+// Function to order manifest entries by path
+static int compare_entries(const void *a, const void *b) {
+    const manifest_entry_t *entry_a = *(const manifest_entry_t *const *)a;
+    const manifest_entry_t *entry_b = *(const manifest_entry_t *const *)b;
+    return strcmp(entry_a->path, entry_b->path);
+}
+
+// Function to write a path with backslashes and newlines escaped, so every entry is one line
+static void manifest_put_path(FILE *file, const char *path) {
+    for (const char *p = path; *p; p++) {
+        if (*p == '\\') {
+            fputs("\\\\", file);
+        } else if (*p == '\n') {
+            fputs("\\n", file);
+        } else {
+            fputc(*p, file);
+        }
+    }
+}
+
+int manifest_write(copy_manifest_t *manifest) {
+    manifest_entry_t **sorted = malloc((manifest->count ? manifest->count : 1) * sizeof(manifest_entry_t *));
+    if (!sorted) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t n = 0;
+    for (manifest_entry_t *entry = manifest->entries; entry; entry = entry->next) {
+        sorted[n++] = entry;
+    }
+    qsort(sorted, n, sizeof(manifest_entry_t *), compare_entries);
+
+    // Written next to the old manifest and renamed over it, so a crash leaves one or the other
+    size_t len = strlen(manifest->path) + 5;
+    char *temp_path = malloc(len);
+    if (!temp_path) {
+        free(sorted);
+        errno = ENOMEM;
+        return -1;
+    }
+    snprintf(temp_path, len, "%s.tmp", manifest->path);
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        int saved_errno = errno;
+        free(temp_path);
+        free(sorted);
+        errno = saved_errno;
+        return -1;
+    }
+
+    fputs(MANIFEST_HEADER, file);
+    for (size_t i = 0; i < n; i++) {
+        const copy_manifest_record_t *record = &sorted[i]->record;
+        fprintf(file, "%08x %lld %lld.%09ld %lld.%09ld ", (unsigned)record->crc, (long long)record->size,
+                (long long)record->src_mtime.tv_sec, (long)record->src_mtime.tv_nsec,
+                (long long)record->dest_mtime.tv_sec, (long)record->dest_mtime.tv_nsec);
+        manifest_put_path(file, sorted[i]->path);
+        fputc('\n', file);
+    }
+    free(sorted);
+
+    int result = fflush(file) == 0 && fsync(fileno(file)) == 0 ? 0 : -1;
+    int saved_errno = errno;
+    if (fclose(file) != 0 && result == 0) {
+        saved_errno = errno;
+        result = -1;
+    }
+    if (result == 0 && rename(temp_path, manifest->path) == -1) {
+        saved_errno = errno;
+        result = -1;
+    }
+    if (result == -1) {
+        unlink(temp_path);
+    }
+    free(temp_path);
+    errno = saved_errno;
+    return result;
+}
+
+// Function to free a list of entries
+static void manifest_free_list(manifest_entry_t *entry) {
+    while (entry) {
+        manifest_entry_t *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+}
+
+void manifest_destroy(copy_manifest_t *manifest) {
+    if (!manifest) {
+        return;
+    }
+    manifest_free_list(manifest->previous);
+    manifest_free_list(manifest->entries);
+    free(manifest->buckets);
+    free(manifest->path);
+    pthread_mutex_destroy(&manifest->lock);
+    free(manifest);
+}
+
+// Function to cut the destination root off a destination path
+static const char *manifest_relative(const copy_context_t *ctx, const char *dest) {
+    if (strlen(dest) <= ctx->dest_root_len) {
+        return NULL;
+    }
+    const char *path = dest + ctx->dest_root_len;
+    while (*path == '/') {
+        path++;
+    }
+    return *path ? path : NULL;
+}
+
+int copy_manifest_lookup(const copy_context_t *ctx, const char *dest, copy_manifest_record_t *record) {
+    const char *path = ctx && ctx->manifest ? manifest_relative(ctx, dest) : NULL;
+    return path ? manifest_lookup(ctx->manifest, path, record) : 0;
+}
+
+void copy_manifest_record(copy_context_t *ctx, const char *dest, const copy_manifest_record_t *record) {
+    const char *path = ctx && ctx->manifest ? manifest_relative(ctx, dest) : NULL;
+    if (path && manifest_add(ctx->manifest, path, record) == -1) {
+        copy_report_error(ctx, "Error adding file to manifest", dest, ENOMEM);
+    }
+}
+
+void copy_manifest_note(copy_context_t *ctx, const char *dest, int dest_fd, const struct stat *src_stat, uint32_t crc) {
+    if (!ctx || !ctx->manifest) {
+        return;
+    }
+    struct stat dest_stat;
+    if (fstat(dest_fd, &dest_stat) == -1) {
+        copy_report_error(ctx, "Error getting target file information", dest, errno);
+        return;
+    }
+    copy_manifest_record_t record;
+    record.crc = crc;
+    record.size = dest_stat.st_size;
+    record.src_mtime = src_stat->st_mtim;
+    // A sync gives the copy the source's modification time as soon as its data is in place
+    record.dest_mtime = ctx->opts.sync ? src_stat->st_mtim : dest_stat.st_mtim;
+    copy_manifest_record(ctx, dest, &record);
+}
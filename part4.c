@@ -2,20 +2,102 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <time.h>
 
 void print_usage(const char *prog_name) {
-    fprintf(stderr, "Usage: %s [-l] [-p] <source_directory> <destination_directory>\n", prog_name);
+    fprintf(stderr, "Usage: %s [-l] [-p] [-j threads] [-F max_fds] [-z] [-e sync|uring] [-s [-D] [-b]] [-H] [-d reflink|link] [-C drop|direct] [-o inode|physical] [-V] [-M manifest] [-P] <source_directory> <destination_directory>\n", prog_name);
+    fprintf(stderr, "       %s -R [-j threads] <directory>\n", prog_name);
+    fprintf(stderr, "       %s -O [-l] <source_directory> | %s -I [-p] <destination_directory>\n", prog_name, prog_name);
     fprintf(stderr, "  -l: Copy symbolic links as links\n");
     fprintf(stderr, "  -p: Copy file permissions\n");
+    fprintf(stderr, "  -j: Copy with a pool of worker threads (0 uses every CPU)\n");
+    fprintf(stderr, "  -F: Limit the number of files held open at once by the parallel copy\n");
+    fprintf(stderr, "  -z: Turn all-zero blocks into holes in the copies\n");
+    fprintf(stderr, "  -s: Sync into an existing destination, skipping files whose size and mtime match\n");
+    fprintf(stderr, "  -D: With -s, delete destination entries that no longer exist in the source\n");
+    fprintf(stderr, "  -b: With -s, rewrite only the changed blocks of large files\n");
+    fprintf(stderr, "  -e: System call engine of the parallel copy (uring batches small files through io_uring)\n");
+    fprintf(stderr, "  -H: Recreate hard links between source files instead of copying them again\n");
+    fprintf(stderr, "  -d: Reflink or hard-link files whose contents match a file copied before\n");
+    fprintf(stderr, "  -C: Keep copied data out of the page cache (drop: write back and drop behind, direct: O_DIRECT)\n");
+    fprintf(stderr, "  -R: Remove the directory tree instead of copying (rmtree mode)\n");
+    fprintf(stderr, "  -o: List each directory first and copy its files sorted by inode number or disk offset\n");
+    fprintf(stderr, "  -V: Verify every copy against a CRC32C of the source taken while copying\n");
+    fprintf(stderr, "  -M: Write the CRC32C of every copied file to a manifest; with -s, read it first to skip matching files\n");
+    fprintf(stderr, "  -O: Write the source directory to stdout as one stream (pack mode)\n");
+    fprintf(stderr, "  -I: Recreate the destination directory from a stream on stdin (unpack mode)\n");
+    fprintf(stderr, "  -P: Show progress and throughput of the parallel copy, then the slowest files\n");
+}
+
+// Function to print a progress report of the parallel copy. Periodic reports rewrite one status line
+// on stderr; the final one prints the totals per data path and the slowest files. arg points at a flag
+// that tells whether a status line is showing.
+static void print_progress(const copytree_progress_t *progress, void *arg) {
+    int *status_shown = arg;
+    if (!progress->final) {
+        fprintf(stderr, "\r%llu entries, %.1f MiB copied, %.0f entries/s, %.1f MB/s   ", progress->entries_done,
+                progress->bytes_copied / (1024.0 * 1024), progress->entries_per_second, progress->mb_per_second);
+        *status_shown = 1;
+        return;
+    }
+    if (*status_shown) {
+        fprintf(stderr, "\n");
+    }
+
+    printf("Copied %llu entries (%.1f MiB) in %.3f s (%.0f entries/s, %.1f MB/s)\n", progress->entries_done,
+           progress->bytes_copied / (1024.0 * 1024), progress->elapsed, progress->entries_per_second,
+           progress->mb_per_second);
+    for (int i = 0; i < COPY_TIER_COUNT; i++) {
+        if (progress->tier_files[i] > 0) {
+            printf("  %-16s %llu files\n", copytree_tier_name((copytree_tier_t)i), progress->tier_files[i]);
+        }
+    }
+    if (progress->slowest_count > 0) {
+        printf("Slowest files:\n");
+        for (size_t i = 0; i < progress->slowest_count; i++) {
+            printf("  %9.3f s %14lld bytes  %s\n", progress->slowest[i].seconds,
+                   (long long)progress->slowest[i].size, progress->slowest[i].path);
+        }
+    }
+}
+
+// Function to remove a directory tree with the parallel delete and report how fast it went
+static int remove_directory(const char *path, copytree_options_t *options) {
+    copytree_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    options->stats = &stats;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failures = delete_directory_parallel(path, options);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (failures == -1) {
+        return EXIT_FAILURE;
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    unsigned long long entries = stats.files_removed + stats.directories_removed;
+    printf("Removed %llu files and %llu directories in %.3f s (%.0f entries/s)\n",
+           stats.files_removed, stats.directories_removed, seconds, seconds > 0 ? entries / seconds : 0.0);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char *argv[]) {
     int opt;
     int copy_symlinks = 0;
     int copy_permissions = 0;
+    int parallel = 0;
+    int remove_tree = 0;
+    int pack = 0;
+    int unpack = 0;
+    int status_shown = 0;
+    copytree_options_t options;
+
+    copytree_options_init(&options);
 
     // Handle the flags
-    while ((opt = getopt(argc, argv, "lp")) != -1) {
+    while ((opt = getopt(argc, argv, "lpj:F:ze:sDbRHd:C:o:VM:POI")) != -1) {
         switch (opt) {
             case 'l':
                 copy_symlinks = 1;
@@ -23,13 +105,124 @@ int main(int argc, char *argv[]) {
             case 'p':
                 copy_permissions = 1;
                 break;
+            case 'j':
+                options.num_threads = atoi(optarg);
+                parallel = 1;
+                break;
+            case 'F':
+                options.max_open_fds = atoi(optarg);
+                parallel = 1;
+                break;
+            case 'z':
+                options.detect_zeros = 1;
+                parallel = 1;
+                break;
+            case 's':
+                options.sync = 1;
+                parallel = 1;
+                break;
+            case 'D':
+                options.delete_extraneous = 1;
+                break;
+            case 'b':
+                options.delta_blocks = 1;
+                break;
+            case 'R':
+                remove_tree = 1;
+                break;
+            case 'O':
+                pack = 1;
+                break;
+            case 'I':
+                unpack = 1;
+                break;
+            case 'H':
+                options.preserve_links = 1;
+                parallel = 1;
+                break;
+            case 'd':
+                if (strcmp(optarg, "reflink") == 0) {
+                    options.dedup = COPYTREE_DEDUP_REFLINK;
+                } else if (strcmp(optarg, "link") == 0) {
+                    options.dedup = COPYTREE_DEDUP_HARDLINK;
+                } else {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                parallel = 1;
+                break;
+            case 'C':
+                if (strcmp(optarg, "drop") == 0) {
+                    options.cache = COPYTREE_CACHE_DROP;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    options.cache = COPYTREE_CACHE_DIRECT;
+                } else {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                parallel = 1;
+                break;
+            case 'o':
+                if (strcmp(optarg, "inode") == 0) {
+                    options.order = COPYTREE_ORDER_INODE;
+                } else if (strcmp(optarg, "physical") == 0) {
+                    options.order = COPYTREE_ORDER_PHYSICAL;
+                } else {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                parallel = 1;
+                break;
+            case 'V':
+                options.verify = 1;
+                parallel = 1;
+                break;
+            case 'M':
+                options.manifest = optarg;
+                parallel = 1;
+                break;
+            case 'P':
+                options.progress = print_progress;
+                options.progress_arg = &status_shown;
+                parallel = 1;
+                break;
+            case 'e':
+                if (strcmp(optarg, "uring") == 0) {
+                    options.engine = COPYTREE_ENGINE_IO_URING;
+                } else if (strcmp(optarg, "sync") == 0) {
+                    options.engine = COPYTREE_ENGINE_SYNC;
+                } else {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                parallel = 1;
+                break;
             default:
                 print_usage(argv[0]);
                 return EXIT_FAILURE;
         }
     }
 
-    if (optind + 2 != argc) {
+    if (remove_tree) {
+        if (optind + 1 != argc) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return remove_directory(argv[optind], &options);
+    }
+
+    if (pack || unpack) {
+        if (optind + 1 != argc || (pack && unpack)) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        int failures = pack ? pack_directory(argv[optind], STDOUT_FILENO, copy_symlinks)
+                            : unpack_directory(STDIN_FILENO, argv[optind], copy_permissions);
+        return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // -D and -b only apply to a sync
+    if (optind + 2 != argc || ((options.delete_extraneous || options.delta_blocks) && !options.sync)) {
         print_usage(argv[0]);
         return EXIT_FAILURE;
     }
@@ -37,6 +230,21 @@ int main(int argc, char *argv[]) {
     const char *src_dir = argv[optind];
     const char *dest_dir = argv[optind + 1];
 
+    if (parallel) {
+        copytree_stats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        options.stats = &stats;
+        int failures = copy_directory_parallel(src_dir, dest_dir, copy_symlinks, copy_permissions, &options);
+        if (failures != -1 && (options.preserve_links || options.dedup != COPYTREE_DEDUP_NONE)) {
+            printf("Hard links recreated: %llu, duplicates linked: %llu, bytes saved: %llu\n",
+                   stats.files_linked, stats.files_deduplicated, stats.bytes_saved);
+        }
+        if (failures != -1 && options.verify) {
+            printf("Files verified: %llu\n", stats.files_verified);
+        }
+        return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     copy_directory(src_dir, dest_dir, copy_symlinks, copy_permissions);
 
     return 0;
@@ -0,0 +1,196 @@
+#include "buffered_open.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+// Threads appending at once and records each of them writes
+#define THREADS 8
+#define RECORDS 2000
+
+// Write buffer capacity of the handle. Small, so the ring of buffers wraps many times.
+#define CAPACITY 4096
+
+// Every LARGE_STRIDE-th record is larger than a buffer, every FLUSH_STRIDE-th write is followed by a flush
+#define LARGE_STRIDE 97
+#define FLUSH_STRIDE 50
+
+// Every record starts with "TT:SSSSSS:LLLLL:" and ends in a newline
+#define HEADER_LEN 16
+
+void print_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s <work_directory>\n", prog_name);
+}
+
+// One appending thread
+typedef struct {
+    buffered_file_t *bf;
+    int thread;
+    int failed;
+} writer_t;
+
+// Function to pick the payload length of a record
+static size_t payload_length(int thread, int seq) {
+    if (seq % LARGE_STRIDE == 0) {
+        return CAPACITY + 1000 + (size_t)thread * 100;
+    }
+    return 1 + (size_t)(seq * 37 + thread * 11) % 300;
+}
+
+// Function to give the payload byte at position i of a record
+static char payload_byte(int thread, int seq, size_t i) {
+    return (char)('a' + ((size_t)(thread * 31 + seq * 7) + i) % 26);
+}
+
+// Function to build the complete record into buf, which has room for any record. Returns its length.
+static size_t build_record(char *buf, int thread, int seq) {
+    size_t len = payload_length(thread, seq);
+    snprintf(buf, HEADER_LEN + 1, "%02d:%06d:%05zu:", thread, seq, len);
+    for (size_t i = 0; i < len; i++) {
+        buf[HEADER_LEN + i] = payload_byte(thread, seq, i);
+    }
+    buf[HEADER_LEN + len] = '\n';
+    return HEADER_LEN + len + 1;
+}
+
+// Function to append the records of one thread, flushing now and then from the middle of the stream
+static void *writer_thread(void *arg) {
+    writer_t *writer = arg;
+    char *record = malloc(HEADER_LEN + CAPACITY + 1000 + THREADS * 100 + 1);
+    if (!record) {
+        writer->failed = 1;
+        return NULL;
+    }
+    for (int seq = 0; seq < RECORDS && !writer->failed; seq++) {
+        size_t len = build_record(record, writer->thread, seq);
+        if (buffered_write(writer->bf, record, len) != (ssize_t)len) {
+            perror("buffered_write");
+            writer->failed = 1;
+        } else if (seq % FLUSH_STRIDE == FLUSH_STRIDE - 1 && buffered_flush(writer->bf) == -1) {
+            writer->failed = 1;
+        }
+    }
+    free(record);
+    return NULL;
+}
+
+// Function to read the whole file into memory. Returns NULL on error.
+static char *read_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat statbuf;
+    if (fd == -1 || fstat(fd, &statbuf) == -1) {
+        perror("open");
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char *data = malloc((size_t)statbuf.st_size + 1);
+    size_t total = 0;
+    while (data && total < (size_t)statbuf.st_size) {
+        ssize_t bytes_read = read(fd, data + total, (size_t)statbuf.st_size - total);
+        if (bytes_read <= 0) {
+            perror("read");
+            free(data);
+            data = NULL;
+            break;
+        }
+        total += (size_t)bytes_read;
+    }
+    close(fd);
+    if (data) {
+        data[total] = '\0';
+    }
+    *size = total;
+    return data;
+}
+
+// Function to walk the records of the file, checking each is unbroken and seen once. Returns the
+// number of good records, or -1 after the first broken or repeated one.
+static int check_records(const char *data, size_t size, unsigned char seen[THREADS][RECORDS]) {
+    size_t pos = 0;
+    int good = 0;
+    while (pos < size) {
+        int thread, seq;
+        size_t len;
+        if (size - pos < HEADER_LEN || sscanf(data + pos, "%2d:%6d:%5zu:", &thread, &seq, &len) != 3 ||
+            thread < 0 || thread >= THREADS || seq < 0 || seq >= RECORDS || len != payload_length(thread, seq) ||
+            size - pos < HEADER_LEN + len + 1 || data[pos + HEADER_LEN + len] != '\n') {
+            fprintf(stderr, "Broken record at offset %zu\n", pos);
+            return -1;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (data[pos + HEADER_LEN + i] != payload_byte(thread, seq, i)) {
+                fprintf(stderr, "Record %d:%d torn at offset %zu\n", thread, seq, pos + HEADER_LEN + i);
+                return -1;
+            }
+        }
+        if (seen[thread][seq]++) {
+            fprintf(stderr, "Record %d:%d written twice\n", thread, seq);
+            return -1;
+        }
+        pos += HEADER_LEN + len + 1;
+        good++;
+    }
+    return good;
+}
+
+// Function to report one check
+static int expect(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/concurrent_append.dat", argv[1]);
+
+    buffered_options_t opts;
+    buffered_options_init(&opts);
+    opts.write_buffer_size = CAPACITY;
+    opts.concurrent_append = 1;
+    buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &opts);
+    if (!bf) {
+        return EXIT_FAILURE;
+    }
+
+    pthread_t threads[THREADS];
+    writer_t writers[THREADS];
+    int started = 0;
+    for (; started < THREADS; started++) {
+        writers[started] = (writer_t){ bf, started, 0 };
+        if (pthread_create(&threads[started], NULL, writer_thread, &writers[started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    int write_failures = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        write_failures += writers[i].failed;
+    }
+
+    int failures = 0;
+    failures += expect(started == THREADS && write_failures == 0, "every thread appends all of its records");
+    failures += expect(buffered_close(bf) == 0, "buffered_close writes what is left");
+
+    size_t size;
+    char *data = read_file(path, &size);
+    static unsigned char seen[THREADS][RECORDS];
+    int good = data ? check_records(data, size, seen) : -1;
+    failures += expect(good != -1, "no record is torn, interleaved or repeated");
+    failures += expect(good == THREADS * RECORDS, "every record reaches the file");
+    free(data);
+    unlink(path);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
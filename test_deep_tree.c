@@ -0,0 +1,141 @@
+#include "copytree_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <linux/limits.h>
+
+// Levels of the generated tree. With 16-byte names the deepest path is far longer than PATH_MAX.
+#define TREE_DEPTH 1500
+
+// Descriptor limit the copies and deletes have to work under
+#define FD_LIMIT 64
+
+// Every FILE_STRIDE levels hold a small file
+#define FILE_STRIDE 100
+
+void print_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s <work_directory>\n", prog_name);
+}
+
+// Function to build a chain of TREE_DEPTH directories under root, holding at most two descriptors
+// at a time, with a file every FILE_STRIDE levels
+static int build_tree(const char *root) {
+    if (mkdir(root, 0755) == -1) {
+        perror("mkdir");
+        return -1;
+    }
+    int fd = open(root, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    for (int level = 0; level < TREE_DEPTH; level++) {
+        char name[32];
+        if (level % FILE_STRIDE == 0) {
+            snprintf(name, sizeof(name), "file_%d", level);
+            int file_fd = openat(fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (file_fd == -1 || write(file_fd, name, strlen(name)) != (ssize_t)strlen(name)) {
+                perror("write");
+                close(fd);
+                return -1;
+            }
+            close(file_fd);
+        }
+        snprintf(name, sizeof(name), "level_%010d", level);
+        if (mkdirat(fd, name, 0755) == -1) {
+            perror("mkdirat");
+            close(fd);
+            return -1;
+        }
+        int next = openat(fd, name, O_RDONLY | O_DIRECTORY);
+        close(fd);
+        if (next == -1) {
+            perror("openat");
+            return -1;
+        }
+        fd = next;
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to walk the chain under root and check that every level and file is there. Returns the
+// number of levels found.
+static int check_tree(const char *root) {
+    int fd = open(root, O_RDONLY | O_DIRECTORY);
+    int level = 0;
+    while (fd != -1 && level < TREE_DEPTH) {
+        char name[32];
+        if (level % FILE_STRIDE == 0) {
+            char data[32] = { 0 };
+            snprintf(name, sizeof(name), "file_%d", level);
+            int file_fd = openat(fd, name, O_RDONLY);
+            if (file_fd == -1 || read(file_fd, data, sizeof(data) - 1) <= 0 || strcmp(data, name) != 0) {
+                fprintf(stderr, "%s missing or wrong at level %d\n", name, level);
+                if (file_fd != -1) {
+                    close(file_fd);
+                }
+                break;
+            }
+            close(file_fd);
+        }
+        snprintf(name, sizeof(name), "level_%010d", level);
+        int next = openat(fd, name, O_RDONLY | O_DIRECTORY);
+        close(fd);
+        fd = next;
+        if (fd != -1) {
+            level++;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return level;
+}
+
+// Function to report one check
+static int expect(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char src[PATH_MAX];
+    char dest[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/deep_src", argv[1]);
+    snprintf(dest, sizeof(dest), "%s/deep_dest", argv[1]);
+    if (build_tree(src) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // Far fewer descriptors than the tree has levels
+    struct rlimit rl = { FD_LIMIT, FD_LIMIT };
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("setrlimit");
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    copy_directory(src, dest, 0, 1);
+    failures += expect(check_tree(dest) == TREE_DEPTH, "copy_directory copies every level");
+    failures += expect(delete_path(dest) == 0 && access(dest, F_OK) == -1, "delete_path removes the copy");
+    copytree_options_t opts;
+    copytree_options_init(&opts);
+    opts.num_threads = 4;
+    failures += expect(copy_directory_parallel(src, dest, 0, 1, &opts) == 0 && check_tree(dest) == TREE_DEPTH,
+                       "copy_directory_parallel copies every level");
+    failures += expect(delete_directory_parallel(dest, &opts) == 0 && access(dest, F_OK) == -1,
+                       "delete_directory_parallel removes the parallel copy");
+    failures += expect(delete_path(src) == 0 && access(src, F_OK) == -1, "delete_path removes the source");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
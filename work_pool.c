@@ -0,0 +1,273 @@
+#include "work_pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+// A queued unit of work
+typedef struct {
+    work_fn_t fn;
+    void *arg;
+} work_task_t;
+
+// Per-worker deque: the owner pushes and pops at the tail (LIFO, keeps traversals depth-first),
+// thieves take from the head (FIFO, steals the oldest and usually largest piece of work)
+typedef struct {
+    pthread_mutex_t lock;
+    work_task_t *tasks;         // Ring buffer of tasks
+    size_t capacity;            // Number of slots in the ring buffer (power of two)
+    size_t head;                // Index of the oldest task
+    size_t count;               // Number of tasks currently queued
+} work_deque_t;
+
+struct work_pool {
+    int num_threads;
+    pthread_t *threads;
+    work_deque_t *deques;
+
+    atomic_size_t queued;       // Tasks sitting in deques, used to decide when workers may sleep
+    atomic_size_t pending;      // Tasks submitted but not yet finished
+    atomic_uint next_deque;     // Round-robin cursor for submissions from outside the pool
+
+    pthread_mutex_t lock;       // Protects the condition variables and shutdown flag
+    pthread_cond_t work_cond;   // Signalled when work is queued or on shutdown
+    pthread_cond_t done_cond;   // Signalled when pending drops to zero
+    int shutdown;
+};
+
+// Identity of the calling thread inside its pool, so nested submissions stay local
+static __thread work_pool_t *current_pool = NULL;
+static __thread int current_worker = -1;
+
+// Function to push a task at the tail of a deque, growing the ring buffer if needed
+static int deque_push(work_deque_t *dq, work_task_t task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->capacity) {
+        size_t new_capacity = dq->capacity ? dq->capacity * 2 : 64;
+        work_task_t *tasks = malloc(new_capacity * sizeof(work_task_t));
+        if (!tasks) {
+            pthread_mutex_unlock(&dq->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        for (size_t i = 0; i < dq->count; i++) {
+            tasks[i] = dq->tasks[(dq->head + i) & (dq->capacity - 1)];
+        }
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->capacity = new_capacity;
+        dq->head = 0;
+    }
+    dq->tasks[(dq->head + dq->count) & (dq->capacity - 1)] = task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+// Function to pop the newest task (owner side)
+static int deque_pop(work_deque_t *dq, work_task_t *task) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        *task = dq->tasks[(dq->head + dq->count) & (dq->capacity - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// Function to steal the oldest task (thief side)
+static int deque_steal(work_deque_t *dq, work_task_t *task) {
+    int found = 0;
+    if (pthread_mutex_trylock(&dq->lock) != 0) {
+        return 0; // Contended, try another victim instead of waiting
+    }
+    if (dq->count > 0) {
+        *task = dq->tasks[dq->head];
+        dq->head = (dq->head + 1) & (dq->capacity - 1);
+        dq->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// Function to find the next task for a worker: own deque first, then steal round the others
+static int find_task(work_pool_t *pool, int self, work_task_t *task) {
+    if (deque_pop(&pool->deques[self], task)) {
+        return 1;
+    }
+    for (int i = 1; i < pool->num_threads; i++) {
+        if (deque_steal(&pool->deques[(self + i) % pool->num_threads], task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function run by every worker thread
+static void *worker_main(void *arg) {
+    work_pool_t *pool = arg;
+    int self;
+
+    pthread_mutex_lock(&pool->lock);
+    for (self = 0; !pthread_equal(pool->threads[self], pthread_self()); self++) {
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    current_pool = pool;
+    current_worker = self;
+
+    for (;;) {
+        work_task_t task;
+        if (find_task(pool, self, &task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            task.fn(task.arg);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->done_cond);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+
+        // Nothing to run or steal: sleep until something is queued
+        pthread_mutex_lock(&pool->lock);
+        while (atomic_load(&pool->queued) == 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        int stop = pool->shutdown && atomic_load(&pool->queued) == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Function to start a pool with the given number of workers
+work_pool_t *work_pool_create(int num_threads) {
+    if (num_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    work_pool_t *pool = calloc(1, sizeof(work_pool_t));
+    if (!pool) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pool->num_threads = num_threads;
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    pool->deques = calloc(num_threads, sizeof(work_deque_t));
+    if (!pool->threads || !pool->deques) {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+
+    // Hold the lock so workers can only look up their index once every thread id is stored
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < num_threads; i++) {
+        int err = pthread_create(&pool->threads[i], NULL, worker_main, pool);
+        if (err != 0) {
+            pool->num_threads = i;
+            pool->shutdown = 1;
+            pthread_cond_broadcast(&pool->work_cond);
+            pthread_mutex_unlock(&pool->lock);
+            for (int j = 0; j < i; j++) {
+                pthread_join(pool->threads[j], NULL);
+            }
+            for (int j = 0; j < num_threads; j++) {
+                pthread_mutex_destroy(&pool->deques[j].lock);
+            }
+            free(pool->threads);
+            free(pool->deques);
+            free(pool);
+            errno = err;
+            return NULL;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return pool;
+}
+
+// Function to queue a task on the pool
+int work_pool_submit(work_pool_t *pool, work_fn_t fn, void *arg) {
+    if (!pool || !fn) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int target = current_pool == pool
+        ? current_worker
+        : (int)(atomic_fetch_add(&pool->next_deque, 1) % (unsigned)pool->num_threads);
+
+    // Count the task before it becomes visible so waiters never see a premature zero
+    atomic_fetch_add(&pool->pending, 1);
+    work_task_t task = { fn, arg };
+    if (deque_push(&pool->deques[target], task) == -1) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+    }
+    atomic_fetch_add(&pool->queued, 1);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Function to block until all submitted work has finished
+void work_pool_wait(work_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to return the number of worker threads in the pool
+int work_pool_size(const work_pool_t *pool) {
+    return pool->num_threads;
+}
+
+// Function to stop the workers and release the pool
+void work_pool_destroy(work_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+}
@@ -0,0 +1,36 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Signature of a task executed by the pool
+typedef void (*work_fn_t)(void *arg);
+
+// Opaque pool of worker threads, each owning a work-stealing deque
+typedef struct work_pool work_pool_t;
+
+// Function to start a pool with the given number of workers (<= 0 selects the number of online CPUs)
+work_pool_t *work_pool_create(int num_threads);
+
+// Function to queue a task. Called from a worker it goes onto that worker's own deque,
+// otherwise the deques are filled round-robin. Returns 0 on success, -1 on failure.
+int work_pool_submit(work_pool_t *pool, work_fn_t fn, void *arg);
+
+// Function to block until every submitted task, including tasks submitted by tasks, has finished
+void work_pool_wait(work_pool_t *pool);
+
+// Function to return the number of worker threads in the pool
+int work_pool_size(const work_pool_t *pool);
+
+// Function to stop the workers and release the pool (pending tasks must have been waited for)
+void work_pool_destroy(work_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WORK_POOL_H